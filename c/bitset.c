@@ -1,16 +1,62 @@
-// gcc -Wall -g -ftest-coverage -fprofile-arcs -o bitset bitset.c
+// gcc -Wall -g -ftest-coverage -fprofile-arcs -o bitset bitset.c -lpthread
+// gcc -Wall -O2 -o bitset bitset.c -lpthread    (for the benchmarks)
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
 
 #define BITS_PER_LONG		(64)
 #define BIT_WORD(nr)        ((nr) / BITS_PER_LONG)
+#define BITS_TO_LONGS(nr)	(((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 #define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) & (BITS_PER_LONG - 1)))
 #define BITMAP_LAST_WORD_MASK(nbits) (~0UL >> (-(nbits) & (BITS_PER_LONG - 1)))
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 
-void __bitmap_set(unsigned long *map, unsigned int start, int len)
+#define __ALIGN_MASK(x, mask)	(((x) + (mask)) & ~(mask))
+#define round_down(x, y)	((x) & ~((__typeof__(x))((y) - 1)))
+#define min(x, y)		((x) < (y) ? (x) : (y))
+#define max(x, y)		((x) > (y) ? (x) : (y))
+
+#define DECLARE_BITMAP(name, bits)	unsigned long name[BITS_TO_LONGS(bits)]
+
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#endif
+
+/*
+ * Sizes known at compile time get inline versions of the common
+ * operations: a single word map is one expression, a map of up to
+ * BITMAP_FIXED_MAX_BITS bits a fully unrolled sequence of them.
+ */
+#define BITMAP_FIXED_MAX_BITS	512
+#define small_const_nbits(nbits) \
+	(__builtin_constant_p(nbits) && (nbits) <= BITS_PER_LONG && (nbits) > 0)
+#define fixed_const_nbits(nbits) \
+	(__builtin_constant_p(nbits) && (nbits) <= BITMAP_FIXED_MAX_BITS && (nbits) > 0)
+
+/* Bits scanned by one AVX2 compare */
+#define BITS_PER_YMM		(256)
+#define LONGS_PER_YMM		(BITS_PER_YMM / BITS_PER_LONG)
+
+/*
+ * Word at a time versions of __bitmap_set() and __bitmap_clear(), kept as
+ * the reference for the range self test.
+ */
+void __bitmap_set_loop(unsigned long *map, unsigned int start, int len)
 {
     unsigned long *p = map + BIT_WORD(start);
     const unsigned int size = start + len;
@@ -30,7 +76,7 @@ void __bitmap_set(unsigned long *map, unsigned int start, int len)
     }
 }
 
-void __bitmap_clear(unsigned long *map, unsigned int start, int len)
+void __bitmap_clear_loop(unsigned long *map, unsigned int start, int len)
 {
     unsigned long *p = map + BIT_WORD(start);
     const unsigned int size = start + len;
@@ -50,79 +96,3671 @@ void __bitmap_clear(unsigned long *map, unsigned int start, int len)
     }
 }
 
-int check_range(unsigned long map_size, unsigned int start, int len)
+/* Fills of at least this many bytes bypass the cache with streaming stores */
+#define BITMAP_NT_THRESHOLD	(4UL << 20)
+/* Words stored one by one rather than by memset() */
+#define BITMAP_FILL_INLINE	8
+
+static void bitmap_fill_words(unsigned long *p, unsigned long val, unsigned long nwords)
 {
-	if (start + len > map_size - 1) {
-		printf("%d + %d > %lu, What do you want me do?\n", start, len, map_size);
-		return 0;
+	__m128i v;
+
+	/* A call to memset() costs more than a few stores */
+	if (nwords < BITMAP_FILL_INLINE) {
+		while (nwords--)
+			*p++ = val;
+		return;
 	}
-	return 1;
+	if (nwords * sizeof(*p) < BITMAP_NT_THRESHOLD) {
+		memset(p, val ? 0xff : 0, nwords * sizeof(*p));
+		return;
+	}
+
+	/* movntdq wants a 16 bytes aligned destination */
+	if ((uintptr_t)p & 15) {
+		*p++ = val;
+		nwords--;
+	}
+	v = _mm_set1_epi64x(val);
+	for (; nwords >= 2; nwords -= 2, p += 2)
+		_mm_stream_si128((__m128i *)p, v);
+	if (nwords)
+		*p = val;
+	_mm_sfence();
 }
 
-int bitmap_set(unsigned long *map, unsigned long map_size, unsigned int start, int len)
+/*
+ * A range is split into the head word, the whole words in the middle
+ * filled by bitmap_fill_words() and the tail word. Ranges within a single
+ * word are handled inline by the callers, so they do not pay for the
+ * call.
+ */
+static void bitmap_fill_range(unsigned long *map, unsigned long start, unsigned long end,
+			      unsigned long val)
 {
-	int err = 0;
+	unsigned long first = BIT_WORD(start), last = BIT_WORD(end);
 
-	if (check_range(map_size, start, len))
-		__bitmap_set(map, start, len);
-	else
-		err = -1;
+	if (start % BITS_PER_LONG) {
+		if (val)
+			map[first] |= BITMAP_FIRST_WORD_MASK(start);
+		else
+			map[first] &= ~BITMAP_FIRST_WORD_MASK(start);
+		first++;
+	}
+	bitmap_fill_words(map + first, val, last - first);
+	if (end % BITS_PER_LONG) {
+		if (val)
+			map[last] |= BITMAP_LAST_WORD_MASK(end);
+		else
+			map[last] &= ~BITMAP_LAST_WORD_MASK(end);
+	}
+}
 
-	return err;
+void __bitmap_set(unsigned long *map, unsigned int start, unsigned int len)
+{
+	unsigned long end = (unsigned long)start + len;
+
+	if (!len)
+		return;
+	if (BIT_WORD(start) == BIT_WORD(end - 1))
+		map[BIT_WORD(start)] |= BITMAP_FIRST_WORD_MASK(start) & BITMAP_LAST_WORD_MASK(end);
+	else
+		bitmap_fill_range(map, start, end, ~0UL);
 }
 
-int bitmap_clear(unsigned long *map, unsigned long map_size, unsigned int start, int len)
+void __bitmap_clear(unsigned long *map, unsigned int start, unsigned int len)
 {
-	int err = 0;
+	unsigned long end = (unsigned long)start + len;
 
-	if (check_range(map_size, start, len))
-		__bitmap_clear(map, start, len);
+	if (!len)
+		return;
+	if (BIT_WORD(start) == BIT_WORD(end - 1))
+		map[BIT_WORD(start)] &= ~(BITMAP_FIRST_WORD_MASK(start) & BITMAP_LAST_WORD_MASK(end));
 	else
-		err = -1;
+		bitmap_fill_range(map, start, end, 0);
+}
 
-	return err;
+/*
+ * Bit search
+ *
+ * A word is scanned with tzcnt/lzcnt (__builtin_ctzl/__builtin_clzl), words
+ * with nothing to find are skipped 256 bits at a time with AVX2 when the
+ * CPU has it.
+ */
+
+/* Index of the lowest set bit, word must not be 0 */
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
 }
 
-void print_map(unsigned long *map, int n)
+/* Index of the highest set bit, word must not be 0 */
+static inline unsigned long __fls(unsigned long word)
 {
-	int i, j;
-	unsigned char *c;
+	return BITS_PER_LONG - 1 - __builtin_clzl(word);
+}
 
-	for (i = 0; i < n; i++) {
-		printf("map[%d]: 7: ", i);
+static int cpu_has_avx2(void)
+{
+	static int has_avx2 = -1;
 
-		c = (unsigned char *)&map[i];
-		//little endian
-		for (j = sizeof(*map) - 1; j > 0; j--)
-			printf("%02x ", c[j]);
+	if (has_avx2 < 0)
+		has_avx2 = __builtin_cpu_supports("avx2");
+	return has_avx2;
+}
 
-		printf(":0\n");
+/*
+ * Skip the blocks of 4 words that are all 0 (invert == 0) or all 1
+ * (invert == ~0UL), starting from word idx and stopping before word end.
+ * Return the index of the first word that may hold what we are looking for.
+ */
+__attribute__((target("avx2")))
+static unsigned long skip_words_avx2(const unsigned long *addr, unsigned long idx,
+				     unsigned long end, unsigned long invert)
+{
+	const __m256i ones = _mm256_set1_epi64x(-1);
+
+	if (invert) {
+		for (; idx + LONGS_PER_YMM <= end; idx += LONGS_PER_YMM) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(addr + idx));
+
+			if (!_mm256_testc_si256(v, ones))
+				break;
+		}
+	} else {
+		for (; idx + LONGS_PER_YMM <= end; idx += LONGS_PER_YMM) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(addr + idx));
+
+			if (!_mm256_testz_si256(v, v))
+				break;
+		}
 	}
+
+	return idx;
 }
 
-void print_bitmap(unsigned long *map, int n)
+/*
+ * Find the next set bit of addr ^ invert at or after start, return nbits
+ * if there is none
+ */
+static unsigned long __find_next_bit(const unsigned long *addr, unsigned long nbits,
+				     unsigned long start, unsigned long invert)
 {
-	printf("      Hi                Lo\n");
-	for (int i = 0; i < n; i++)
-		printf("map[%d]: %016lx\n", i, map[i]);
+	unsigned long tmp, idx;
+
+	if (start >= nbits)
+		return nbits;
+
+	idx = BIT_WORD(start);
+	tmp = (addr[idx] ^ invert) & BITMAP_FIRST_WORD_MASK(start);
+
+	while (!tmp) {
+		if (++idx >= BITS_TO_LONGS(nbits))
+			return nbits;
+		if (BITS_TO_LONGS(nbits) - idx >= LONGS_PER_YMM && cpu_has_avx2()) {
+			idx = skip_words_avx2(addr, idx, BITS_TO_LONGS(nbits), invert);
+			if (idx >= BITS_TO_LONGS(nbits))
+				return nbits;
+		}
+		tmp = addr[idx] ^ invert;
+	}
+
+	return min(idx * BITS_PER_LONG + __ffs(tmp), nbits);
 }
 
-int main()
+unsigned long _find_next_bit(const unsigned long *addr, unsigned long size,
+			     unsigned long offset)
 {
-	unsigned long map[8] = {0};
-	unsigned long map_size = sizeof(map) * 8; // Bit per char is 8
+	return __find_next_bit(addr, size, offset, 0UL);
+}
+
+unsigned long _find_next_zero_bit(const unsigned long *addr, unsigned long size,
+				  unsigned long offset)
+{
+	return __find_next_bit(addr, size, offset, ~0UL);
+}
+
+unsigned long _find_first_bit(const unsigned long *addr, unsigned long size)
+{
+	return __find_next_bit(addr, size, 0, 0UL);
+}
+
+unsigned long _find_first_zero_bit(const unsigned long *addr, unsigned long size)
+{
+	return __find_next_bit(addr, size, 0, ~0UL);
+}
+
+/*
+ * Find the last set bit, return size if there is none
+ */
+unsigned long _find_last_bit(const unsigned long *addr, unsigned long size)
+{
+	if (size) {
+		unsigned long val = BITMAP_LAST_WORD_MASK(size);
+		unsigned long idx = (size - 1) / BITS_PER_LONG;
+
+		do {
+			val &= addr[idx];
+			if (val)
+				return idx * BITS_PER_LONG + __fls(val);
+
+			val = ~0UL;
+		} while (idx--);
+	}
+	return size;
+}
+
+/*
+ * Constant size versions of the searches, the loop is unrolled and only
+ * the words from the one of start on are looked at.
+ */
+static __always_inline unsigned long fixed_find_next_bit(const unsigned long *addr,
+							 unsigned long nbits,
+							 unsigned long start,
+							 unsigned long invert)
+{
+	if (start >= nbits)
+		return nbits;
+
+#pragma GCC unroll 8
+	for (unsigned long k = 0; k < BITS_TO_LONGS(nbits); k++) {
+		unsigned long w = addr[k] ^ invert;
+
+		if (k < BIT_WORD(start))
+			continue;
+		if (k == BIT_WORD(start))
+			w &= BITMAP_FIRST_WORD_MASK(start);
+		if (k == BITS_TO_LONGS(nbits) - 1)
+			w &= BITMAP_LAST_WORD_MASK(nbits);
+		if (w)
+			return k * BITS_PER_LONG + __ffs(w);
+	}
+	return nbits;
+}
+
+static __always_inline unsigned long find_next_bit(const unsigned long *addr,
+						   unsigned long size, unsigned long offset)
+{
+	if (fixed_const_nbits(size))
+		return fixed_find_next_bit(addr, size, offset, 0UL);
+	return _find_next_bit(addr, size, offset);
+}
+
+static __always_inline unsigned long find_next_zero_bit(const unsigned long *addr,
+							unsigned long size, unsigned long offset)
+{
+	if (fixed_const_nbits(size))
+		return fixed_find_next_bit(addr, size, offset, ~0UL);
+	return _find_next_zero_bit(addr, size, offset);
+}
+
+static __always_inline unsigned long find_first_bit(const unsigned long *addr, unsigned long size)
+{
+	if (fixed_const_nbits(size))
+		return fixed_find_next_bit(addr, size, 0, 0UL);
+	return _find_first_bit(addr, size);
+}
+
+static __always_inline unsigned long find_first_zero_bit(const unsigned long *addr,
+							 unsigned long size)
+{
+	if (fixed_const_nbits(size))
+		return fixed_find_next_bit(addr, size, 0, ~0UL);
+	return _find_first_zero_bit(addr, size);
+}
+
+static __always_inline unsigned long find_last_bit(const unsigned long *addr, unsigned long size)
+{
+	if (small_const_nbits(size)) {
+		unsigned long val = *addr & BITMAP_LAST_WORD_MASK(size);
+
+		return val ? __fls(val) : size;
+	}
+	return _find_last_bit(addr, size);
+}
+
+/*
+ * Find a run of nr zero bits at or after start whose first bit index is
+ * aligned to align_mask + 1 (align_mask is 0 for no alignment).
+ *
+ * Return the index of the run. If there is no such run, the returned index
+ * + nr is beyond size, so the callers check "index + nr > size".
+ */
+unsigned long bitmap_find_next_zero_area(unsigned long *map, unsigned long size,
+					 unsigned long start, unsigned int nr,
+					 unsigned long align_mask)
+{
+	unsigned long index, end, i;
+again:
+	index = find_next_zero_bit(map, size, start);
+
+	index = __ALIGN_MASK(index, align_mask);
+
+	end = index + nr;
+	if (end > size)
+		return end;
+	i = find_next_bit(map, end, index);
+	if (i < end) {
+		start = i + 1;
+		goto again;
+	}
+	return index;
+}
+
+/*
+ * Atomic bit operations
+ *
+ * These may be used on a map shared between threads. Setting a bit is an
+ * acquire and clearing it a release, so a bit can guard the slot it stands
+ * for. Do not mix them with the non-atomic helpers on the same words.
+ */
+
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+
+static inline void set_bit(unsigned long nr, unsigned long *addr)
+{
+	__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_ACQUIRE);
+}
+
+static inline void clear_bit(unsigned long nr, unsigned long *addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_RELEASE);
+}
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr)
+{
+	return (__atomic_load_n(addr + BIT_WORD(nr), __ATOMIC_RELAXED) >> (nr % BITS_PER_LONG)) & 1;
+}
+
+/* Returns the old value of the bit */
+static inline int test_and_set_bit(unsigned long nr, unsigned long *addr)
+{
+	unsigned long mask = BIT_MASK(nr);
+
+	return (__atomic_fetch_or(addr + BIT_WORD(nr), mask, __ATOMIC_ACQUIRE) & mask) != 0;
+}
+
+static inline int test_and_clear_bit(unsigned long nr, unsigned long *addr)
+{
+	unsigned long mask = BIT_MASK(nr);
+
+	return (__atomic_fetch_and(addr + BIT_WORD(nr), ~mask, __ATOMIC_RELEASE) & mask) != 0;
+}
+
+/*
+ * Claim a zero bit of the first nbits bits and set it, scanning from the
+ * word of *hint and wrapping around. Each word is updated with a single
+ * CAS, a lost race just retries on the fresh value of that word.
+ *
+ * The hint is the caller's cursor: keep one per thread, started at
+ * different places, so the threads do not all fight over word 0. It is
+ * moved to the bit after the claimed one.
+ *
+ * Returns the bit number, or nbits if the map is full.
+ */
+unsigned long bitmap_claim_bit(unsigned long *map, unsigned long nbits, unsigned long *hint)
+{
+	unsigned long nwords = BITS_TO_LONGS(nbits);
+	unsigned long idx, k;
+
+	if (!nbits)
+		return nbits;
+
+	idx = *hint < nbits ? BIT_WORD(*hint) : 0;
+	for (k = 0; k < nwords; k++, idx = idx + 1 < nwords ? idx + 1 : 0) {
+		unsigned long mask = idx == nwords - 1 ? BITMAP_LAST_WORD_MASK(nbits) : ~0UL;
+		unsigned long old = __atomic_load_n(map + idx, __ATOMIC_RELAXED);
+
+		while (~old & mask) {
+			unsigned long bit = __ffs(~old & mask);
+
+			if (__atomic_compare_exchange_n(map + idx, &old, old | (1UL << bit), 0,
+							__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				bit += idx * BITS_PER_LONG;
+				*hint = bit + 1 < nbits ? bit + 1 : 0;
+				return bit;
+			}
+		}
+	}
+	return nbits;
+}
+
+static inline void bitmap_release_bit(unsigned long *map, unsigned long nr)
+{
+	clear_bit(nr, map);
+}
+
+/*
+ * Whole-map operations
+ *
+ * Every operation has a scalar, popcnt, AVX2 and AVX-512 flavour working on
+ * full words, the best one the CPU supports is picked on first use. The
+ * bitmap_*() wrappers take care of the last partial word.
+ */
+
+enum bitmap_impl {
+	BITMAP_IMPL_SCALAR,
+	BITMAP_IMPL_POPCNT,
+	BITMAP_IMPL_AVX2,
+	BITMAP_IMPL_AVX512,
+	BITMAP_IMPL_MAX,
+};
+
+struct bitmap_bulk_ops {
+	const char *name;
+	/* Binary operations return non-zero if any bit of dst is set */
+	unsigned long (*and)(unsigned long *dst, const unsigned long *b1,
+			     const unsigned long *b2, unsigned long nwords);
+	unsigned long (*or)(unsigned long *dst, const unsigned long *b1,
+			    const unsigned long *b2, unsigned long nwords);
+	unsigned long (*xor)(unsigned long *dst, const unsigned long *b1,
+			     const unsigned long *b2, unsigned long nwords);
+	unsigned long (*andnot)(unsigned long *dst, const unsigned long *b1,
+				const unsigned long *b2, unsigned long nwords);
+	unsigned long (*weight)(const unsigned long *src, unsigned long nwords);
+	int (*equal)(const unsigned long *b1, const unsigned long *b2, unsigned long nwords);
+	int (*intersects)(const unsigned long *b1, const unsigned long *b2, unsigned long nwords);
+};
+
+#define OP_AND(a, b)		((a) & (b))
+#define OP_OR(a, b)		((a) | (b))
+#define OP_XOR(a, b)		((a) ^ (b))
+#define OP_ANDNOT(a, b)		((a) & ~(b))
+
+#define DEFINE_BITMAP_OP_SCALAR(name, OP)					\
+static unsigned long name##_scalar(unsigned long *dst, const unsigned long *b1,	\
+				   const unsigned long *b2, unsigned long nwords) \
+{										\
+	unsigned long result = 0;						\
+										\
+	for (unsigned long k = 0; k < nwords; k++)				\
+		result |= (dst[k] = OP(b1[k], b2[k]));				\
+	return result;								\
+}
+
+DEFINE_BITMAP_OP_SCALAR(and, OP_AND)
+DEFINE_BITMAP_OP_SCALAR(or, OP_OR)
+DEFINE_BITMAP_OP_SCALAR(xor, OP_XOR)
+DEFINE_BITMAP_OP_SCALAR(andnot, OP_ANDNOT)
+
+/* Software popcount, lib/hweight.c */
+static inline unsigned long __sw_hweight64(unsigned long w)
+{
+	w -= (w >> 1) & 0x5555555555555555ul;
+	w =  (w & 0x3333333333333333ul) + ((w >> 2) & 0x3333333333333333ul);
+	w =  (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0ful;
+	return (w * 0x0101010101010101ul) >> 56;
+}
+
+static unsigned long weight_scalar(const unsigned long *src, unsigned long nwords)
+{
+	unsigned long w = 0;
+
+	for (unsigned long k = 0; k < nwords; k++)
+		w += __sw_hweight64(src[k]);
+	return w;
+}
+
+static int equal_scalar(const unsigned long *b1, const unsigned long *b2, unsigned long nwords)
+{
+	for (unsigned long k = 0; k < nwords; k++)
+		if (b1[k] != b2[k])
+			return 0;
+	return 1;
+}
+
+static int intersects_scalar(const unsigned long *b1, const unsigned long *b2, unsigned long nwords)
+{
+	for (unsigned long k = 0; k < nwords; k++)
+		if (b1[k] & b2[k])
+			return 1;
+	return 0;
+}
+
+__attribute__((target("popcnt")))
+static unsigned long weight_popcnt(const unsigned long *src, unsigned long nwords)
+{
+	unsigned long w = 0;
+
+	for (unsigned long k = 0; k < nwords; k++)
+		w += __builtin_popcountl(src[k]);
+	return w;
+}
+
+#define YMM_AND(a, b)		_mm256_and_si256(a, b)
+#define YMM_OR(a, b)		_mm256_or_si256(a, b)
+#define YMM_XOR(a, b)		_mm256_xor_si256(a, b)
+#define YMM_ANDNOT(a, b)	_mm256_andnot_si256(b, a)
+
+#define DEFINE_BITMAP_OP_AVX2(name, YMM_OP, OP)					\
+__attribute__((target("avx2")))							\
+static unsigned long name##_avx2(unsigned long *dst, const unsigned long *b1,	\
+				 const unsigned long *b2, unsigned long nwords)	\
+{										\
+	__m256i acc = _mm256_setzero_si256();					\
+	unsigned long result = 0, k = 0;					\
+										\
+	for (; k + LONGS_PER_YMM <= nwords; k += LONGS_PER_YMM) {		\
+		__m256i v = YMM_OP(_mm256_loadu_si256((const __m256i *)(b1 + k)), \
+				   _mm256_loadu_si256((const __m256i *)(b2 + k))); \
+										\
+		_mm256_storeu_si256((__m256i *)(dst + k), v);			\
+		acc = _mm256_or_si256(acc, v);					\
+	}									\
+	for (; k < nwords; k++)							\
+		result |= (dst[k] = OP(b1[k], b2[k]));				\
+	return result | !_mm256_testz_si256(acc, acc);				\
+}
+
+DEFINE_BITMAP_OP_AVX2(and, YMM_AND, OP_AND)
+DEFINE_BITMAP_OP_AVX2(or, YMM_OR, OP_OR)
+DEFINE_BITMAP_OP_AVX2(xor, YMM_XOR, OP_XOR)
+DEFINE_BITMAP_OP_AVX2(andnot, YMM_ANDNOT, OP_ANDNOT)
+
+/*
+ * Nibble lookup popcount with pshufb, the byte counts are summed up by
+ * psadbw (Mula et al.)
+ */
+__attribute__((target("avx2,popcnt")))
+static unsigned long weight_avx2(const unsigned long *src, unsigned long nwords)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+					     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	unsigned long w = 0, k = 0;
+
+	for (; k + LONGS_PER_YMM <= nwords; k += LONGS_PER_YMM) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + k));
+		__m256i lo = _mm256_and_si256(v, low_mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+		__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+					      _mm256_shuffle_epi8(lut, hi));
+
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+	}
+	w = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+	    _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+	for (; k < nwords; k++)
+		w += __builtin_popcountl(src[k]);
+	return w;
+}
+
+__attribute__((target("avx2")))
+static int equal_avx2(const unsigned long *b1, const unsigned long *b2, unsigned long nwords)
+{
+	unsigned long k = 0;
+
+	for (; k + LONGS_PER_YMM <= nwords; k += LONGS_PER_YMM) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(b1 + k)),
+					     _mm256_loadu_si256((const __m256i *)(b2 + k)));
+
+		if (!_mm256_testz_si256(v, v))
+			return 0;
+	}
+	return equal_scalar(b1 + k, b2 + k, nwords - k);
+}
+
+__attribute__((target("avx2")))
+static int intersects_avx2(const unsigned long *b1, const unsigned long *b2, unsigned long nwords)
+{
+	unsigned long k = 0;
+
+	for (; k + LONGS_PER_YMM <= nwords; k += LONGS_PER_YMM) {
+		if (!_mm256_testz_si256(_mm256_loadu_si256((const __m256i *)(b1 + k)),
+					_mm256_loadu_si256((const __m256i *)(b2 + k))))
+			return 1;
+	}
+	return intersects_scalar(b1 + k, b2 + k, nwords - k);
+}
+
+#define LONGS_PER_ZMM		(512 / BITS_PER_LONG)
+
+#define ZMM_AND(a, b)		_mm512_and_si512(a, b)
+#define ZMM_OR(a, b)		_mm512_or_si512(a, b)
+#define ZMM_XOR(a, b)		_mm512_xor_si512(a, b)
+#define ZMM_ANDNOT(a, b)	_mm512_andnot_si512(b, a)
+
+#define DEFINE_BITMAP_OP_AVX512(name, ZMM_OP, OP)				\
+__attribute__((target("avx512f")))						\
+static unsigned long name##_avx512(unsigned long *dst, const unsigned long *b1,	\
+				   const unsigned long *b2, unsigned long nwords) \
+{										\
+	__m512i acc = _mm512_setzero_si512();					\
+	unsigned long result = 0, k = 0;					\
+										\
+	for (; k + LONGS_PER_ZMM <= nwords; k += LONGS_PER_ZMM) {		\
+		__m512i v = ZMM_OP(_mm512_loadu_si512(b1 + k),			\
+				   _mm512_loadu_si512(b2 + k));			\
+										\
+		_mm512_storeu_si512(dst + k, v);				\
+		acc = _mm512_or_si512(acc, v);					\
+	}									\
+	for (; k < nwords; k++)							\
+		result |= (dst[k] = OP(b1[k], b2[k]));				\
+	return result | !!_mm512_test_epi64_mask(acc, acc);			\
+}
+
+DEFINE_BITMAP_OP_AVX512(and, ZMM_AND, OP_AND)
+DEFINE_BITMAP_OP_AVX512(or, ZMM_OR, OP_OR)
+DEFINE_BITMAP_OP_AVX512(xor, ZMM_XOR, OP_XOR)
+DEFINE_BITMAP_OP_AVX512(andnot, ZMM_ANDNOT, OP_ANDNOT)
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static unsigned long weight_avx512(const unsigned long *src, unsigned long nwords)
+{
+	__m512i acc = _mm512_setzero_si512();
+	unsigned long w, k = 0;
+
+	for (; k + LONGS_PER_ZMM <= nwords; k += LONGS_PER_ZMM)
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512(src + k)));
+	w = _mm512_reduce_add_epi64(acc);
+	for (; k < nwords; k++)
+		w += __builtin_popcountl(src[k]);
+	return w;
+}
+
+__attribute__((target("avx512f")))
+static int equal_avx512(const unsigned long *b1, const unsigned long *b2, unsigned long nwords)
+{
+	unsigned long k = 0;
+
+	for (; k + LONGS_PER_ZMM <= nwords; k += LONGS_PER_ZMM) {
+		if (_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(b1 + k),
+					     _mm512_loadu_si512(b2 + k)))
+			return 0;
+	}
+	return equal_scalar(b1 + k, b2 + k, nwords - k);
+}
+
+__attribute__((target("avx512f")))
+static int intersects_avx512(const unsigned long *b1, const unsigned long *b2, unsigned long nwords)
+{
+	unsigned long k = 0;
+
+	for (; k + LONGS_PER_ZMM <= nwords; k += LONGS_PER_ZMM) {
+		if (_mm512_test_epi64_mask(_mm512_loadu_si512(b1 + k),
+					   _mm512_loadu_si512(b2 + k)))
+			return 1;
+	}
+	return intersects_scalar(b1 + k, b2 + k, nwords - k);
+}
+
+static const struct bitmap_bulk_ops bitmap_bulk_ops_table[] = {
+	[BITMAP_IMPL_SCALAR] = {
+		"scalar", and_scalar, or_scalar, xor_scalar, andnot_scalar,
+		weight_scalar, equal_scalar, intersects_scalar,
+	},
+	[BITMAP_IMPL_POPCNT] = {
+		"popcnt", and_scalar, or_scalar, xor_scalar, andnot_scalar,
+		weight_popcnt, equal_scalar, intersects_scalar,
+	},
+	[BITMAP_IMPL_AVX2] = {
+		"avx2", and_avx2, or_avx2, xor_avx2, andnot_avx2,
+		weight_avx2, equal_avx2, intersects_avx2,
+	},
+	[BITMAP_IMPL_AVX512] = {
+		"avx512", and_avx512, or_avx512, xor_avx512, andnot_avx512,
+		weight_avx512, equal_avx512, intersects_avx512,
+	},
+};
+
+static int bitmap_impl_supported(enum bitmap_impl impl)
+{
+	switch (impl) {
+	case BITMAP_IMPL_SCALAR:
+		return 1;
+	case BITMAP_IMPL_POPCNT:
+		return __builtin_cpu_supports("popcnt");
+	case BITMAP_IMPL_AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+	case BITMAP_IMPL_AVX512:
+		return __builtin_cpu_supports("avx512f") &&
+		       __builtin_cpu_supports("avx512vpopcntdq") &&
+		       __builtin_cpu_supports("popcnt");
+	default:
+		return 0;
+	}
+}
+
+static const struct bitmap_bulk_ops *bulk_ops(void)
+{
+	static const struct bitmap_bulk_ops *ops;
+
+	if (!ops) {
+		int impl = BITMAP_IMPL_MAX - 1;
+
+		while (!bitmap_impl_supported(impl))
+			impl--;
+		ops = &bitmap_bulk_ops_table[impl];
+	}
+	return ops;
+}
+
+int __bitmap_and(unsigned long *dst, const unsigned long *bitmap1,
+		 const unsigned long *bitmap2, unsigned int bits)
+{
+	unsigned int lim = bits / BITS_PER_LONG;
+	unsigned long result = bulk_ops()->and(dst, bitmap1, bitmap2, lim);
+
+	if (bits % BITS_PER_LONG)
+		result |= (dst[lim] = bitmap1[lim] & bitmap2[lim] &
+			   BITMAP_LAST_WORD_MASK(bits));
+	return result != 0;
+}
+
+void __bitmap_or(unsigned long *dst, const unsigned long *bitmap1,
+		 const unsigned long *bitmap2, unsigned int bits)
+{
+	bulk_ops()->or(dst, bitmap1, bitmap2, BITS_TO_LONGS(bits));
+}
+
+void __bitmap_xor(unsigned long *dst, const unsigned long *bitmap1,
+		  const unsigned long *bitmap2, unsigned int bits)
+{
+	bulk_ops()->xor(dst, bitmap1, bitmap2, BITS_TO_LONGS(bits));
+}
+
+int __bitmap_andnot(unsigned long *dst, const unsigned long *bitmap1,
+		    const unsigned long *bitmap2, unsigned int bits)
+{
+	unsigned int lim = bits / BITS_PER_LONG;
+	unsigned long result = bulk_ops()->andnot(dst, bitmap1, bitmap2, lim);
+
+	if (bits % BITS_PER_LONG)
+		result |= (dst[lim] = bitmap1[lim] & ~bitmap2[lim] &
+			   BITMAP_LAST_WORD_MASK(bits));
+	return result != 0;
+}
 
-	if (!bitmap_set(map, map_size, 311, 68))
-		print_bitmap(map, ARRAY_SIZE(map));
+unsigned int __bitmap_weight(const unsigned long *src, unsigned int bits)
+{
+	unsigned int lim = bits / BITS_PER_LONG;
+	unsigned long w = bulk_ops()->weight(src, lim);
+
+	if (bits % BITS_PER_LONG)
+		w += __sw_hweight64(src[lim] & BITMAP_LAST_WORD_MASK(bits));
+	return w;
+}
 
-	if (!bitmap_set(map, map_size, 518, 88))
-		print_bitmap(map, ARRAY_SIZE(map));
+int __bitmap_equal(const unsigned long *bitmap1, const unsigned long *bitmap2,
+		   unsigned int bits)
+{
+	unsigned int lim = bits / BITS_PER_LONG;
 
-	if (!bitmap_set(map, map_size, 78, 168))
-		print_bitmap(map, ARRAY_SIZE(map));
+	if (!bulk_ops()->equal(bitmap1, bitmap2, lim))
+		return 0;
+	if (bits % BITS_PER_LONG)
+		if ((bitmap1[lim] ^ bitmap2[lim]) & BITMAP_LAST_WORD_MASK(bits))
+			return 0;
+	return 1;
+}
 
-	if (!bitmap_clear(map, map_size, 121, 18))
-		print_bitmap(map, ARRAY_SIZE(map));
+int __bitmap_intersects(const unsigned long *bitmap1, const unsigned long *bitmap2,
+			unsigned int bits)
+{
+	unsigned int lim = bits / BITS_PER_LONG;
 
+	if (bulk_ops()->intersects(bitmap1, bitmap2, lim))
+		return 1;
+	if (bits % BITS_PER_LONG)
+		if ((bitmap1[lim] & bitmap2[lim]) & BITMAP_LAST_WORD_MASK(bits))
+			return 1;
 	return 0;
 }
+
+/*
+ * Inline front ends of the whole-map operations. With a constant size of
+ * up to BITMAP_FIXED_MAX_BITS the loop over the words is unrolled,
+ * everything else goes to the dispatched versions above.
+ */
+
+#define FIXED_WORDS(nbits)	BITS_TO_LONGS(nbits)
+/* Mask of word k of a nbits bits map, ~0UL but for a partial last word */
+#define FIXED_MASK(k, nbits)	\
+	((k) == FIXED_WORDS(nbits) - 1 ? BITMAP_LAST_WORD_MASK(nbits) : ~0UL)
+
+static __always_inline void bitmap_zero(unsigned long *dst, unsigned int nbits)
+{
+	memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+/* Like the kernel's, the bits past nbits in the last word are cleared */
+static __always_inline void bitmap_fill(unsigned long *dst, unsigned int nbits)
+{
+	unsigned int nlongs = BITS_TO_LONGS(nbits);
+
+	if (!nlongs)
+		return;
+	memset(dst, 0xff, (nlongs - 1) * sizeof(unsigned long));
+	dst[nlongs - 1] = BITMAP_LAST_WORD_MASK(nbits);
+}
+
+static __always_inline void bitmap_copy(unsigned long *dst, const unsigned long *src,
+					unsigned int nbits)
+{
+	memcpy(dst, src, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static __always_inline int bitmap_and(unsigned long *dst, const unsigned long *src1,
+				      const unsigned long *src2, unsigned int nbits)
+{
+	if (fixed_const_nbits(nbits)) {
+		unsigned long result = 0;
+
+#pragma GCC unroll 8
+		for (unsigned int k = 0; k < FIXED_WORDS(nbits); k++)
+			result |= (dst[k] = src1[k] & src2[k] & FIXED_MASK(k, nbits));
+		return result != 0;
+	}
+	return __bitmap_and(dst, src1, src2, nbits);
+}
+
+static __always_inline void bitmap_or(unsigned long *dst, const unsigned long *src1,
+				      const unsigned long *src2, unsigned int nbits)
+{
+	if (fixed_const_nbits(nbits)) {
+#pragma GCC unroll 8
+		for (unsigned int k = 0; k < FIXED_WORDS(nbits); k++)
+			dst[k] = src1[k] | src2[k];
+		return;
+	}
+	__bitmap_or(dst, src1, src2, nbits);
+}
+
+static __always_inline void bitmap_xor(unsigned long *dst, const unsigned long *src1,
+				       const unsigned long *src2, unsigned int nbits)
+{
+	if (fixed_const_nbits(nbits)) {
+#pragma GCC unroll 8
+		for (unsigned int k = 0; k < FIXED_WORDS(nbits); k++)
+			dst[k] = src1[k] ^ src2[k];
+		return;
+	}
+	__bitmap_xor(dst, src1, src2, nbits);
+}
+
+static __always_inline int bitmap_andnot(unsigned long *dst, const unsigned long *src1,
+					 const unsigned long *src2, unsigned int nbits)
+{
+	if (fixed_const_nbits(nbits)) {
+		unsigned long result = 0;
+
+#pragma GCC unroll 8
+		for (unsigned int k = 0; k < FIXED_WORDS(nbits); k++)
+			result |= (dst[k] = src1[k] & ~src2[k] & FIXED_MASK(k, nbits));
+		return result != 0;
+	}
+	return __bitmap_andnot(dst, src1, src2, nbits);
+}
+
+/*
+ * Without popcnt the software count only beats the dispatched vector
+ * versions for a couple of words
+ */
+#ifdef __POPCNT__
+#define BITMAP_FIXED_WEIGHT_MAX_BITS	BITMAP_FIXED_MAX_BITS
+#define fixed_hweight64(w)		__builtin_popcountl(w)
+#else
+#define BITMAP_FIXED_WEIGHT_MAX_BITS	(2 * BITS_PER_LONG)
+#define fixed_hweight64(w)		__sw_hweight64(w)
+#endif
+
+static __always_inline unsigned int bitmap_weight(const unsigned long *src, unsigned int nbits)
+{
+	if (fixed_const_nbits(nbits) && nbits <= BITMAP_FIXED_WEIGHT_MAX_BITS) {
+		unsigned int w = 0;
+
+#pragma GCC unroll 8
+		for (unsigned int k = 0; k < FIXED_WORDS(nbits); k++)
+			w += fixed_hweight64(src[k] & FIXED_MASK(k, nbits));
+		return w;
+	}
+	return __bitmap_weight(src, nbits);
+}
+
+static __always_inline int bitmap_equal(const unsigned long *src1, const unsigned long *src2,
+					unsigned int nbits)
+{
+	if (fixed_const_nbits(nbits)) {
+		unsigned long diff = 0;
+
+#pragma GCC unroll 8
+		for (unsigned int k = 0; k < FIXED_WORDS(nbits); k++)
+			diff |= (src1[k] ^ src2[k]) & FIXED_MASK(k, nbits);
+		return !diff;
+	}
+	return __bitmap_equal(src1, src2, nbits);
+}
+
+static __always_inline int bitmap_intersects(const unsigned long *src1, const unsigned long *src2,
+					     unsigned int nbits)
+{
+	if (fixed_const_nbits(nbits)) {
+		unsigned long common = 0;
+
+#pragma GCC unroll 8
+		for (unsigned int k = 0; k < FIXED_WORDS(nbits); k++)
+			common |= src1[k] & src2[k] & FIXED_MASK(k, nbits);
+		return common != 0;
+	}
+	return __bitmap_intersects(src1, src2, nbits);
+}
+
+static __always_inline int bitmap_empty(const unsigned long *src, unsigned int nbits)
+{
+	if (small_const_nbits(nbits))
+		return !(*src & BITMAP_LAST_WORD_MASK(nbits));
+	return find_first_bit(src, nbits) >= nbits;
+}
+
+static __always_inline int bitmap_full(const unsigned long *src, unsigned int nbits)
+{
+	if (small_const_nbits(nbits))
+		return !(~*src & BITMAP_LAST_WORD_MASK(nbits));
+	return find_first_zero_bit(src, nbits) >= nbits;
+}
+
+/* Returns 0 if [start, start + len) fits in the map, -errno otherwise */
+static inline int check_range(unsigned long map_size, unsigned int start, int len)
+{
+	if (len < 0)
+		return -EINVAL;
+	if ((unsigned long)start + len > map_size)
+		return -ERANGE;
+	return 0;
+}
+
+/* A constant range within one word is a single or/and-not */
+#define const_word_range(start, len)						\
+	(__builtin_constant_p(start) && __builtin_constant_p(len) && (len) > 0 &&	\
+	 BIT_WORD(start) == BIT_WORD((start) + (len) - 1))
+
+static __always_inline int bitmap_set(unsigned long *map, unsigned long map_size,
+				      unsigned int start, int len)
+{
+	int err = check_range(map_size, start, len);
+
+	if (err)
+		return err;
+	if (const_word_range(start, len))
+		map[BIT_WORD(start)] |= BITMAP_FIRST_WORD_MASK(start) &
+					BITMAP_LAST_WORD_MASK(start + len);
+	else
+		__bitmap_set(map, start, len);
+	return 0;
+}
+
+static __always_inline int bitmap_clear(unsigned long *map, unsigned long map_size,
+					unsigned int start, int len)
+{
+	int err = check_range(map_size, start, len);
+
+	if (err)
+		return err;
+	if (const_word_range(start, len))
+		map[BIT_WORD(start)] &= ~(BITMAP_FIRST_WORD_MASK(start) &
+					  BITMAP_LAST_WORD_MASK(start + len));
+	else
+		__bitmap_clear(map, start, len);
+	return 0;
+}
+
+/*
+ * Hierarchical bitmap
+ *
+ * For large and sparse maps. Two summaries sit on top of the leaf words:
+ * bit i of any.level[0] says leaf word i has a set bit, bit i of
+ * free.level[0] says it has a zero bit. Every level above summarizes the
+ * non-zero words of the level below, up to a single word, so finding the
+ * next set or zero bit reads one word per level instead of scanning the
+ * leaves. The range operations have the semantics of bitmap_set() and
+ * bitmap_clear(), which limits a map to UINT_MAX bits.
+ */
+
+#define HBITMAP_MAX_LEVELS	6
+
+struct hbitmap_summary {
+	int nr_levels;
+	unsigned long nwords[HBITMAP_MAX_LEVELS];
+	unsigned long *level[HBITMAP_MAX_LEVELS];
+};
+
+struct hbitmap {
+	unsigned long nbits;
+	unsigned long nwords;
+	unsigned long *map;
+	struct hbitmap_summary any;
+	struct hbitmap_summary free;
+};
+
+static inline void __assign_bit(unsigned long nr, unsigned long *addr, int val)
+{
+	if (val)
+		addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+	else
+		addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static int summary_init(struct hbitmap_summary *s, unsigned long nwords, int val)
+{
+	int l;
+
+	for (l = 0; l < HBITMAP_MAX_LEVELS; l++) {
+		unsigned long nbits = nwords;
+
+		nwords = BITS_TO_LONGS(nbits);
+		s->level[l] = calloc(nwords, sizeof(unsigned long));
+		if (!s->level[l])
+			return -ENOMEM;
+		s->nwords[l] = nwords;
+		s->nr_levels = l + 1;
+		if (val)
+			__bitmap_set(s->level[l], 0, nbits);
+		if (nwords == 1)
+			return 0;
+	}
+	return -EINVAL;
+}
+
+static void summary_destroy(struct hbitmap_summary *s)
+{
+	for (int l = 0; l < s->nr_levels; l++)
+		free(s->level[l]);
+	s->nr_levels = 0;
+}
+
+/* Bits [lo, hi] of level l changed, bring the levels above up to date */
+static void summary_propagate(struct hbitmap_summary *s, int l, unsigned long lo, unsigned long hi)
+{
+	for (; l + 1 < s->nr_levels; l++) {
+		const unsigned long *lv = s->level[l];
+		unsigned long *up = s->level[l + 1];
+
+		lo = BIT_WORD(lo);
+		hi = BIT_WORD(hi);
+		for (unsigned long w = lo; w <= hi; w++)
+			__assign_bit(w, up, lv[w] != 0);
+	}
+}
+
+/* Smallest set bit >= idx of level 0, or ~0UL */
+static unsigned long summary_next(const struct hbitmap_summary *s, unsigned long idx)
+{
+	unsigned long w;
+	int l = 0;
+
+	for (;;) {
+		if (l == s->nr_levels || BIT_WORD(idx) >= s->nwords[l])
+			return ~0UL;
+		w = s->level[l][BIT_WORD(idx)] & BITMAP_FIRST_WORD_MASK(idx);
+		if (w)
+			break;
+		idx = BIT_WORD(idx) + 1;
+		l++;
+	}
+
+	idx = round_down(idx, BITS_PER_LONG) + __ffs(w);
+	while (l-- > 0)
+		idx = idx * BITS_PER_LONG + __ffs(s->level[l][idx]);
+	return idx;
+}
+
+void hbitmap_destroy(struct hbitmap *hb)
+{
+	summary_destroy(&hb->any);
+	summary_destroy(&hb->free);
+	free(hb->map);
+	hb->map = NULL;
+}
+
+/* Returns 0, -EINVAL for more than UINT_MAX bits or -ENOMEM */
+int hbitmap_init(struct hbitmap *hb, unsigned long nbits)
+{
+	memset(hb, 0, sizeof(*hb));
+	if (!nbits || nbits > UINT_MAX)
+		return -EINVAL;
+
+	hb->nbits = nbits;
+	hb->nwords = BITS_TO_LONGS(nbits);
+	hb->map = calloc(hb->nwords, sizeof(unsigned long));
+	if (!hb->map || summary_init(&hb->any, hb->nwords, 0) ||
+	    summary_init(&hb->free, hb->nwords, 1)) {
+		hbitmap_destroy(hb);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int hbitmap_word_full(const struct hbitmap *hb, unsigned long idx)
+{
+	unsigned long mask = idx == hb->nwords - 1 ? BITMAP_LAST_WORD_MASK(hb->nbits) : ~0UL;
+
+	return (hb->map[idx] & mask) == mask;
+}
+
+/*
+ * Leaf words first..last were changed by a range operation, the ones
+ * strictly in between are now all ones or all zeros.
+ */
+static void hbitmap_update(struct hbitmap *hb, unsigned long first, unsigned long last, int set)
+{
+	if (last - first > 1) {
+		if (set) {
+			__bitmap_set(hb->any.level[0], first + 1, last - first - 1);
+			__bitmap_clear(hb->free.level[0], first + 1, last - first - 1);
+		} else {
+			__bitmap_clear(hb->any.level[0], first + 1, last - first - 1);
+			__bitmap_set(hb->free.level[0], first + 1, last - first - 1);
+		}
+	}
+	__assign_bit(first, hb->any.level[0], hb->map[first] != 0);
+	__assign_bit(first, hb->free.level[0], !hbitmap_word_full(hb, first));
+	__assign_bit(last, hb->any.level[0], hb->map[last] != 0);
+	__assign_bit(last, hb->free.level[0], !hbitmap_word_full(hb, last));
+
+	summary_propagate(&hb->any, 0, first, last);
+	summary_propagate(&hb->free, 0, first, last);
+}
+
+static int hbitmap_check_range(const struct hbitmap *hb, unsigned long start, unsigned long len)
+{
+	if (start > hb->nbits || len > hb->nbits - start)
+		return -ERANGE;
+	return 0;
+}
+
+int hbitmap_set(struct hbitmap *hb, unsigned long start, unsigned long len)
+{
+	int err = hbitmap_check_range(hb, start, len);
+
+	if (!err && len) {
+		__bitmap_set(hb->map, start, len);
+		hbitmap_update(hb, BIT_WORD(start), BIT_WORD(start + len - 1), 1);
+	}
+	return err;
+}
+
+int hbitmap_clear(struct hbitmap *hb, unsigned long start, unsigned long len)
+{
+	int err = hbitmap_check_range(hb, start, len);
+
+	if (!err && len) {
+		__bitmap_clear(hb->map, start, len);
+		hbitmap_update(hb, BIT_WORD(start), BIT_WORD(start + len - 1), 0);
+	}
+	return err;
+}
+
+static inline int hbitmap_test_bit(const struct hbitmap *hb, unsigned long nr)
+{
+	return (hb->map[BIT_WORD(nr)] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+/* Both return hb->nbits if there is no such bit */
+unsigned long hbitmap_find_next_bit(const struct hbitmap *hb, unsigned long start)
+{
+	unsigned long idx, w;
+
+	if (start >= hb->nbits)
+		return hb->nbits;
+
+	idx = BIT_WORD(start);
+	w = hb->map[idx] & BITMAP_FIRST_WORD_MASK(start);
+	if (!w) {
+		idx = summary_next(&hb->any, idx + 1);
+		if (idx >= hb->nwords)
+			return hb->nbits;
+		w = hb->map[idx];
+	}
+	return min(idx * BITS_PER_LONG + __ffs(w), hb->nbits);
+}
+
+unsigned long hbitmap_find_next_zero_bit(const struct hbitmap *hb, unsigned long start)
+{
+	unsigned long idx, w;
+
+	if (start >= hb->nbits)
+		return hb->nbits;
+
+	idx = BIT_WORD(start);
+	w = ~hb->map[idx] & BITMAP_FIRST_WORD_MASK(start);
+	if (!w) {
+		idx = summary_next(&hb->free, idx + 1);
+		if (idx >= hb->nwords)
+			return hb->nbits;
+		w = ~hb->map[idx];
+	}
+	return min(idx * BITS_PER_LONG + __ffs(w), hb->nbits);
+}
+
+/*
+ * Compressed bitmap
+ *
+ * Roaring style: the 32 bit positions are split into 64K bit chunks by
+ * their high 16 bits, and every non-empty chunk is kept in the smallest
+ * of three containers: a sorted array of the set positions, a plain 8KB
+ * bitmap or a list of runs. Long runs from __bitmap_set() take 4 bytes
+ * each, a fully set chunk is a single run.
+ *
+ * A partially covered chunk is expanded into a flat bitmap, changed with
+ * the flat helpers and encoded again; whole chunks are set or dropped
+ * directly.
+ */
+
+#define RB_CHUNK_BITS		(1UL << 16)
+#define RB_CHUNK_WORDS		(RB_CHUNK_BITS / BITS_PER_LONG)
+#define RB_ARRAY_MAX		4096
+
+enum rb_type {
+	RB_ARRAY,
+	RB_BITMAP,
+	RB_RUN,
+};
+
+/* Bits start..last, both included */
+struct rb_run {
+	uint16_t start;
+	uint16_t last;
+};
+
+struct rb_container {
+	uint16_t key;
+	uint8_t type;
+	/* Set bits, 1..RB_CHUNK_BITS */
+	uint32_t card;
+	/* Array entries or runs, unused by bitmaps */
+	uint32_t n;
+	union {
+		uint16_t *array;
+		unsigned long *bitmap;
+		struct rb_run *runs;
+		void *data;
+	};
+};
+
+struct roaring {
+	unsigned int n;
+	unsigned int cap;
+	struct rb_container *c;
+};
+
+static size_t rb_data_size(const struct rb_container *c)
+{
+	switch (c->type) {
+	case RB_ARRAY:
+		return c->n * sizeof(uint16_t);
+	case RB_BITMAP:
+		return RB_CHUNK_WORDS * sizeof(unsigned long);
+	default:
+		return c->n * sizeof(struct rb_run);
+	}
+}
+
+static void rb_decode(const struct rb_container *c, unsigned long *words)
+{
+	uint32_t k;
+
+	if (c->type == RB_BITMAP) {
+		memcpy(words, c->bitmap, RB_CHUNK_WORDS * sizeof(unsigned long));
+		return;
+	}
+
+	memset(words, 0, RB_CHUNK_WORDS * sizeof(unsigned long));
+	if (c->type == RB_ARRAY) {
+		for (k = 0; k < c->n; k++)
+			words[BIT_WORD(c->array[k])] |= BIT_MASK(c->array[k]);
+	} else {
+		for (k = 0; k < c->n; k++)
+			__bitmap_set(words, c->runs[k].start, c->runs[k].last - c->runs[k].start + 1);
+	}
+}
+
+/* Store words in the smallest container, card is 0 for an empty chunk */
+static int rb_encode(struct rb_container *c, const unsigned long *words)
+{
+	unsigned long card = bitmap_weight(words, RB_CHUNK_BITS);
+	unsigned long nruns = 0, carry = 0, bit, end;
+	size_t array_size, bitmap_size, run_size;
+	uint32_t n = 0;
+	void *data;
+
+	for (unsigned long k = 0; k < RB_CHUNK_WORDS; k++) {
+		nruns += __builtin_popcountl(words[k] & ~((words[k] << 1) | carry));
+		carry = words[k] >> (BITS_PER_LONG - 1);
+	}
+
+	free(c->data);
+	c->data = NULL;
+	c->card = card;
+	c->n = 0;
+	if (!card)
+		return 0;
+
+	array_size = card <= RB_ARRAY_MAX ? card * sizeof(uint16_t) : SIZE_MAX;
+	bitmap_size = RB_CHUNK_WORDS * sizeof(unsigned long);
+	run_size = nruns * sizeof(struct rb_run);
+
+	if (run_size <= array_size && run_size <= bitmap_size) {
+		struct rb_run *runs = data = malloc(run_size);
+
+		if (!data)
+			return -ENOMEM;
+		for (bit = find_next_bit(words, RB_CHUNK_BITS, 0); bit < RB_CHUNK_BITS;
+		     bit = find_next_bit(words, RB_CHUNK_BITS, end)) {
+			end = find_next_zero_bit(words, RB_CHUNK_BITS, bit);
+			runs[n].start = bit;
+			runs[n].last = end - 1;
+			n++;
+		}
+		c->type = RB_RUN;
+	} else if (array_size <= bitmap_size) {
+		uint16_t *array = data = malloc(array_size);
+
+		if (!data)
+			return -ENOMEM;
+		for (bit = find_next_bit(words, RB_CHUNK_BITS, 0); bit < RB_CHUNK_BITS;
+		     bit = find_next_bit(words, RB_CHUNK_BITS, bit + 1))
+			array[n++] = bit;
+		c->type = RB_ARRAY;
+	} else {
+		data = malloc(bitmap_size);
+		if (!data)
+			return -ENOMEM;
+		memcpy(data, words, bitmap_size);
+		c->type = RB_BITMAP;
+	}
+	c->data = data;
+	c->n = n;
+	return 0;
+}
+
+static int rb_set_full(struct rb_container *c)
+{
+	struct rb_run *run = malloc(sizeof(*run));
+
+	if (!run)
+		return -ENOMEM;
+	free(c->data);
+	run->start = 0;
+	run->last = RB_CHUNK_BITS - 1;
+	c->runs = run;
+	c->type = RB_RUN;
+	c->card = RB_CHUNK_BITS;
+	c->n = 1;
+	return 0;
+}
+
+/* Index of the container of key, or where it would be inserted */
+static unsigned int rb_find(const struct roaring *r, uint16_t key, int *found)
+{
+	unsigned int lo = 0, hi = r->n;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (r->c[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < r->n && r->c[lo].key == key;
+	return lo;
+}
+
+/* Insert an empty array container */
+static struct rb_container *rb_insert(struct roaring *r, unsigned int pos, uint16_t key)
+{
+	if (r->n == r->cap) {
+		unsigned int cap = r->cap ? r->cap * 2 : 4;
+		struct rb_container *c = realloc(r->c, cap * sizeof(*c));
+
+		if (!c)
+			return NULL;
+		r->c = c;
+		r->cap = cap;
+	}
+	memmove(r->c + pos + 1, r->c + pos, (r->n - pos) * sizeof(*r->c));
+	r->n++;
+	memset(r->c + pos, 0, sizeof(*r->c));
+	r->c[pos].key = key;
+	r->c[pos].type = RB_ARRAY;
+	return r->c + pos;
+}
+
+static void rb_remove(struct roaring *r, unsigned int pos)
+{
+	free(r->c[pos].data);
+	memmove(r->c + pos, r->c + pos + 1, (r->n - pos - 1) * sizeof(*r->c));
+	r->n--;
+}
+
+void roaring_init(struct roaring *r)
+{
+	memset(r, 0, sizeof(*r));
+}
+
+void roaring_destroy(struct roaring *r)
+{
+	for (unsigned int i = 0; i < r->n; i++)
+		free(r->c[i].data);
+	free(r->c);
+	roaring_init(r);
+}
+
+/* Bytes used by the containers and their data */
+size_t roaring_size(const struct roaring *r)
+{
+	size_t size = r->cap * sizeof(*r->c);
+
+	for (unsigned int i = 0; i < r->n; i++)
+		size += rb_data_size(&r->c[i]);
+	return size;
+}
+
+unsigned long roaring_weight(const struct roaring *r)
+{
+	unsigned long w = 0;
+
+	for (unsigned int i = 0; i < r->n; i++)
+		w += r->c[i].card;
+	return w;
+}
+
+static int roaring_range(struct roaring *r, unsigned long start, unsigned long end, int set)
+{
+	unsigned long words[RB_CHUNK_WORDS];
+	int found, err = 0;
+
+	while (start < end && !err) {
+		uint16_t key = start >> 16;
+		unsigned long base = (unsigned long)key << 16;
+		unsigned long lo = start - base, hi = min(end - base, RB_CHUNK_BITS);
+		unsigned int pos = rb_find(r, key, &found);
+		struct rb_container *c = found ? r->c + pos : NULL;
+
+		start = base + RB_CHUNK_BITS;
+		if (!c && !set)
+			continue;
+		if (!c && !(c = rb_insert(r, pos, key)))
+			return -ENOMEM;
+
+		if (lo == 0 && hi == RB_CHUNK_BITS) {
+			if (set)
+				err = rb_set_full(c);
+			else
+				rb_remove(r, pos);
+			continue;
+		}
+
+		rb_decode(c, words);
+		if (set)
+			__bitmap_set(words, lo, hi - lo);
+		else
+			__bitmap_clear(words, lo, hi - lo);
+		err = rb_encode(c, words);
+		if (!err && !c->card)
+			rb_remove(r, pos);
+	}
+	return err;
+}
+
+#define ROARING_MAX_BITS	(1UL << 32)
+
+int roaring_set(struct roaring *r, unsigned long start, unsigned long len)
+{
+	if (start > ROARING_MAX_BITS || len > ROARING_MAX_BITS - start)
+		return -ERANGE;
+	return roaring_range(r, start, start + len, 1);
+}
+
+int roaring_clear(struct roaring *r, unsigned long start, unsigned long len)
+{
+	if (start > ROARING_MAX_BITS || len > ROARING_MAX_BITS - start)
+		return -ERANGE;
+	return roaring_range(r, start, start + len, 0);
+}
+
+int roaring_test_bit(const struct roaring *r, unsigned long nr)
+{
+	const struct rb_container *c;
+	uint16_t low = nr & (RB_CHUNK_BITS - 1);
+	unsigned int pos, lo, hi;
+	int found;
+
+	if (nr >= ROARING_MAX_BITS)
+		return 0;
+	pos = rb_find(r, nr >> 16, &found);
+	if (!found)
+		return 0;
+
+	c = r->c + pos;
+	if (c->type == RB_BITMAP)
+		return (c->bitmap[BIT_WORD(low)] >> (low % BITS_PER_LONG)) & 1;
+
+	/* First array entry or run ending at or after low */
+	for (lo = 0, hi = c->n; lo < hi; ) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if ((c->type == RB_ARRAY ? c->array[mid] : c->runs[mid].last) < low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == c->n)
+		return 0;
+	return c->type == RB_ARRAY ? c->array[lo] == low : c->runs[lo].start <= low;
+}
+
+static int rb_copy(struct rb_container *dst, const struct rb_container *src)
+{
+	size_t size = rb_data_size(src);
+
+	*dst = *src;
+	dst->data = malloc(size);
+	if (!dst->data)
+		return -ENOMEM;
+	memcpy(dst->data, src->data, size);
+	return 0;
+}
+
+/*
+ * dst = r1 | r2 or dst = r1 & r2, dst may be one of the operands. On
+ * error dst is left untouched.
+ */
+static int roaring_op(struct roaring *dst, const struct roaring *r1,
+		      const struct roaring *r2, int is_and)
+{
+	unsigned long w1[RB_CHUNK_WORDS], w2[RB_CHUNK_WORDS];
+	struct roaring res;
+	unsigned int i = 0, j = 0;
+	int err = 0;
+
+	roaring_init(&res);
+	while (!err && (i < r1->n || j < r2->n)) {
+		const struct rb_container *c1 = i < r1->n ? r1->c + i : NULL;
+		const struct rb_container *c2 = j < r2->n ? r2->c + j : NULL;
+		struct rb_container *c;
+
+		if (c1 && c2 && c1->key == c2->key) {
+			i++;
+			j++;
+			rb_decode(c1, w1);
+			rb_decode(c2, w2);
+			if (is_and) {
+				if (!bitmap_and(w1, w1, w2, RB_CHUNK_BITS))
+					continue;
+			} else {
+				bitmap_or(w1, w1, w2, RB_CHUNK_BITS);
+			}
+			c = rb_insert(&res, res.n, c1->key);
+			err = c ? rb_encode(c, w1) : -ENOMEM;
+			continue;
+		}
+
+		/* A chunk only one side has */
+		if (!c2 || (c1 && c1->key < c2->key))
+			i++;
+		else {
+			c1 = c2;
+			j++;
+		}
+		if (is_and)
+			continue;
+		c = rb_insert(&res, res.n, c1->key);
+		err = c ? rb_copy(c, c1) : -ENOMEM;
+	}
+
+	if (err) {
+		roaring_destroy(&res);
+		return err;
+	}
+	roaring_destroy(dst);
+	*dst = res;
+	return 0;
+}
+
+int roaring_or(struct roaring *dst, const struct roaring *r1, const struct roaring *r2)
+{
+	return roaring_op(dst, r1, r2, 0);
+}
+
+int roaring_and(struct roaring *dst, const struct roaring *r1, const struct roaring *r2)
+{
+	return roaring_op(dst, r1, r2, 1);
+}
+
+/* Replace the content of r with the first nbits bits of map */
+int roaring_from_bitmap(struct roaring *r, const unsigned long *map, unsigned long nbits)
+{
+	unsigned long words[RB_CHUNK_WORDS];
+	unsigned long base, n;
+	struct roaring res;
+	int err = 0;
+
+	if (nbits > ROARING_MAX_BITS)
+		return -ERANGE;
+
+	roaring_init(&res);
+	for (base = 0; base < nbits && !err; base += RB_CHUNK_BITS) {
+		struct rb_container *c;
+
+		n = min(nbits - base, RB_CHUNK_BITS);
+		if (find_next_bit(map + BIT_WORD(base), n, 0) >= n)
+			continue;
+
+		memset(words, 0, sizeof(words));
+		memcpy(words, map + BIT_WORD(base), BITS_TO_LONGS(n) * sizeof(unsigned long));
+		if (n % BITS_PER_LONG)
+			words[BIT_WORD(n)] &= BITMAP_LAST_WORD_MASK(n);
+
+		c = rb_insert(&res, res.n, base >> 16);
+		err = c ? rb_encode(c, words) : -ENOMEM;
+	}
+
+	if (err) {
+		roaring_destroy(&res);
+		return err;
+	}
+	roaring_destroy(r);
+	*r = res;
+	return 0;
+}
+
+/* Expand into the first nbits bits of map, set bits past nbits are dropped */
+void roaring_to_bitmap(const struct roaring *r, unsigned long *map, unsigned long nbits)
+{
+	unsigned long words[RB_CHUNK_WORDS];
+
+	memset(map, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+	for (unsigned int i = 0; i < r->n; i++) {
+		unsigned long base = (unsigned long)r->c[i].key << 16;
+
+		if (base >= nbits)
+			break;
+		rb_decode(r->c + i, words);
+		memcpy(map + BIT_WORD(base), words,
+		       BITS_TO_LONGS(min(nbits - base, RB_CHUNK_BITS)) * sizeof(unsigned long));
+	}
+	if (nbits % BITS_PER_LONG)
+		map[BIT_WORD(nbits)] &= BITMAP_LAST_WORD_MASK(nbits);
+}
+
+/*
+ * Persistent bitmap
+ *
+ * A file made of a one page header followed by the bitmap words, mapped
+ * shared so the map can be used in place by the __bitmap_*() and find
+ * helpers. pbitmap_set() and pbitmap_clear() remember the pages they
+ * touched; code changing pb->map directly calls pbitmap_mark_dirty().
+ * pbitmap_flush() then msync()s only the dirty pages.
+ *
+ * The data checksum is only brought up to date by pbitmap_close(), a
+ * file still open or left behind by a crash is not marked clean and can
+ * not be verified.
+ */
+
+#define PBITMAP_MAGIC		"BITMAPv1"
+#define PBITMAP_VERSION		1
+#define PBITMAP_CLEAN		(1U << 0)
+
+struct pbitmap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t word_size;
+	uint64_t nbits;
+	uint32_t flags;
+	uint32_t reserved;
+	/* Of the data, valid if PBITMAP_CLEAN is set */
+	uint64_t data_csum;
+	/* Of the header up to here */
+	uint64_t hdr_csum;
+};
+
+struct pbitmap {
+	int fd;
+	size_t len;
+	size_t pagesize;
+	struct pbitmap_header *hdr;
+	unsigned long *map;
+	unsigned long nbits;
+	/* One bit per page of the data */
+	unsigned long *dirty;
+	unsigned long nr_pages;
+};
+
+/* FNV-1a on words */
+static uint64_t pbitmap_csum(const void *buf, size_t len)
+{
+	const uint64_t *p = buf;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (size_t k = 0; k < len / sizeof(*p); k++)
+		h = (h ^ p[k]) * 0x100000001b3ULL;
+	return h;
+}
+
+static uint64_t pbitmap_hdr_csum(const struct pbitmap_header *hdr)
+{
+	return pbitmap_csum(hdr, offsetof(struct pbitmap_header, hdr_csum));
+}
+
+static size_t pbitmap_data_size(unsigned long nbits)
+{
+	return BITS_TO_LONGS(nbits) * sizeof(unsigned long);
+}
+
+static int pbitmap_map(struct pbitmap *pb, int fd, unsigned long nbits)
+{
+	pb->fd = fd;
+	pb->pagesize = sysconf(_SC_PAGESIZE);
+	pb->nbits = nbits;
+	pb->nr_pages = (pbitmap_data_size(nbits) + pb->pagesize - 1) / pb->pagesize;
+	pb->len = pb->pagesize * (1 + pb->nr_pages);
+
+	pb->dirty = calloc(BITS_TO_LONGS(pb->nr_pages), sizeof(unsigned long));
+	if (!pb->dirty)
+		return -ENOMEM;
+
+	pb->hdr = mmap(NULL, pb->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (pb->hdr == MAP_FAILED) {
+		free(pb->dirty);
+		return -errno;
+	}
+	pb->map = (unsigned long *)((char *)pb->hdr + pb->pagesize);
+	return 0;
+}
+
+static void pbitmap_unmap(struct pbitmap *pb)
+{
+	munmap(pb->hdr, pb->len);
+	free(pb->dirty);
+	close(pb->fd);
+	pb->fd = -1;
+}
+
+/* Write the header with the given flags and wait for it to hit the file */
+static int pbitmap_write_header(struct pbitmap *pb, uint32_t flags)
+{
+	pb->hdr->flags = flags;
+	pb->hdr->hdr_csum = pbitmap_hdr_csum(pb->hdr);
+	if (msync(pb->hdr, pb->pagesize, MS_SYNC))
+		return -errno;
+	return 0;
+}
+
+/* Create or truncate path to an empty map of nbits bits */
+int pbitmap_create(struct pbitmap *pb, const char *path, unsigned long nbits)
+{
+	int fd, err;
+
+	if (!nbits || nbits > UINT_MAX)
+		return -EINVAL;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, sysconf(_SC_PAGESIZE) + pbitmap_data_size(nbits))) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	err = pbitmap_map(pb, fd, nbits);
+	if (err) {
+		close(fd);
+		return err;
+	}
+
+	memcpy(pb->hdr->magic, PBITMAP_MAGIC, sizeof(pb->hdr->magic));
+	pb->hdr->version = PBITMAP_VERSION;
+	pb->hdr->word_size = sizeof(unsigned long);
+	pb->hdr->nbits = nbits;
+	err = pbitmap_write_header(pb, 0);
+	if (err)
+		pbitmap_unmap(pb);
+	return err;
+}
+
+/*
+ * Map an existing file. Returns -EBADMSG for a damaged header, or with
+ * verify for a data checksum mismatch or a file that was not closed
+ * cleanly.
+ */
+int pbitmap_open(struct pbitmap *pb, const char *path, int verify)
+{
+	struct pbitmap_header hdr;
+	struct stat st;
+	int fd, err = -EBADMSG;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &st))
+		goto out_close;
+	if (memcmp(hdr.magic, PBITMAP_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != PBITMAP_VERSION || hdr.hdr_csum != pbitmap_hdr_csum(&hdr))
+		goto out_close;
+	if (hdr.word_size != sizeof(unsigned long) || !hdr.nbits || hdr.nbits > UINT_MAX ||
+	    st.st_size < sysconf(_SC_PAGESIZE) + pbitmap_data_size(hdr.nbits)) {
+		err = -EINVAL;
+		goto out_close;
+	}
+
+	err = pbitmap_map(pb, fd, hdr.nbits);
+	if (err)
+		goto out_close;
+
+	if (verify && (!(hdr.flags & PBITMAP_CLEAN) ||
+		       pbitmap_csum(pb->map, pbitmap_data_size(pb->nbits)) != hdr.data_csum)) {
+		pbitmap_unmap(pb);
+		return -EBADMSG;
+	}
+
+	/* The checksum goes stale as soon as the map is changed */
+	err = pbitmap_write_header(pb, hdr.flags & ~PBITMAP_CLEAN);
+	if (err)
+		pbitmap_unmap(pb);
+	return err;
+
+out_close:
+	close(fd);
+	return err;
+}
+
+void pbitmap_mark_dirty(struct pbitmap *pb, unsigned long start, unsigned long len)
+{
+	unsigned long bits_per_page = pb->pagesize * 8;
+	unsigned long first, last;
+
+	if (!len)
+		return;
+	first = start / bits_per_page;
+	last = (start + len - 1) / bits_per_page;
+	__bitmap_set(pb->dirty, first, last - first + 1);
+}
+
+int pbitmap_set(struct pbitmap *pb, unsigned int start, int len)
+{
+	int err = bitmap_set(pb->map, pb->nbits, start, len);
+
+	if (!err)
+		pbitmap_mark_dirty(pb, start, len);
+	return err;
+}
+
+int pbitmap_clear(struct pbitmap *pb, unsigned int start, int len)
+{
+	int err = bitmap_clear(pb->map, pb->nbits, start, len);
+
+	if (!err)
+		pbitmap_mark_dirty(pb, start, len);
+	return err;
+}
+
+/* msync() every run of dirty pages, returns the number of pages or -errno */
+long pbitmap_flush(struct pbitmap *pb)
+{
+	unsigned long first, end;
+	long pages = 0;
+
+	for (first = find_next_bit(pb->dirty, pb->nr_pages, 0); first < pb->nr_pages;
+	     first = find_next_bit(pb->dirty, pb->nr_pages, end)) {
+		end = find_next_zero_bit(pb->dirty, pb->nr_pages, first);
+		if (msync((char *)pb->map + first * pb->pagesize,
+			  (end - first) * pb->pagesize, MS_SYNC))
+			return -errno;
+		__bitmap_clear(pb->dirty, first, end - first);
+		pages += end - first;
+	}
+	return pages;
+}
+
+/* Flush, store the data checksum and mark the file clean */
+int pbitmap_close(struct pbitmap *pb)
+{
+	long ret = pbitmap_flush(pb);
+
+	if (ret >= 0) {
+		pb->hdr->data_csum = pbitmap_csum(pb->map, pbitmap_data_size(pb->nbits));
+		ret = pbitmap_write_header(pb, pb->hdr->flags | PBITMAP_CLEAN);
+	}
+	pbitmap_unmap(pb);
+	return ret;
+}
+
+/*
+ * Text forms, the same as the kernel uses in /sys and /proc
+ *
+ * The list form is "0-3,8,10-63", the hex form is 32 bit chunks separated
+ * by commas with the most significant one first, "ff,ffffff00" for 40
+ * bits. Both are built by hand in the caller's buffer, no stdio.
+ */
+
+#define PAGE_SIZE		4096
+#define CHUNKSZ			32
+
+struct fmtbuf {
+	char *p;
+	char *end;
+	size_t len;
+};
+
+/* Characters past the end of the buffer are dropped, len counts what fits */
+static inline void fmt_putc(struct fmtbuf *f, char c)
+{
+	if (f->p < f->end) {
+		*f->p++ = c;
+		f->len++;
+	}
+}
+
+static void fmt_dec(struct fmtbuf *f, unsigned long val)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	while (n)
+		fmt_putc(f, tmp[--n]);
+}
+
+static void fmt_hex(struct fmtbuf *f, unsigned long val, int width)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	while (width--)
+		fmt_putc(f, digits[(val >> (width * 4)) & 0xf]);
+}
+
+static void fmt_list(struct fmtbuf *f, const unsigned long *maskp, unsigned int nmaskbits)
+{
+	unsigned long first, end;
+	int sep = 0;
+
+	for (first = find_next_bit(maskp, nmaskbits, 0); first < nmaskbits;
+	     first = find_next_bit(maskp, nmaskbits, end)) {
+		end = find_next_zero_bit(maskp, nmaskbits, first);
+		if (sep)
+			fmt_putc(f, ',');
+		sep = 1;
+		fmt_dec(f, first);
+		if (end - first > 1) {
+			fmt_putc(f, '-');
+			fmt_dec(f, end - 1);
+		}
+	}
+}
+
+static void fmt_mask(struct fmtbuf *f, const unsigned long *maskp, unsigned int nmaskbits)
+{
+	int chunksz = nmaskbits % CHUNKSZ ? nmaskbits % CHUNKSZ : CHUNKSZ;
+	long i;
+
+	for (i = __ALIGN_MASK((long)nmaskbits, CHUNKSZ - 1) - CHUNKSZ; i >= 0; i -= CHUNKSZ) {
+		unsigned long val = (maskp[BIT_WORD(i)] >> (i % BITS_PER_LONG)) &
+				    (~0UL >> (BITS_PER_LONG - chunksz));
+
+		fmt_hex(f, val, (chunksz + 3) / 4);
+		if (i)
+			fmt_putc(f, ',');
+		chunksz = CHUNKSZ;
+	}
+}
+
+/*
+ * Print maskp in list or hex form followed by a newline, the buffer is
+ * always terminated. Returns the number of characters written without
+ * the terminating zero.
+ */
+int bitmap_print_to_buf(int list, char *buf, size_t size, const unsigned long *maskp,
+			unsigned int nmaskbits)
+{
+	struct fmtbuf f = { buf, buf + size - 1, 0 };
+
+	if (!size)
+		return 0;
+	if (list)
+		fmt_list(&f, maskp, nmaskbits);
+	else
+		fmt_mask(&f, maskp, nmaskbits);
+	fmt_putc(&f, '\n');
+	*f.p = '\0';
+	return f.len;
+}
+
+/* buf has to be PAGE_SIZE bytes, like a sysfs show() buffer */
+int bitmap_print_to_pagebuf(int list, char *buf, const unsigned long *maskp,
+			    unsigned int nmaskbits)
+{
+	return bitmap_print_to_buf(list, buf, PAGE_SIZE, maskp, nmaskbits);
+}
+
+static inline int is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline int hex_to_bin(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Decimal number at *s, or "N" for the last bit. Moves *s past it,
+ * returns -EINVAL if there is none and -EOVERFLOW if it does not fit.
+ */
+static int parse_num(const char **s, const char *end, unsigned int nmaskbits,
+		     unsigned int *val)
+{
+	unsigned long v = 0;
+	const char *p = *s;
+
+	if (p < end && *p == 'N') {
+		if (!nmaskbits)
+			return -EINVAL;
+		*val = nmaskbits - 1;
+		*s = p + 1;
+		return 0;
+	}
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		v = v * 10 + *p - '0';
+		if (v > UINT_MAX)
+			return -EOVERFLOW;
+	}
+	if (p == *s)
+		return -EINVAL;
+	*val = v;
+	*s = p;
+	return 0;
+}
+
+static inline int end_of_region(char c)
+{
+	return is_space(c) || c == ',';
+}
+
+/*
+ * Parse a list like "0-3,8,10-63" into maskp, which is cleared first.
+ * Ranges take an optional group suffix, "0-15:2/4" sets the first two
+ * bits of every four. "N" stands for the last bit. Regions are separated
+ * by commas and/or white space.
+ *
+ * Returns 0, -EINVAL for bad syntax or -ERANGE for a bit past nmaskbits.
+ */
+int bitmap_parselist(const char *buf, unsigned long *maskp, unsigned int nmaskbits)
+{
+	const char *s = buf, *end = buf + strlen(buf);
+	int err;
+
+	memset(maskp, 0, BITS_TO_LONGS(nmaskbits) * sizeof(unsigned long));
+	for (;;) {
+		unsigned int start, last, used, group, base;
+
+		while (s < end && end_of_region(*s))
+			s++;
+		if (s == end)
+			return 0;
+
+		err = parse_num(&s, end, nmaskbits, &start);
+		if (err)
+			return err;
+		last = start;
+		used = group = 1;
+
+		if (s < end && *s == '-') {
+			s++;
+			err = parse_num(&s, end, nmaskbits, &last);
+			if (err)
+				return err;
+			if (s < end && *s == ':') {
+				s++;
+				err = parse_num(&s, end, 0, &used);
+				if (err)
+					return err;
+				if (s >= end || *s++ != '/')
+					return -EINVAL;
+				err = parse_num(&s, end, 0, &group);
+				if (err)
+					return err;
+			}
+		}
+		if (s < end && !end_of_region(*s))
+			return -EINVAL;
+
+		if (start > last || !group || used > group)
+			return -EINVAL;
+		if (last >= nmaskbits)
+			return -ERANGE;
+
+		for (base = start; base <= last; base += group) {
+			__bitmap_set(maskp, base, min(used, last - base + 1));
+			if (last - base < group)
+				break;
+		}
+	}
+}
+
+/*
+ * Parse the hex form up to the first newline, chunks are read from the
+ * end so the first one may be short. Returns 0, -EINVAL for bad syntax or
+ * -EOVERFLOW for a chunk over 32 bits or a bit past nmaskbits.
+ */
+int bitmap_parse(const char *buf, unsigned int buflen, unsigned long *maskp,
+		 unsigned int nmaskbits)
+{
+	const char *s = buf, *end = buf;
+	unsigned long nchunks = (nmaskbits + CHUNKSZ - 1) / CHUNKSZ;
+	unsigned long chunk;
+
+	while (end < buf + buflen && *end && *end != '\n')
+		end++;
+
+	memset(maskp, 0, BITS_TO_LONGS(nmaskbits) * sizeof(unsigned long));
+	for (chunk = 0; ; chunk++) {
+		unsigned long val = 0, base = chunk * CHUNKSZ;
+		int shift = 0;
+
+		while (end > s && end_of_region(end[-1]))
+			end--;
+		if (end == s)
+			break;
+		if (chunk == nchunks)
+			return -EOVERFLOW;
+
+		do {
+			int d = hex_to_bin(*--end);
+
+			if (d < 0)
+				return -EINVAL;
+			if (shift == CHUNKSZ)
+				return -EOVERFLOW;
+			val |= (unsigned long)d << shift;
+			shift += 4;
+		} while (end > s && !end_of_region(end[-1]));
+
+		maskp[BIT_WORD(base)] |= val << (base % BITS_PER_LONG);
+	}
+
+	if (nmaskbits % BITS_PER_LONG &&
+	    maskp[BIT_WORD(nmaskbits)] & ~BITMAP_LAST_WORD_MASK(nmaskbits))
+		return -EOVERFLOW;
+	return 0;
+}
+
+void print_map(unsigned long *map, int n)
+{
+	int i, j;
+	unsigned char *c;
+
+	for (i = 0; i < n; i++) {
+		printf("map[%d]: 7: ", i);
+
+		c = (unsigned char *)&map[i];
+		//little endian
+		for (j = sizeof(*map) - 1; j > 0; j--)
+			printf("%02x ", c[j]);
+
+		printf(":0\n");
+	}
+}
+
+void print_bitmap(unsigned long *map, int n)
+{
+	printf("      Hi                Lo\n");
+	for (int i = 0; i < n; i++)
+		printf("map[%d]: %016lx\n", i, map[i]);
+}
+
+#define BENCH_MIN_BITS		(1UL << 10)
+#define BENCH_MAX_BITS		(1UL << 30)
+#define BENCH_TOTAL_BITS	(1UL << 31)
+
+static volatile unsigned long bench_sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *bench_alloc(unsigned long nbits)
+{
+	/* aligned_alloc() wants the size to be a multiple of the alignment */
+	void *p = aligned_alloc(64, __ALIGN_MASK(BITS_TO_LONGS(nbits) * sizeof(unsigned long), 63));
+
+	if (!p) {
+		fprintf(stderr, "failed to allocate %lu bits\n", nbits);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/*
+ * Run every operation of every supported implementation over maps from
+ * 1 Kbit to 1 Gbit, print one CSV line per (impl, op, size). Bandwidth
+ * counts the bytes of all operands, reads and writes.
+ */
+static void bulk_benchmark(unsigned long max_bits)
+{
+	unsigned long *b1 = bench_alloc(max_bits);
+	unsigned long *b2 = bench_alloc(max_bits);
+	unsigned long *dst = bench_alloc(max_bits);
+	static const char *const op_names[] = {
+		"and", "or", "xor", "andnot", "weight", "equal", "intersects",
+	};
+	static const int op_operands[] = { 3, 3, 3, 3, 1, 2, 2 };
+
+	srand(1);
+	for (unsigned long k = 0; k < BITS_TO_LONGS(max_bits); k++) {
+		b1[k] = ((unsigned long)rand() << 32) ^ rand();
+		/* Same as b1, so equal has to scan everything */
+		b2[k] = b1[k];
+		dst[k] = 0;
+	}
+
+	printf("impl,op,nbits,ns_per_call,gbytes_per_s\n");
+	for (int impl = 0; impl < BITMAP_IMPL_MAX; impl++) {
+		const struct bitmap_bulk_ops *ops = &bitmap_bulk_ops_table[impl];
+
+		if (!bitmap_impl_supported(impl))
+			continue;
+
+		for (int op = 0; op < ARRAY_SIZE(op_names); op++) {
+			/* Disjoint from b1, so intersects has to scan everything */
+			if (op == 6)
+				for (unsigned long k = 0; k < BITS_TO_LONGS(max_bits); k++)
+					dst[k] = ~b1[k];
+
+			for (unsigned long nbits = BENCH_MIN_BITS; nbits <= max_bits; nbits <<= 2) {
+				unsigned long nwords = nbits / BITS_PER_LONG;
+				unsigned long iters = BENCH_TOTAL_BITS / nbits;
+				unsigned long sink = 0;
+				double start, ns;
+
+				if (!iters)
+					iters = 1;
+				start = now_ns();
+				for (unsigned long i = 0; i < iters; i++) {
+					switch (op) {
+					case 0: sink += ops->and(dst, b1, b2, nwords); break;
+					case 1: sink += ops->or(dst, b1, b2, nwords); break;
+					case 2: sink += ops->xor(dst, b1, b2, nwords); break;
+					case 3: sink += ops->andnot(dst, b1, b2, nwords); break;
+					case 4: sink += ops->weight(b1, nwords); break;
+					case 5: sink += ops->equal(b1, b2, nwords); break;
+					case 6: sink += ops->intersects(b1, dst, nwords); break;
+					}
+				}
+				ns = (now_ns() - start) / iters;
+				bench_sink += sink;
+
+				printf("%s,%s,%lu,%.1f,%.2f\n", ops->name, op_names[op], nbits, ns,
+				       op_operands[op] * (nbits / 8) / ns);
+			}
+		}
+	}
+
+	free(b1);
+	free(b2);
+	free(dst);
+}
+
+static unsigned long rand_long(void)
+{
+	return ((unsigned long)rand() << 33) ^ ((unsigned long)rand() << 11) ^ rand();
+}
+
+/*
+ * Compare bitmap_set()/bitmap_clear() with the word loops on random ranges
+ * of random maps. One map in 16 is large enough for the streaming stores.
+ * The word after the map is a guard that must never be touched.
+ */
+static int range_selftest(unsigned long iterations, unsigned int seed)
+{
+	const unsigned long max_bits = BITMAP_NT_THRESHOLD * 8 * 2;
+	unsigned long *map = bench_alloc(max_bits + BITS_PER_LONG);
+	unsigned long *ref = bench_alloc(max_bits + BITS_PER_LONG);
+	unsigned long i;
+	int ret = 0;
+
+	if (check_range(64, 0, 64) || check_range(64, 1, 64) != -ERANGE ||
+	    check_range(64, 0, -1) != -EINVAL) {
+		printf("range self test: check_range() bounds are wrong\n");
+		ret = 1;
+		iterations = 0;
+	}
+
+	printf("range self test: seed %u\n", seed);
+	srand(seed);
+	for (i = 0; i < iterations; i++) {
+		unsigned long map_size, nwords, k;
+		unsigned int start;
+		int set = rand() & 1, len, err, expect = 0;
+
+		if (i % 16 == 0)
+			map_size = max_bits - rand() % (2 * BITS_PER_LONG);
+		else
+			map_size = 1 + rand() % 4096;
+		nwords = BITS_TO_LONGS(map_size) + 1;
+
+		if (i % 16 == 0) {
+			memset(map, rand(), nwords * sizeof(*map));
+		} else {
+			for (k = 0; k < nwords; k++)
+				map[k] = rand_long();
+		}
+		memcpy(ref, map, nwords * sizeof(*map));
+
+		start = rand() % (map_size + 1);
+		len = rand() % (map_size - start + 1);
+		switch (rand() % 8) {
+		case 0:
+			len = map_size - start + 1 + rand() % BITS_PER_LONG;
+			expect = -ERANGE;
+			break;
+		case 1:
+			len = -1 - rand() % BITS_PER_LONG;
+			expect = -EINVAL;
+			break;
+		case 2:
+			len = map_size - start;
+			break;
+		}
+
+		if (set)
+			err = bitmap_set(map, map_size, start, len);
+		else
+			err = bitmap_clear(map, map_size, start, len);
+
+		if (!expect) {
+			if (set)
+				__bitmap_set_loop(ref, start, len);
+			else
+				__bitmap_clear_loop(ref, start, len);
+		}
+
+		if (err != expect || memcmp(map, ref, nwords * sizeof(*map))) {
+			printf("range self test: %s %u + %d in %lu bits: got %d expected %d%s\n",
+			       set ? "set" : "clear", start, len, map_size, err, expect,
+			       err == expect ? ", maps differ" : "");
+			ret = 1;
+			break;
+		}
+	}
+	if (!ret)
+		printf("range self test: %lu iterations passed\n", iterations);
+
+	free(map);
+	free(ref);
+	return ret;
+}
+
+/*
+ * Random range operations on a hierarchical and a flat map, the searches
+ * from random places must agree after every step.
+ */
+static int hbitmap_selftest(unsigned long iterations)
+{
+	for (unsigned long i = 0; i < iterations; i++) {
+		unsigned long nbits = 1 + rand() % (i % 8 ? 5000 : 300000);
+		unsigned long *ref = calloc(BITS_TO_LONGS(nbits), sizeof(unsigned long));
+		struct hbitmap hb;
+
+		if (!ref || hbitmap_init(&hb, nbits)) {
+			fprintf(stderr, "failed to allocate %lu bits\n", nbits);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int step = 0; step < 64; step++) {
+			unsigned long start = rand() % (nbits + 1);
+			/* Mostly short ranges so the map stays sparse-ish */
+			unsigned long len = rand() % (step % 4 ? min(nbits - start, 200UL) + 1 : nbits - start + 1);
+			unsigned long pos = rand() % (nbits + 1);
+			int set = rand() % 3 != 0;
+
+			if (set) {
+				hbitmap_set(&hb, start, len);
+				bitmap_set(ref, nbits, start, len);
+			} else {
+				hbitmap_clear(&hb, start, len);
+				bitmap_clear(ref, nbits, start, len);
+			}
+
+			if (hbitmap_find_next_bit(&hb, pos) != find_next_bit(ref, nbits, pos) ||
+			    hbitmap_find_next_zero_bit(&hb, pos) != find_next_zero_bit(ref, nbits, pos) ||
+			    (pos < nbits && hbitmap_test_bit(&hb, pos) != test_bit(pos, ref)) ||
+			    hbitmap_set(&hb, nbits, 1) != -ERANGE) {
+				printf("hbitmap self test: %s %lu + %lu in %lu bits, search from %lu differs\n",
+				       set ? "set" : "clear", start, len, nbits, pos);
+				return 1;
+			}
+		}
+
+		hbitmap_destroy(&hb);
+		free(ref);
+	}
+	printf("hbitmap self test: %lu maps passed\n", iterations);
+	return 0;
+}
+
+/*
+ * Walk all set bits of a sparse map and look for the first zero bit behind
+ * a long run of ones, in the hierarchical and the flat map.
+ */
+static void hbitmap_benchmark(unsigned long nbits)
+{
+	unsigned long *flat = bench_alloc(nbits);
+	struct hbitmap hb;
+	unsigned long bit, found, k;
+	double start, hb_ns, flat_ns;
+
+	if (hbitmap_init(&hb, nbits)) {
+		fprintf(stderr, "failed to allocate %lu bits\n", nbits);
+		exit(EXIT_FAILURE);
+	}
+	memset(flat, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+
+	for (k = 0; k < 16; k++) {
+		bit = ((unsigned long)rand() << 16 ^ rand()) % nbits;
+		hbitmap_set(&hb, bit, 1);
+		bitmap_set(flat, nbits, bit, 1);
+	}
+
+	printf("op,nbits,hbitmap_ns,flat_ns\n");
+
+	start = now_ns();
+	for (found = 0, bit = hbitmap_find_next_bit(&hb, 0); bit < nbits;
+	     bit = hbitmap_find_next_bit(&hb, bit + 1))
+		found++;
+	hb_ns = now_ns() - start;
+	start = now_ns();
+	for (bit = find_next_bit(flat, nbits, 0); bit < nbits; bit = find_next_bit(flat, nbits, bit + 1))
+		found--;
+	flat_ns = now_ns() - start;
+	bench_sink += found;
+	printf("walk 16 set bits,%lu,%.0f,%.0f\n", nbits, hb_ns, flat_ns);
+
+	hbitmap_set(&hb, 0, nbits - 1);
+	bitmap_set(flat, nbits, 0, nbits - 1);
+	start = now_ns();
+	found = hbitmap_find_next_zero_bit(&hb, 0);
+	hb_ns = now_ns() - start;
+	start = now_ns();
+	found ^= find_next_zero_bit(flat, nbits, 0);
+	flat_ns = now_ns() - start;
+	bench_sink += found;
+	printf("first zero bit at the end,%lu,%.0f,%.0f\n", nbits, hb_ns, flat_ns);
+
+	hbitmap_destroy(&hb);
+	free(flat);
+}
+
+static void roaring_check_alloc(int err)
+{
+	if (err) {
+		fprintf(stderr, "roaring: %s\n", strerror(-err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Random range operations on two compressed maps and their flat
+ * counterparts. After every step the expanded maps, a round trip through
+ * roaring_from_bitmap() and the union and intersection must match the
+ * flat versions.
+ */
+static int roaring_selftest(unsigned long iterations)
+{
+	const unsigned long nbits = 8 * RB_CHUNK_BITS + 4321;
+	unsigned long *flat[2], *and, *or, *out;
+	unsigned long i;
+	int ret = 0;
+
+	flat[0] = bench_alloc(nbits);
+	flat[1] = bench_alloc(nbits);
+	and = bench_alloc(nbits);
+	or = bench_alloc(nbits);
+	out = bench_alloc(nbits);
+
+	for (i = 0; i < iterations && !ret; i++) {
+		struct roaring r[2], tmp;
+
+		for (int m = 0; m < 2; m++) {
+			roaring_init(&r[m]);
+			memset(flat[m], 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+		}
+		roaring_init(&tmp);
+
+		for (int step = 0; step < 32 && !ret; step++) {
+			int m = rand() & 1, set = rand() % 3 != 0;
+			unsigned long start = rand() % nbits;
+			unsigned long len;
+
+			/* Single bits, runs within a chunk and runs across chunks */
+			switch (rand() % 3) {
+			case 0:
+				len = 1 + rand() % 8;
+				break;
+			case 1:
+				len = rand() % 5000;
+				break;
+			default:
+				len = rand() % (4 * RB_CHUNK_BITS);
+				break;
+			}
+			len = min(len, nbits - start);
+
+			if (set) {
+				roaring_check_alloc(roaring_set(&r[m], start, len));
+				bitmap_set(flat[m], nbits, start, len);
+			} else {
+				roaring_check_alloc(roaring_clear(&r[m], start, len));
+				bitmap_clear(flat[m], nbits, start, len);
+			}
+
+			roaring_to_bitmap(&r[m], out, nbits);
+			if (!bitmap_equal(out, flat[m], nbits) ||
+			    roaring_weight(&r[m]) != bitmap_weight(flat[m], nbits) ||
+			    roaring_test_bit(&r[m], start) != test_bit(start, flat[m]))
+				ret = 1;
+
+			roaring_check_alloc(roaring_from_bitmap(&tmp, flat[m], nbits));
+			roaring_to_bitmap(&tmp, out, nbits);
+			if (!bitmap_equal(out, flat[m], nbits))
+				ret = 1;
+
+			bitmap_and(and, flat[0], flat[1], nbits);
+			roaring_check_alloc(roaring_and(&tmp, &r[0], &r[1]));
+			roaring_to_bitmap(&tmp, out, nbits);
+			if (!bitmap_equal(out, and, nbits))
+				ret = 1;
+
+			bitmap_or(or, flat[0], flat[1], nbits);
+			roaring_check_alloc(roaring_or(&tmp, &r[0], &r[1]));
+			roaring_to_bitmap(&tmp, out, nbits);
+			if (!bitmap_equal(out, or, nbits))
+				ret = 1;
+
+			if (ret)
+				printf("roaring self test: %s %lu + %lu differs\n",
+				       set ? "set" : "clear", start, len);
+		}
+
+		roaring_destroy(&r[0]);
+		roaring_destroy(&r[1]);
+		roaring_destroy(&tmp);
+	}
+	if (!ret)
+		printf("roaring self test: %lu maps passed\n", iterations);
+
+	free(flat[0]);
+	free(flat[1]);
+	free(and);
+	free(or);
+	free(out);
+	return ret;
+}
+
+/* Memory of a flat and a compressed map holding runs of random length */
+static void roaring_report(unsigned long nbits)
+{
+	unsigned long *flat = bench_alloc(nbits);
+	static const unsigned long nr_runs[] = { 16, 1024, 65536 };
+	struct roaring r;
+
+	roaring_init(&r);
+	printf("nbits,runs,set_bits,flat_bytes,roaring_bytes\n");
+	for (int k = 0; k < ARRAY_SIZE(nr_runs); k++) {
+		unsigned long stride = nbits / nr_runs[k];
+
+		memset(flat, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+		for (unsigned long run = 0; run < nr_runs[k]; run++)
+			__bitmap_set(flat, run * stride, rand() % stride);
+
+		roaring_check_alloc(roaring_from_bitmap(&r, flat, nbits));
+		printf("%lu,%lu,%lu,%lu,%zu\n", nbits, nr_runs[k], roaring_weight(&r),
+		       BITS_TO_LONGS(nbits) * sizeof(unsigned long), roaring_size(&r));
+	}
+	roaring_destroy(&r);
+	free(flat);
+}
+
+/* The old way, one snprintf() per bit or chunk, as the reference output */
+static void ref_format(int list, char *buf, size_t size, const unsigned long *map,
+		       unsigned int nbits)
+{
+	size_t len = 0;
+	long i;
+
+	buf[0] = '\0';
+	if (list) {
+		for (i = 0; i < nbits; i++) {
+			long j = i;
+
+			if (!test_bit(i, map))
+				continue;
+			while (j + 1 < nbits && test_bit(j + 1, map))
+				j++;
+			len += snprintf(buf + len, size - len, len ? ",%ld" : "%ld", i);
+			if (j > i)
+				len += snprintf(buf + len, size - len, "-%ld", j);
+			i = j;
+		}
+	} else {
+		int chunksz = nbits % CHUNKSZ ? nbits % CHUNKSZ : CHUNKSZ;
+
+		for (i = __ALIGN_MASK((long)nbits, CHUNKSZ - 1) - CHUNKSZ; i >= 0; i -= CHUNKSZ) {
+			unsigned long val = 0;
+
+			for (int k = 0; k < chunksz; k++)
+				val |= (unsigned long)test_bit(i + k, map) << k;
+			len += snprintf(buf + len, size - len, "%0*lx%s", (chunksz + 3) / 4, val,
+					i ? "," : "");
+			chunksz = CHUNKSZ;
+		}
+	}
+	snprintf(buf + len, size - len, "\n");
+}
+
+static const struct {
+	const char *str;
+	int list;
+	unsigned int nbits;
+	int err;
+	const char *canon;
+} format_cases[] = {
+	{ "0-3,8,10-63",	1, 64,  0,	 "0-3,8,10-63\n" },
+	{ " 1,,2 3\n",		1, 64,  0,	 "1-3\n" },
+	{ "0-15:2/4",		1, 16,  0,	 "0-1,4-5,8-9,12-13\n" },
+	{ "2-N",		1, 10,  0,	 "2-9\n" },
+	{ "",			1, 10,  0,	 "\n" },
+	{ "5-3",		1, 10,  -EINVAL, NULL },
+	{ "0-9:3/2",		1, 10,  -EINVAL, NULL },
+	{ "0-9:1/0",		1, 10,  -EINVAL, NULL },
+	{ "1x",			1, 10,  -EINVAL, NULL },
+	{ "3-10",		1, 10,  -ERANGE, NULL },
+	{ "ff,ffffff00",	0, 40,  0,	 "ff,ffffff00\n" },
+	{ "1,,00000002\n",	0, 64,  0,	 "00000001,00000002\n" },
+	{ "1ff,00000000",	0, 40,  -EOVERFLOW, NULL },
+	{ "1,0,0",		0, 64,  -EOVERFLOW, NULL },
+	{ "123456789",		0, 64,  -EOVERFLOW, NULL },
+	{ "12g4",		0, 64,  -EINVAL, NULL },
+};
+
+/*
+ * Fixed cases for the parsers, then random maps: the output must match
+ * the snprintf() reference, survive a round trip through the parsers and
+ * be cut cleanly by a small buffer.
+ */
+static int format_selftest(unsigned long iterations)
+{
+	static unsigned long map[BITS_TO_LONGS(4096)], back[BITS_TO_LONGS(4096)];
+	static char buf[32768], ref[32768];
+	unsigned long i;
+	double start, fmt_ns = 0, ref_ns = 0;
+
+	for (i = 0; i < ARRAY_SIZE(format_cases); i++) {
+		const char *str = format_cases[i].str;
+		int list = format_cases[i].list;
+		unsigned int nbits = format_cases[i].nbits;
+		int err;
+
+		if (list)
+			err = bitmap_parselist(str, map, nbits);
+		else
+			err = bitmap_parse(str, strlen(str), map, nbits);
+		if (!err)
+			bitmap_print_to_buf(list, buf, sizeof(buf), map, nbits);
+		if (err != format_cases[i].err || (!err && strcmp(buf, format_cases[i].canon))) {
+			printf("format self test: \"%s\" gave %d \"%s\"\n", str, err, err ? "" : buf);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < iterations; i++) {
+		unsigned int nbits = rand() % 4096;
+		int list = i & 1, len, cut;
+
+		memset(map, 0, sizeof(map));
+		for (int k = rand() % 64; k > 0 && nbits; k--) {
+			unsigned int s = rand() % nbits, run = 1 + rand() % 128;
+
+			__bitmap_set(map, s, rand() % min(nbits - s, run) + 1);
+		}
+
+		start = now_ns();
+		len = bitmap_print_to_buf(list, buf, sizeof(buf), map, nbits);
+		fmt_ns += now_ns() - start;
+		start = now_ns();
+		ref_format(list, ref, sizeof(ref), map, nbits);
+		ref_ns += now_ns() - start;
+
+		if (strcmp(buf, ref) || len != strlen(ref)) {
+			printf("format self test: %s of %u bits\n  got      %s  expected %s",
+			       list ? "list" : "hex", nbits, buf, ref);
+			return 1;
+		}
+
+		if ((list ? bitmap_parselist(buf, back, nbits) :
+			    bitmap_parse(buf, len, back, nbits)) ||
+		    !bitmap_equal(map, back, nbits)) {
+			printf("format self test: parsing back %s", buf);
+			return 1;
+		}
+
+		cut = rand() % (len + 1) + 1;
+		if (bitmap_print_to_buf(list, buf, cut, map, nbits) != cut - 1 ||
+		    strncmp(buf, ref, cut - 1) || buf[cut - 1]) {
+			printf("format self test: cut to %d bytes gave %s\n", cut, buf);
+			return 1;
+		}
+	}
+	printf("format self test: %lu maps passed, %.0f ns per map, %.0f ns with snprintf\n",
+	       iterations, fmt_ns / iterations, ref_ns / iterations);
+	return 0;
+}
+
+static void pbitmap_check(int err, const char *what)
+{
+	if (err < 0) {
+		fprintf(stderr, "persistent bitmap: %s: %s\n", what, strerror(-err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Create a persistent map of nbits bits, change it in a few rounds with
+ * incremental flushes, then reopen it and compare with a copy kept in
+ * memory. Finally damage one data byte and make sure verification fails.
+ * The file is removed at the end.
+ */
+static int pbitmap_selftest(const char *path, unsigned long nbits)
+{
+	unsigned long *ref = bench_alloc(nbits);
+	struct pbitmap pb;
+	double start, open_ns, verify_ns;
+	int ret = 0, fd;
+	char byte;
+
+	memset(ref, 0, pbitmap_data_size(nbits));
+	pbitmap_check(pbitmap_create(&pb, path, nbits), "create");
+
+	for (int round = 0; round < 4; round++) {
+		for (int k = 0; k < 64; k++) {
+			unsigned int start = rand() % nbits;
+			unsigned long run = 1UL << (rand() % 20);
+			int len = rand() % min(nbits - start + 1, run);
+
+			if (rand() % 4) {
+				pbitmap_set(&pb, start, len);
+				bitmap_set(ref, nbits, start, len);
+			} else {
+				pbitmap_clear(&pb, start, len);
+				bitmap_clear(ref, nbits, start, len);
+			}
+		}
+		printf("persistent bitmap: round %d flushed %ld of %lu pages\n",
+		       round, pbitmap_flush(&pb), pb.nr_pages);
+	}
+	pbitmap_check(pbitmap_close(&pb), "close");
+
+	start = now_ns();
+	pbitmap_check(pbitmap_open(&pb, path, 0), "open");
+	open_ns = now_ns() - start;
+	if (!bitmap_equal(pb.map, ref, nbits)) {
+		printf("persistent bitmap: map differs after reopening\n");
+		ret = 1;
+	}
+	pbitmap_check(pbitmap_close(&pb), "close");
+
+	start = now_ns();
+	pbitmap_check(pbitmap_open(&pb, path, 1), "open with verify");
+	verify_ns = now_ns() - start;
+	pbitmap_check(pbitmap_close(&pb), "close");
+	printf("persistent bitmap: %lu bits open in %.0f us, %.0f us with verify\n",
+	       nbits, open_ns / 1e3, verify_ns / 1e3);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0 || pread(fd, &byte, 1, sysconf(_SC_PAGESIZE)) != 1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	byte ^= 0x10;
+	if (pwrite(fd, &byte, 1, sysconf(_SC_PAGESIZE)) != 1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	if (pbitmap_open(&pb, path, 1) != -EBADMSG) {
+		printf("persistent bitmap: damaged data not detected\n");
+		ret = 1;
+	}
+
+	unlink(path);
+	free(ref);
+	if (!ret)
+		printf("persistent bitmap self test passed\n");
+	return ret;
+}
+
+/*
+ * Property tests
+ *
+ * A bool per bit is the model. Random operations are applied to the model
+ * and to a flat map, and mirrored into a hierarchical and a compressed
+ * map, then every routine is asked about the state and must agree with
+ * the model.
+ */
+
+#define PROP_MAX_BITS		2048
+
+struct prop_state {
+	unsigned int nbits;
+	bool model[PROP_MAX_BITS];
+	unsigned long map[BITS_TO_LONGS(PROP_MAX_BITS)];
+	/* Second operand of the whole-map operations */
+	bool model2[PROP_MAX_BITS];
+	unsigned long map2[BITS_TO_LONGS(PROP_MAX_BITS)];
+	struct hbitmap hb;
+	struct roaring rb;
+};
+
+static unsigned long model_next(const bool *model, unsigned long nbits,
+				unsigned long start, bool val)
+{
+	for (; start < nbits; start++)
+		if (model[start] == val)
+			return start;
+	return nbits;
+}
+
+static unsigned long model_zero_area(const bool *model, unsigned long nbits,
+				     unsigned long start, unsigned int nr,
+				     unsigned long align_mask)
+{
+	for (unsigned long i = __ALIGN_MASK(start, align_mask); i + nr <= nbits;
+	     i += align_mask + 1) {
+		if (model_next(model, i + nr, i, true) == i + nr)
+			return i;
+	}
+	return nbits;
+}
+
+/* Set or clear one bit everywhere after the flat map was changed */
+static void prop_mirror_bit(struct prop_state *st, unsigned long nr, bool val)
+{
+	st->model[nr] = val;
+	if (val) {
+		hbitmap_set(&st->hb, nr, 1);
+		roaring_check_alloc(roaring_set(&st->rb, nr, 1));
+	} else {
+		hbitmap_clear(&st->hb, nr, 1);
+		roaring_check_alloc(roaring_clear(&st->rb, nr, 1));
+	}
+}
+
+#define PROP_CHECK(cond, fmt, ...)						\
+	do {									\
+		if (!(cond)) {							\
+			printf("property test: step %lu, %u bits: " fmt "\n",	\
+			       step, st->nbits, ##__VA_ARGS__);			\
+			return 1;						\
+		}								\
+	} while (0)
+
+static int prop_step(struct prop_state *st, unsigned long step)
+{
+	unsigned int nbits = st->nbits;
+	unsigned long start = rand() % (nbits + 1), got, want;
+	int len = rand() % (nbits - start + 1);
+	unsigned long k;
+	int err;
+
+	switch (rand() % 9) {
+	case 0:
+	case 1: {
+		int set = rand() & 1, expect = 0;
+
+		/* Some ranges past the end or of negative length */
+		if (rand() % 8 == 0) {
+			len = nbits - start + 1 + rand() % 100;
+			expect = -ERANGE;
+		} else if (rand() % 8 == 0) {
+			len = -1 - rand() % 100;
+			expect = -EINVAL;
+		}
+		err = set ? bitmap_set(st->map, nbits, start, len) :
+			    bitmap_clear(st->map, nbits, start, len);
+		PROP_CHECK(err == expect, "%s %lu + %d returned %d", set ? "set" : "clear",
+			   start, len, err);
+		if (err)
+			break;
+		for (k = start; k < start + len; k++)
+			st->model[k] = set;
+		if (set) {
+			hbitmap_set(&st->hb, start, len);
+			roaring_check_alloc(roaring_set(&st->rb, start, len));
+		} else {
+			hbitmap_clear(&st->hb, start, len);
+			roaring_check_alloc(roaring_clear(&st->rb, start, len));
+		}
+		break;
+	}
+	case 2:
+		got = find_next_bit(st->map, nbits, start);
+		want = model_next(st->model, nbits, start, true);
+		PROP_CHECK(got == want, "find_next_bit(%lu) = %lu, want %lu", start, got, want);
+		got = hbitmap_find_next_bit(&st->hb, start);
+		PROP_CHECK(got == want, "hbitmap_find_next_bit(%lu) = %lu, want %lu", start, got, want);
+		got = find_next_zero_bit(st->map, nbits, start);
+		want = model_next(st->model, nbits, start, false);
+		PROP_CHECK(got == want, "find_next_zero_bit(%lu) = %lu, want %lu", start, got, want);
+		got = hbitmap_find_next_zero_bit(&st->hb, start);
+		PROP_CHECK(got == want, "hbitmap_find_next_zero_bit(%lu) = %lu, want %lu",
+			   start, got, want);
+		break;
+	case 3:
+		want = model_next(st->model, nbits, 0, true);
+		PROP_CHECK(find_first_bit(st->map, nbits) == want, "find_first_bit");
+		want = model_next(st->model, nbits, 0, false);
+		PROP_CHECK(find_first_zero_bit(st->map, nbits) == want, "find_first_zero_bit");
+		for (want = nbits; want > 0 && !st->model[want - 1]; want--)
+			;
+		want = want ? want - 1 : nbits;
+		PROP_CHECK(find_last_bit(st->map, nbits) == want, "find_last_bit");
+		break;
+	case 4: {
+		unsigned int nr = 1 + rand() % 64;
+		unsigned long align_mask = (1UL << (rand() % 7)) - 1;
+
+		got = bitmap_find_next_zero_area(st->map, nbits, start, nr, align_mask);
+		want = model_zero_area(st->model, nbits, start, nr, align_mask);
+		PROP_CHECK(got == want || (want == nbits && got + nr > nbits),
+			   "zero area from %lu of %u aligned %lu = %lu, want %lu",
+			   start, nr, align_mask + 1, got, want);
+		break;
+	}
+	case 5: {
+		unsigned long dst[BITS_TO_LONGS(PROP_MAX_BITS)];
+		unsigned long nwords = nbits / BITS_PER_LONG;
+		unsigned long w = 0;
+		bool any_and = false, any_andnot = false, equal = true;
+
+		/* Half of the time a copy with a few flipped bits */
+		for (k = 0; k < nbits; k++) {
+			st->model2[k] = rand() & 1;
+			if (rand() % 2)
+				st->model2[k] = st->model[k] ^ (rand() % 64 == 0);
+			__assign_bit(k, st->map2, st->model2[k]);
+			w += st->model[k];
+			any_and |= st->model[k] && st->model2[k];
+			any_andnot |= st->model[k] && !st->model2[k];
+			equal &= st->model[k] == st->model2[k];
+		}
+
+		PROP_CHECK(bitmap_and(dst, st->map, st->map2, nbits) == any_and, "bitmap_and result");
+		for (k = 0; k < nbits; k++)
+			PROP_CHECK(test_bit(k, dst) == (st->model[k] && st->model2[k]), "bitmap_and bit %lu", k);
+		PROP_CHECK(bitmap_andnot(dst, st->map, st->map2, nbits) == any_andnot, "bitmap_andnot result");
+		for (k = 0; k < nbits; k++)
+			PROP_CHECK(test_bit(k, dst) == (st->model[k] && !st->model2[k]), "bitmap_andnot bit %lu", k);
+		bitmap_or(dst, st->map, st->map2, nbits);
+		for (k = 0; k < nbits; k++)
+			PROP_CHECK(test_bit(k, dst) == (st->model[k] || st->model2[k]), "bitmap_or bit %lu", k);
+		bitmap_xor(dst, st->map, st->map2, nbits);
+		for (k = 0; k < nbits; k++)
+			PROP_CHECK(test_bit(k, dst) == (st->model[k] != st->model2[k]), "bitmap_xor bit %lu", k);
+		PROP_CHECK(bitmap_weight(st->map, nbits) == w, "bitmap_weight");
+		PROP_CHECK(bitmap_equal(st->map, st->map2, nbits) == equal, "bitmap_equal");
+		PROP_CHECK(bitmap_intersects(st->map, st->map2, nbits) == any_and, "bitmap_intersects");
+
+		/* Every implementation on the whole words */
+		for (int impl = 0; impl < BITMAP_IMPL_MAX; impl++) {
+			const struct bitmap_bulk_ops *ops = &bitmap_bulk_ops_table[impl];
+			const struct bitmap_bulk_ops *ref = &bitmap_bulk_ops_table[BITMAP_IMPL_SCALAR];
+			unsigned long dst2[BITS_TO_LONGS(PROP_MAX_BITS)];
+
+			if (!bitmap_impl_supported(impl))
+				continue;
+			PROP_CHECK(!ops->and(dst, st->map, st->map2, nwords) ==
+				   !ref->and(dst2, st->map, st->map2, nwords) &&
+				   !memcmp(dst, dst2, nwords * sizeof(*dst)), "%s and", ops->name);
+			PROP_CHECK(!ops->xor(dst, st->map, st->map2, nwords) ==
+				   !ref->xor(dst2, st->map, st->map2, nwords) &&
+				   !memcmp(dst, dst2, nwords * sizeof(*dst)), "%s xor", ops->name);
+			PROP_CHECK(ops->weight(st->map, nwords) == ref->weight(st->map, nwords),
+				   "%s weight", ops->name);
+			PROP_CHECK(ops->equal(st->map, st->map2, nwords) ==
+				   ref->equal(st->map, st->map2, nwords), "%s equal", ops->name);
+			PROP_CHECK(ops->intersects(st->map, st->map2, nwords) ==
+				   ref->intersects(st->map, st->map2, nwords), "%s intersects", ops->name);
+		}
+		break;
+	}
+	case 6:
+		if (start == nbits)
+			break;
+		if (rand() & 1) {
+			PROP_CHECK(test_and_set_bit(start, st->map) == st->model[start],
+				   "test_and_set_bit(%lu)", start);
+			prop_mirror_bit(st, start, true);
+		} else {
+			PROP_CHECK(test_and_clear_bit(start, st->map) == st->model[start],
+				   "test_and_clear_bit(%lu)", start);
+			prop_mirror_bit(st, start, false);
+		}
+		break;
+	case 7: {
+		unsigned long hint = start;
+
+		got = bitmap_claim_bit(st->map, nbits, &hint);
+		want = model_next(st->model, nbits, 0, false);
+		if (want == nbits) {
+			PROP_CHECK(got == nbits, "claim from a full map gave %lu", got);
+			break;
+		}
+		PROP_CHECK(got < nbits && !st->model[got], "claimed bit %lu was not free", got);
+		prop_mirror_bit(st, got, true);
+		break;
+	}
+	case 8: {
+		char buf[PAGE_SIZE * 4];
+		unsigned long back[BITS_TO_LONGS(PROP_MAX_BITS)];
+		int list = rand() & 1;
+
+		bitmap_print_to_buf(list, buf, sizeof(buf), st->map, nbits);
+		err = list ? bitmap_parselist(buf, back, nbits) :
+			     bitmap_parse(buf, sizeof(buf), back, nbits);
+		PROP_CHECK(!err && bitmap_equal(back, st->map, nbits), "parsing back %s", buf);
+		break;
+	}
+	}
+
+	/* The whole state after every step */
+	for (k = 0; k < nbits; k++) {
+		PROP_CHECK(test_bit(k, st->map) == st->model[k], "flat map bit %lu", k);
+		PROP_CHECK(hbitmap_test_bit(&st->hb, k) == st->model[k], "hbitmap bit %lu", k);
+	}
+	if (step % 16 == 0) {
+		for (k = 0; k < nbits; k++)
+			PROP_CHECK(roaring_test_bit(&st->rb, k) == st->model[k], "roaring bit %lu", k);
+	}
+	return 0;
+}
+
+static int property_test(unsigned long iterations, unsigned int seed)
+{
+	static struct prop_state state;
+	struct prop_state *st = &state;
+	unsigned long step = 0;
+
+	printf("property test: seed %u\n", seed);
+	srand(seed);
+	for (unsigned long i = 0; i < iterations; i++) {
+		memset(st, 0, sizeof(*st));
+		/* Small maps hit the edge cases, large ones the vector loops */
+		st->nbits = 1 + rand() % (i % 2 ? 200 : PROP_MAX_BITS);
+		if (hbitmap_init(&st->hb, st->nbits)) {
+			fprintf(stderr, "failed to allocate %u bits\n", st->nbits);
+			exit(EXIT_FAILURE);
+		}
+		roaring_init(&st->rb);
+
+		for (int k = 0; k < 200; k++, step++)
+			if (prop_step(st, step))
+				return 1;
+
+		hbitmap_destroy(&st->hb);
+		roaring_destroy(&st->rb);
+	}
+	printf("property test: %lu maps, %lu steps passed\n", iterations, step);
+	return 0;
+}
+
+/*
+ * Microbenchmarks
+ *
+ * Range set and clear, old word loop against the split version, and the
+ * searches, at several start alignments and lengths. One CSV line each.
+ */
+
+/* Keep the compiler from hoisting a search out of the timing loop */
+#define barrier()		__asm__ __volatile__("" ::: "memory")
+
+#define MICRO_MAP_BITS		(1UL << 27)
+#define MICRO_TOTAL_BITS	(1UL << 30)
+
+static void micro_line(const char *op, const char *impl, unsigned long align,
+		       unsigned long len, unsigned long iters, double ns)
+{
+	printf("%s,%s,%lu,%lu,%.2f,%.3f\n", op, impl, align, len, ns / iters,
+	       (double)len * iters / ns);
+}
+
+static void micro_benchmark(void)
+{
+	static const unsigned long aligns[] = { 0, 1, 33, 63 };
+	static const unsigned long lens[] = { 1, 7, 64, 100, 4096, 1UL << 16, 1UL << 20, 1UL << 26 };
+	unsigned long *map = bench_alloc(MICRO_MAP_BITS);
+	struct hbitmap hb;
+	double start;
+
+	if (hbitmap_init(&hb, MICRO_MAP_BITS)) {
+		fprintf(stderr, "failed to allocate %lu bits\n", MICRO_MAP_BITS);
+		exit(EXIT_FAILURE);
+	}
+	memset(map, 0, BITS_TO_LONGS(MICRO_MAP_BITS) * sizeof(unsigned long));
+
+	printf("op,impl,align,len,ns_per_call,bits_per_ns\n");
+	for (int a = 0; a < ARRAY_SIZE(aligns); a++) {
+		for (int l = 0; l < ARRAY_SIZE(lens); l++) {
+			unsigned long align = aligns[a], len = lens[l];
+			unsigned long iters = max(MICRO_TOTAL_BITS / len, 16UL);
+			/* Walk the map so short ranges do not stay in one word */
+			unsigned long span = MICRO_MAP_BITS - len - BITS_PER_LONG;
+			unsigned long stride = __ALIGN_MASK(len, BITS_PER_LONG - 1);
+			unsigned long i, pos, sink = 0;
+
+			iters = min(iters, 1UL << 24);
+
+#define MICRO_LOOP(expr)							\
+			do {							\
+				pos = 0;					\
+				start = now_ns();				\
+				for (i = 0; i < iters; i++) {			\
+					expr;					\
+					barrier();				\
+					pos += stride;				\
+					if (pos > span)				\
+						pos = 0;			\
+				}						\
+			} while (0)
+
+			MICRO_LOOP(__bitmap_set_loop(map, pos + align, len));
+			micro_line("set", "loop", align, len, iters, now_ns() - start);
+			MICRO_LOOP(__bitmap_set(map, pos + align, len));
+			micro_line("set", "split", align, len, iters, now_ns() - start);
+			MICRO_LOOP(__bitmap_clear_loop(map, pos + align, len));
+			micro_line("clear", "loop", align, len, iters, now_ns() - start);
+			MICRO_LOOP(__bitmap_clear(map, pos + align, len));
+			micro_line("clear", "split", align, len, iters, now_ns() - start);
+
+			/* The map is empty, the searched bit is len bits away */
+			__bitmap_set(map, align + len, 1);
+			hbitmap_set(&hb, align + len, 1);
+			MICRO_LOOP(sink += find_next_bit(map, MICRO_MAP_BITS, align));
+			micro_line("find_next_bit", "flat", align, len, iters, now_ns() - start);
+			MICRO_LOOP(sink += hbitmap_find_next_bit(&hb, align));
+			micro_line("find_next_bit", "hbitmap", align, len, iters, now_ns() - start);
+			__bitmap_clear(map, align + len, 1);
+			hbitmap_clear(&hb, align + len, 1);
+
+			__bitmap_set(map, 0, align + len);
+			hbitmap_set(&hb, 0, align + len);
+			MICRO_LOOP(sink += find_next_zero_bit(map, MICRO_MAP_BITS, align));
+			micro_line("find_next_zero_bit", "flat", align, len, iters, now_ns() - start);
+			MICRO_LOOP(sink += hbitmap_find_next_zero_bit(&hb, align));
+			micro_line("find_next_zero_bit", "hbitmap", align, len, iters, now_ns() - start);
+			__bitmap_clear(map, 0, align + len);
+			hbitmap_clear(&hb, 0, align + len);
+#undef MICRO_LOOP
+
+			bench_sink += sink;
+		}
+	}
+
+	hbitmap_destroy(&hb);
+	free(map);
+}
+
+/*
+ * Constant size paths against the generic ones: the results must agree
+ * on random maps, then both are timed. Every size gets its own function
+ * so nbits stays a compile time constant.
+ */
+
+#define FIXED_MAPS		64
+#define FIXED_ROUNDS		(1UL << 16)
+
+#define FIXED_TIME(sink, expr)							\
+	({									\
+		double __start = now_ns();					\
+		for (unsigned long r = 0; r < FIXED_ROUNDS; r++)		\
+			for (int m = 0; m < FIXED_MAPS; m++) {			\
+				sink += (expr);					\
+				barrier();					\
+			}							\
+		(now_ns() - __start) / (FIXED_ROUNDS * FIXED_MAPS);		\
+	})
+
+#define DEFINE_FIXED_TEST(N)							\
+static int fixed_test_##N(void)							\
+{										\
+	static unsigned long a[FIXED_MAPS][BITS_TO_LONGS(N)];			\
+	static unsigned long b[FIXED_MAPS][BITS_TO_LONGS(N)];			\
+	DECLARE_BITMAP(d1, N);							\
+	DECLARE_BITMAP(d2, N);							\
+	unsigned long sink = 0;							\
+										\
+	for (int m = 0; m < FIXED_MAPS; m++) {					\
+		for (int k = 0; k < BITS_TO_LONGS(N); k++) {			\
+			/* Sparse ones too, for the searches */			\
+			a[m][k] = rand_long() & (m % 2 ? rand_long() & rand_long() : ~0UL); \
+			b[m][k] = m % 4 ? rand_long() : a[m][k];		\
+		}								\
+	}									\
+										\
+	for (int m = 0; m < FIXED_MAPS; m++) {					\
+		unsigned long start = rand() % (N + 1);				\
+										\
+		if (bitmap_and(d1, a[m], b[m], N) != __bitmap_and(d2, a[m], b[m], N) || \
+		    !__bitmap_equal(d1, d2, N) ||					\
+		    (bitmap_or(d1, a[m], b[m], N), __bitmap_or(d2, a[m], b[m], N),	\
+		     !__bitmap_equal(d1, d2, N)) ||					\
+		    (bitmap_xor(d1, a[m], b[m], N), __bitmap_xor(d2, a[m], b[m], N),	\
+		     !__bitmap_equal(d1, d2, N)) ||					\
+		    (bitmap_copy(d1, a[m], N), !__bitmap_equal(d1, a[m], N)) ||	\
+		    bitmap_empty(a[m], N) != (_find_first_bit(a[m], N) >= N) ||	\
+		    bitmap_full(a[m], N) != (_find_first_zero_bit(a[m], N) >= N) ||	\
+		    (bitmap_zero(d1, N), !bitmap_empty(d1, N) || __bitmap_weight(d1, N)) || \
+		    (bitmap_fill(d1, N), !bitmap_full(d1, N) ||			\
+		     __bitmap_weight(d1, N) != N ||					\
+		     (N % BITS_PER_LONG && d1[BITS_TO_LONGS(N) - 1] & ~BITMAP_LAST_WORD_MASK(N))) || \
+		    bitmap_andnot(d1, a[m], b[m], N) != __bitmap_andnot(d2, a[m], b[m], N) || \
+		    !__bitmap_equal(d1, d2, N) ||					\
+		    bitmap_weight(a[m], N) != __bitmap_weight(a[m], N) ||		\
+		    bitmap_equal(a[m], b[m], N) != __bitmap_equal(a[m], b[m], N) ||	\
+		    bitmap_intersects(a[m], b[m], N) != __bitmap_intersects(a[m], b[m], N) || \
+		    find_next_bit(a[m], N, start) != _find_next_bit(a[m], N, start) ||	\
+		    find_next_zero_bit(a[m], N, start) != _find_next_zero_bit(a[m], N, start) || \
+		    find_last_bit(a[m], N) != _find_last_bit(a[m], N)) {		\
+			printf("fixed size test: %d bits map %d differs\n", N, m);	\
+			return 1;						\
+		}								\
+	}									\
+										\
+	printf("and,%d,%.2f,%.2f\n", N,						\
+	       FIXED_TIME(sink, bitmap_and(d1, a[m], b[m], N)),		\
+	       FIXED_TIME(sink, __bitmap_and(d1, a[m], b[m], N)));		\
+	printf("or,%d,%.2f,%.2f\n", N,						\
+	       FIXED_TIME(sink, (bitmap_or(d1, a[m], b[m], N), d1[0])),	\
+	       FIXED_TIME(sink, (__bitmap_or(d1, a[m], b[m], N), d1[0])));	\
+	printf("weight,%d,%.2f,%.2f\n", N,					\
+	       FIXED_TIME(sink, bitmap_weight(a[m], N)),			\
+	       FIXED_TIME(sink, __bitmap_weight(a[m], N)));			\
+	printf("equal,%d,%.2f,%.2f\n", N,					\
+	       FIXED_TIME(sink, bitmap_equal(a[m], b[m], N)),			\
+	       FIXED_TIME(sink, __bitmap_equal(a[m], b[m], N)));		\
+	printf("find_next_bit,%d,%.2f,%.2f\n", N,				\
+	       FIXED_TIME(sink, find_next_bit(a[m], N, m)),			\
+	       FIXED_TIME(sink, _find_next_bit(a[m], N, m)));			\
+	printf("set_one_word,%d,%.2f,%.2f\n", N,				\
+	       FIXED_TIME(sink, bitmap_set(a[m], N, 3, 40)),			\
+	       FIXED_TIME(sink, (__bitmap_set(a[m], 3, 40), 0)));		\
+	bench_sink += sink;							\
+	return 0;								\
+}
+
+DEFINE_FIXED_TEST(64)
+DEFINE_FIXED_TEST(100)
+DEFINE_FIXED_TEST(128)
+DEFINE_FIXED_TEST(256)
+DEFINE_FIXED_TEST(500)
+DEFINE_FIXED_TEST(512)
+
+static int fixed_test(void)
+{
+	printf("op,nbits,fixed_ns,generic_ns\n");
+	return fixed_test_64() || fixed_test_100() || fixed_test_128() ||
+	       fixed_test_256() || fixed_test_500() || fixed_test_512();
+}
+
+#define CLAIM_BITS		4096
+/* Bits each thread holds at a time, the map can never fill up */
+#define CLAIM_HELD		16
+#define CLAIM_MAX_THREADS	(CLAIM_BITS / CLAIM_HELD)
+#define CLAIM_OPS		(1UL << 20)
+
+enum claim_mode {
+	CLAIM_MUTEX,
+	CLAIM_ATOMIC_NOHINT,
+	CLAIM_ATOMIC,
+	CLAIM_MODE_MAX,
+};
+
+static const char *const claim_mode_names[] = {
+	[CLAIM_MUTEX]		= "mutex",
+	[CLAIM_ATOMIC_NOHINT]	= "atomic-nohint",
+	[CLAIM_ATOMIC]		= "atomic",
+};
+
+struct claim_thread {
+	pthread_t thread;
+	int tid;
+	int nthreads;
+	enum claim_mode mode;
+	unsigned long *map;
+	/* Owner of every bit, only for the stress test */
+	int *owner;
+	unsigned long errors;
+};
+
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long claim_one(struct claim_thread *t, unsigned long *hint)
+{
+	unsigned long bit;
+
+	switch (t->mode) {
+	case CLAIM_MUTEX:
+		pthread_mutex_lock(&claim_lock);
+		bit = find_first_zero_bit(t->map, CLAIM_BITS);
+		if (bit < CLAIM_BITS)
+			__bitmap_set(t->map, bit, 1);
+		pthread_mutex_unlock(&claim_lock);
+		return bit;
+	case CLAIM_ATOMIC_NOHINT:
+		*hint = 0;
+		/* fall through */
+	default:
+		return bitmap_claim_bit(t->map, CLAIM_BITS, hint);
+	}
+}
+
+static void release_one(struct claim_thread *t, unsigned long bit)
+{
+	if (t->mode == CLAIM_MUTEX) {
+		pthread_mutex_lock(&claim_lock);
+		__bitmap_clear(t->map, bit, 1);
+		pthread_mutex_unlock(&claim_lock);
+	} else {
+		bitmap_release_bit(t->map, bit);
+	}
+}
+
+/*
+ * Keep CLAIM_HELD bits, release the oldest one and claim a new one on
+ * every step. In the stress test every fourth bit is taken with
+ * test_and_set_bit() on a random bit instead, and the owner array
+ * catches a bit handed out twice.
+ */
+static void *claim_worker(void *arg)
+{
+	struct claim_thread *t = arg;
+	unsigned long held[CLAIM_HELD];
+	unsigned long hint = CLAIM_BITS / t->nthreads * t->tid;
+	unsigned int seed = t->tid;
+	unsigned long i, bit;
+
+	for (i = 0; i < CLAIM_OPS + CLAIM_HELD; i++) {
+		unsigned long slot = i % CLAIM_HELD;
+
+		if (i >= CLAIM_HELD) {
+			bit = held[slot];
+			if (t->owner &&
+			    __atomic_exchange_n(&t->owner[bit], -1, __ATOMIC_RELAXED) != t->tid)
+				t->errors++;
+			release_one(t, bit);
+		}
+		if (i >= CLAIM_OPS)
+			continue;
+
+		/*
+		 * Mix in test_and_set_bit() claims of random bits, but not with
+		 * the mutex, whose non-atomic updates would race with them.
+		 */
+		if (t->owner && t->mode != CLAIM_MUTEX && i % 4 == 3) {
+			do {
+				bit = rand_r(&seed) % CLAIM_BITS;
+			} while (test_and_set_bit(bit, t->map));
+		} else {
+			bit = claim_one(t, &hint);
+			if (bit >= CLAIM_BITS) {
+				t->errors++;
+				break;
+			}
+		}
+		if (t->owner &&
+		    __atomic_exchange_n(&t->owner[bit], t->tid, __ATOMIC_RELAXED) != -1)
+			t->errors++;
+		held[slot] = bit;
+	}
+	return NULL;
+}
+
+/* Returns the wall time of the run in ns, the errors are summed in *errors */
+static double claim_run(enum claim_mode mode, int nthreads, int *owner, unsigned long *errors)
+{
+	unsigned long map[BITS_TO_LONGS(CLAIM_BITS)] = {0};
+	struct claim_thread *threads = calloc(nthreads, sizeof(*threads));
+	double start;
+	int i;
+
+	if (!threads) {
+		fprintf(stderr, "failed to allocate %d threads\n", nthreads);
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].tid = i;
+		threads[i].nthreads = nthreads;
+		threads[i].mode = mode;
+		threads[i].map = map;
+		threads[i].owner = owner;
+		if (pthread_create(&threads[i].thread, NULL, claim_worker, &threads[i])) {
+			fprintf(stderr, "failed to create thread %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		*errors += threads[i].errors;
+	}
+	start = now_ns() - start;
+
+	/* Everything claimed was released again */
+	if (find_first_bit(map, CLAIM_BITS) < CLAIM_BITS)
+		(*errors)++;
+
+	free(threads);
+	return start;
+}
+
+static int claim_stress(int nthreads)
+{
+	int owner[CLAIM_BITS];
+	int mode, ret = 0;
+
+	for (mode = 0; mode < CLAIM_MODE_MAX; mode++) {
+		unsigned long errors = 0;
+
+		for (int k = 0; k < CLAIM_BITS; k++)
+			owner[k] = -1;
+		claim_run(mode, nthreads, owner, &errors);
+		printf("claim stress test, %s, %d threads: %lu errors\n",
+		       claim_mode_names[mode], nthreads, errors);
+		if (errors)
+			ret = 1;
+	}
+	return ret;
+}
+
+/* Claim and release throughput from 1 to max_threads threads, CSV output */
+static void claim_benchmark(int max_threads)
+{
+	printf("mode,threads,mops_per_s\n");
+	for (int mode = 0; mode < CLAIM_MODE_MAX; mode++) {
+		for (int n = 1; ; n = min(n * 2, max_threads)) {
+			unsigned long errors = 0;
+			double ns = claim_run(mode, n, NULL, &errors);
+
+			printf("%s,%d,%.2f\n", claim_mode_names[mode], n,
+			       (double)CLAIM_OPS * n / ns * 1e3);
+			if (n == max_threads)
+				break;
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-B] [-m max_bits] [-T iterations [-s seed]] [-A] [-C] [-t threads] [-H maps] [-R maps] [-P file] [-F maps]\n", prog);
+	printf("       %s [-p maps] [-s seed] [-b] [-f]\n", prog);
+	printf("  -B             benchmark the whole-map operations, CSV output\n");
+	printf("  -m max_bits    largest map size of the benchmark (default %lu)\n", BENCH_MAX_BITS);
+	printf("  -T iterations  compare range set/clear with the word loops\n");
+	printf("  -A             stress test the atomic bit claiming\n");
+	printf("  -C             benchmark claiming bits from 1 up to threads threads, CSV output\n");
+	printf("  -t threads     threads of -A and -C (default online CPUs, at most %d)\n", CLAIM_MAX_THREADS);
+	printf("  -H maps        check the hierarchical bitmap on random maps and compare\n");
+	printf("                 its searches with the flat map on max_bits bits\n");
+	printf("  -R maps        check the compressed bitmap on random maps and report\n");
+	printf("                 its size for runs in max_bits bits\n");
+	printf("  -P file        check a persistent bitmap of max_bits bits in file,\n");
+	printf("                 the file is removed afterwards\n");
+	printf("  -F maps        check list and hex formatting and parsing on random maps\n");
+	printf("  -p maps        property test every routine against a bool per bit\n");
+	printf("  -s seed        random seed of -T and -p (default time)\n");
+	printf("  -b             set/clear/search microbenchmarks, CSV output\n");
+	printf("  -f             check and time the constant size paths, CSV output\n");
+	printf("  without options run the demo\n");
+}
+
+static void demo_range(unsigned long *map, unsigned long map_size, int set,
+		       unsigned int start, int len)
+{
+	int err;
+
+	if (set)
+		err = bitmap_set(map, map_size, start, len);
+	else
+		err = bitmap_clear(map, map_size, start, len);
+
+	if (err)
+		printf("%s %u + %d in %lu bits: %s\n", set ? "set" : "clear",
+		       start, len, map_size, strerror(-err));
+	else
+		print_bitmap(map, BITS_TO_LONGS(map_size));
+}
+
+static int bitset_demo(void)
+{
+	unsigned long map[8] = {0};
+	unsigned long map_size = sizeof(map) * 8; // Bit per char is 8
+	char buf[PAGE_SIZE];
+
+	demo_range(map, map_size, 1, 311, 68);
+	demo_range(map, map_size, 1, 518, 88);
+	demo_range(map, map_size, 1, 78, 168);
+	demo_range(map, map_size, 0, 121, 18);
+
+	printf("first bit: %lu, last bit: %lu, first zero bit: %lu\n",
+		find_first_bit(map, map_size), find_last_bit(map, map_size),
+		find_first_zero_bit(map, map_size));
+	printf("next zero bit after 78: %lu, 64 free bits aligned to 64 after 64 at: %lu\n",
+		find_next_zero_bit(map, map_size, 78),
+		bitmap_find_next_zero_area(map, map_size, 64, 64, 63));
+
+	bitmap_print_to_pagebuf(1, buf, map, map_size);
+	printf("list: %s", buf);
+	bitmap_print_to_pagebuf(0, buf, map, map_size);
+	printf("mask: %s", buf);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long max_bits = BENCH_MAX_BITS;
+	unsigned long selftest = 0, hbitmap_maps = 0, roaring_maps = 0, format_maps = 0;
+	unsigned long prop_maps = 0;
+	unsigned int seed = time(NULL);
+	int micro = 0, fixed = 0;
+	const char *pbitmap_path = NULL;
+	int nthreads = min(sysconf(_SC_NPROCESSORS_ONLN), CLAIM_MAX_THREADS);
+	int bench = 0, stress = 0, claim_bench = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "Bm:T:ACt:H:R:P:F:p:s:bfh")) != -1) {
+		switch (opt) {
+		case 'B':
+			bench = 1;
+			break;
+		case 'm':
+			max_bits = strtoul(optarg, NULL, 0);
+			if (max_bits < BENCH_MIN_BITS) {
+				fprintf(stderr, "max_bits must be at least %lu\n", BENCH_MIN_BITS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			selftest = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			stress = 1;
+			break;
+		case 'C':
+			claim_bench = 1;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'H':
+			hbitmap_maps = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			roaring_maps = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			pbitmap_path = optarg;
+			break;
+		case 'F':
+			format_maps = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			prop_maps = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			micro = 1;
+			break;
+		case 'f':
+			fixed = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nthreads < 1 || nthreads > CLAIM_MAX_THREADS) {
+		fprintf(stderr, "threads must be in 1..%d\n", CLAIM_MAX_THREADS);
+		return EXIT_FAILURE;
+	}
+
+	if (selftest)
+		return range_selftest(selftest, seed);
+
+	if (stress)
+		return claim_stress(nthreads);
+
+	if (hbitmap_maps) {
+		if (hbitmap_selftest(hbitmap_maps))
+			return 1;
+		hbitmap_benchmark(min(max_bits, (unsigned long)UINT_MAX));
+		return 0;
+	}
+
+	if (prop_maps)
+		return property_test(prop_maps, seed);
+
+	if (fixed)
+		return fixed_test();
+
+	if (micro) {
+		micro_benchmark();
+		return 0;
+	}
+
+	if (format_maps)
+		return format_selftest(format_maps);
+
+	if (pbitmap_path)
+		return pbitmap_selftest(pbitmap_path, min(max_bits, (unsigned long)UINT_MAX));
+
+	if (roaring_maps) {
+		if (roaring_selftest(roaring_maps))
+			return 1;
+		roaring_report(min(max_bits, ROARING_MAX_BITS));
+		return 0;
+	}
+
+	if (claim_bench) {
+		claim_benchmark(nthreads);
+		return 0;
+	}
+
+	if (bench) {
+		bulk_benchmark(max_bits);
+		return 0;
+	}
+
+	return bitset_demo();
+}
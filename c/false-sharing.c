@@ -1,15 +1,31 @@
 /*
- * gcc -Wall -lpthread -g -o false-sharing false-sharing.c
+ * gcc -Wall -lpthread -g -o false-sharing false-sharing.c percpu_counter.c pagemap.c
  * perf stat -e cache-misses ./false-sharing
  *
+ * Cycles, instructions, cache misses and HITM (Intel only) of every writer
+ * are also collected with perf_event_open() directly, so "perf" itself is
+ * not needed. Writers run without counters if perf events are unavailable
+ * (e.g. /proc/sys/kernel/perf_event_paranoid is too strict).
+ *
  * NOTE: the UC write (option: -t 2) need to access /dev/mem, to archive it:
  *    1. Disable kernel config: "# CONFIG_STRICT_DEVMEM is not set"
  *    2. Disable PAT by kernel option: "nopat"
+ *
+ * Topology-aware runs:
+ *    ./false-sharing -n 4 -p socket    # 4 workers on distinct cores of a socket
+ *    ./false-sharing -n 2 -c 0,32      # 2 workers pinned to CPU 0 and 32
+ *    ./false-sharing -m -l 100000000   # coherence cost matrix of all CPU pairs
+ *    ./false-sharing -H -c 0,1         # per-thread latency percentiles
+ *    ./false-sharing -S -c 0,1 > s.csv # throughput vs. distance of x and y
+ *    ./false-sharing -C -n 8 -p socket # shared atomic vs. per-CPU counter
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -20,6 +36,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <cpuid.h>
+#include <immintrin.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "pagemap.h"
+#include "percpu_counter.h"
 
 /* x86 L1 cache line size is 64B */
 #define L1_CACHE_SHIFT  (6)
@@ -48,15 +72,56 @@ typedef unsigned long u64;
 
 #define LOOP_MAX (1000000000)
 
+#define SYSFS_CPU_DIR "/sys/devices/system/cpu"
+
+// Fold a per-CPU counter slot into the global count every this many updates
+#define PERCPU_COUNTER_BATCH (32)
+
+// Stride sweep covers the adjacent cache line prefetcher, which pulls 128B pairs
+#define SWEEP_MAX_STRIDE (4 * SMP_CACHE_BYTES)
+
 static int g_infinite;
+static long g_loops = LOOP_MAX;
 
 enum write_type {
 	FULL_CACHELINE,	// full cacheline write by default
 	NT_WRITE,
 	UC_WRTIE,
+	ATOMIC_ADD,	// lock xadd
+	STORE_RELAXED,	// relaxed atomic store, a plain mov on x86
+	STORE_SEQ_CST,	// seq_cst atomic store, xchg on x86
+	NT_WRITE_32,	// 32-byte AVX non-temporal store
+	NT_WRITE_64,	// 64-byte AVX-512 non-temporal store of the whole line
+	CLFLUSHOPT_WRITE, // store then clflushopt
+	CLWB_WRITE,	// store then clwb
 	WRITE_MAX,
 };
 
+// CPU features some of the write types depend on
+#define CPU_FEAT_AVX		(1 << 0)
+#define CPU_FEAT_AVX512F	(1 << 1)
+#define CPU_FEAT_CLFLUSHOPT	(1 << 2)
+#define CPU_FEAT_CLWB		(1 << 3)
+
+struct write_type_info {
+	const char *name;
+	int width;	// bytes written at once, slots are aligned to it
+	u32 features;	// required CPU_FEAT_*
+};
+
+static struct write_type_info write_type_info[] = {
+	[FULL_CACHELINE]   = { "full cacheline", 8, 0 },
+	[NT_WRITE]         = { "non-temporal", 8, 0 },
+	[UC_WRTIE]         = { "uncachable", 8, 0 },
+	[ATOMIC_ADD]       = { "atomic fetch_add", 8, 0 },
+	[STORE_RELAXED]    = { "relaxed atomic store", 8, 0 },
+	[STORE_SEQ_CST]    = { "seq_cst atomic store", 8, 0 },
+	[NT_WRITE_32]      = { "32-byte non-temporal", 32, CPU_FEAT_AVX },
+	[NT_WRITE_64]      = { "64-byte non-temporal", 64, CPU_FEAT_AVX512F },
+	[CLFLUSHOPT_WRITE] = { "store+clflushopt", 8, CPU_FEAT_CLFLUSHOPT },
+	[CLWB_WRITE]       = { "store+clwb", 8, CPU_FEAT_CLWB },
+};
+
 // No padding, might be sharing the same cacheline
 typedef struct {
 	volatile long x;
@@ -70,17 +135,125 @@ typedef struct {
 	volatile long y;
 } sharing_t;
 
+// How the workers are spread over the CPUs
+enum placement {
+	PLACE_NONE,	// let the scheduler decide
+	PLACE_SMT,	// SMT siblings of the same core
+	PLACE_SOCKET,	// different cores of the same socket
+	PLACE_CROSS,	// alternate between sockets
+};
+
+static const char *placement_name[] = {
+	[PLACE_NONE]   = "none",
+	[PLACE_SMT]    = "smt",
+	[PLACE_SOCKET] = "socket",
+	[PLACE_CROSS]  = "cross",
+};
+
+struct cpu_topology {
+	int cpu;
+	int core_id;
+	int package_id;
+};
+
+// CPUs this process is allowed to run on, in ascending order
+static struct cpu_topology g_topo[CPU_SETSIZE];
+static int g_nr_topo;
+
+/*
+ * HDR-style log-linear latency histogram: values below HIST_SUB_COUNT have
+ * their own bucket, above that every power of 2 is split into HIST_SUB_COUNT
+ * linear sub-buckets, so the error of a recorded value is below 1/16.
+ * Each worker owns its histogram, nothing is shared while recording.
+ */
+#define HIST_SUB_BITS	(4)
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+	u64 count;
+	u64 max;
+	u64 buckets[HIST_BUCKETS];
+} ____cacheline_aligned;
+
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_HITM,	// load hit a modified line in another core's cache
+	PERF_MAX,
+};
+
+struct perf_counter_desc {
+	const char *name;
+	u32 type;
+	u64 config;
+};
+
+// The HITM raw event is model specific, it's filled by detect_hitm_event()
+static struct perf_counter_desc perf_counter_table[PERF_MAX] = {
+	[PERF_CYCLES]       = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_CACHE_MISSES] = { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PERF_HITM]         = { "hitm", PERF_TYPE_RAW, 0 },
+};
+
+// perf events can be opened by this process
+static int g_perf;
+
+// write function gets the 'struct worker' of its thread as the argument
+typedef void * (*write_func)(void *arg);
+
+struct worker {
+	pthread_t tid;
+	int cpu;		// CPU to pin to, -1 if not pinned
+	volatile long *var;	// the variable this worker keeps writing
+	write_func fn;
+	struct histogram *hist;	// per-iteration latency, NULL if not sampling
+	u64 last_tsc;
+	int perf_fd[PERF_MAX];	// -1 if the counter isn't available
+	u64 perf_val[PERF_MAX];
+	struct timespec start, end;
+} ____cacheline_aligned;
+
+// TSC ticks per nanosecond, calibrated when histograms are enabled
+static double g_tsc_per_ns;
+
+static pthread_barrier_t g_start_barrier;
+
 void show_help(char *program)
 {
-	fprintf(stderr, "\nUsage: %s [-t write_type] [-s]\n"
+	fprintf(stderr, "\nUsage: %s [-t write_type] [-s] [-n threads] [-c cpulist | -p placement] [-m]\n"
 		"\t-t write_type: the type to write memory:\n"
 		"\t                 0 - full cacheline\n"
 		"\t                 1 - non-temporal write\n"
 		"\t                 2 - write uncachable memory\n"
+		"\t                 3 - atomic fetch_add (lock xadd)\n"
+		"\t                 4 - relaxed atomic store\n"
+		"\t                 5 - seq_cst atomic store\n"
+		"\t                 6 - 32-byte AVX non-temporal store\n"
+		"\t                 7 - 64-byte AVX-512 non-temporal store\n"
+		"\t                 8 - store + clflushopt\n"
+		"\t                 9 - store + clwb\n"
 		"\t-s           : sharing cacheline test (false-sharing by default)\n"
+		"\t-n threads   : number of writer threads, 2 by default\n"
+		"\t-c cpulist   : pin the writers to these CPUs, e.g. \"0,2,4-7\"\n"
+		"\t-p placement : pick the CPUs from sysfs topology:\n"
+		"\t                 smt    - SMT siblings of the same core\n"
+		"\t                 socket - different cores of the same socket\n"
+		"\t                 cross  - alternate between sockets\n"
+		"\t-m           : run 2 pinned writers on every CPU pair and print\n"
+		"\t               the coherence cost matrix\n"
+		"\t-S           : sweep the distance between the writers' variables\n"
+		"\t               from the store width to %d bytes, print CSV\n"
+		"\t-C           : compare a shared atomic counter with per-CPU\n"
+		"\t               counters at 1..threads writers, print CSV\n"
+		"\t-l loops     : writes per thread, %d by default\n"
+		"\t-H           : sample per-iteration latency with rdtsc and report\n"
+		"\t               the percentiles of each thread\n"
 		"\t-i           : infinite looping and never exit\n"
 		"\t-h           : print this help\n\n",
-		program);
+		program, SWEEP_MAX_STRIDE, LOOP_MAX);
 }
 
 void get_xy_addresses(int is_sharing, void *data, volatile long **x,
@@ -99,40 +272,376 @@ void get_xy_addresses(int is_sharing, void *data, volatile long **x,
 }
 
 /*
- * Get information about address from /proc/self/pagemap
+ * Read a single integer from a sysfs file, return -1 if it can't be read
  */
-unsigned long long vtop(unsigned long long addr)
+static int read_sysfs_int(const char *path)
 {
-	static int pagesize;
-	unsigned long long pinfo;
-	long offset;
-	int fd;
+	FILE *fp = fopen(path, "r");
+	int val = -1;
 
-	if (pagesize == 0)
-	    pagesize = getpagesize();
-	offset = addr / pagesize * (sizeof pinfo);
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &val) != 1)
+		val = -1;
+	fclose(fp);
 
-	fd = open("/proc/self/pagemap", O_RDONLY);
-	if (fd == -1) {
-	    perror("pagemap");
-	    exit(EXIT_FAILURE);
+	return val;
+}
+
+/*
+ * Collect core and socket IDs of the CPUs we are allowed to run on
+ */
+static void read_topology(void)
+{
+	char path[128];
+	cpu_set_t allowed;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) FATAL;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		struct cpu_topology *t = &g_topo[g_nr_topo];
+
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+
+		t->cpu = cpu;
+		snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/topology/core_id", cpu);
+		t->core_id = read_sysfs_int(path);
+		snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/topology/physical_package_id", cpu);
+		t->package_id = read_sysfs_int(path);
+		// No topology exported (e.g. some VMs), treat each CPU as its own core
+		if (t->core_id < 0)
+			t->core_id = cpu;
+		if (t->package_id < 0)
+			t->package_id = 0;
+		g_nr_topo++;
+	}
+}
+
+static struct cpu_topology *find_topology(int cpu)
+{
+	for (int i = 0; i < g_nr_topo; i++)
+		if (g_topo[i].cpu == cpu)
+			return &g_topo[i];
+	return NULL;
+}
+
+/*
+ * How two CPUs are related, which decides the cost of moving a cache line
+ * between them
+ */
+static const char *cpu_relation(int cpu_a, int cpu_b)
+{
+	struct cpu_topology *a = find_topology(cpu_a), *b = find_topology(cpu_b);
+
+	if (!a || !b)
+		return "unknown";
+	if (a->cpu == b->cpu)
+		return "same-cpu";
+	if (a->package_id != b->package_id)
+		return "cross-socket";
+	if (a->core_id == b->core_id)
+		return "smt";
+	return "same-socket";
+}
+
+/*
+ * Parse a cpulist like "0,2,4-7" into cpus[], return the number of CPUs
+ */
+static int parse_cpulist(const char *list, int *cpus, int max)
+{
+	const char *p = list;
+	int n = 0;
+
+	while (*p) {
+		char *end;
+		long first, last;
+
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			return -1;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (n >= max)
+				return -1;
+			cpus[n++] = cpu;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		p = end;
+	}
+
+	return n;
+}
+
+static int cpu_used(int cpu, int *cpus, int n)
+{
+	for (int i = 0; i < n; i++)
+		if (cpus[i] == cpu)
+			return 1;
+	return 0;
+}
+
+static int core_used(struct cpu_topology *t, int *cpus, int n)
+{
+	for (int i = 0; i < n; i++) {
+		struct cpu_topology *u = find_topology(cpus[i]);
+
+		if (u->package_id == t->package_id && u->core_id == t->core_id)
+			return 1;
 	}
+	return 0;
+}
+
+/*
+ * Pick nr CPUs for the workers according to the placement, the first worker
+ * always goes to the first allowed CPU. Return 0 on success, -1 if the
+ * machine doesn't have enough CPUs of the requested kind.
+ */
+static int pick_cpus(enum placement place, int *cpus, int nr)
+{
+	if (g_nr_topo == 0)
+		return -1;
+
+	cpus[0] = g_topo[0].cpu;
+	for (int i = 1; i < nr; i++) {
+		struct cpu_topology *first = &g_topo[0];
+		struct cpu_topology *prev = find_topology(cpus[i - 1]);
+		int found = -1;
+
+		for (int j = 0; j < g_nr_topo && found < 0; j++) {
+			struct cpu_topology *t = &g_topo[j];
+
+			if (cpu_used(t->cpu, cpus, i))
+				continue;
 
-	if (pread(fd, &pinfo, sizeof pinfo, offset) != sizeof pinfo) {
-	    perror("pagemap");
-	    exit(EXIT_FAILURE);
+			switch (place) {
+			case PLACE_SMT:
+				if (t->package_id == first->package_id &&
+				    t->core_id == first->core_id)
+					found = t->cpu;
+				break;
+			case PLACE_SOCKET:
+				if (t->package_id == first->package_id &&
+				    !core_used(t, cpus, i))
+					found = t->cpu;
+				break;
+			case PLACE_CROSS:
+				if (t->package_id != prev->package_id &&
+				    !core_used(t, cpus, i))
+					found = t->cpu;
+				break;
+			default:
+				return -1;
+			}
+		}
+
+		if (found < 0)
+			return -1;
+		cpus[i] = found;
 	}
 
+	return 0;
+}
+
+static __always_inline u64 rdtsc(void)
+{
+	u32 lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((u64)hi << 32) | lo;
+}
+
+static __always_inline int hist_index(u64 val)
+{
+	int shift;
+
+	if (val < HIST_SUB_COUNT)
+		return val;
+
+	shift = (63 - __builtin_clzl(val)) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT + ((val >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/* The highest value which falls into the bucket */
+static u64 hist_bucket_value(int idx)
+{
+	int shift = idx / HIST_SUB_COUNT - 1;
+	u64 sub = idx % HIST_SUB_COUNT;
+
+	if (shift < 0)
+		return idx;
+	return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+static __always_inline void hist_record(struct histogram *h, u64 val)
+{
+	h->buckets[hist_index(val)]++;
+	h->count++;
+	if (val > h->max)
+		h->max = val;
+}
+
+/* Value at the given percentile, e.g. 99.9 */
+static u64 hist_percentile(struct histogram *h, double percentile)
+{
+	u64 target = (u64)(h->count * percentile / 100.0 + 0.5);
+	u64 seen = 0;
+
+	if (target == 0)
+		target = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			return hist_bucket_value(i) < h->max ? hist_bucket_value(i) : h->max;
+	}
+	return h->max;
+}
+
+/*
+ * Record the time since the previous iteration of the worker, the overhead
+ * is one rdtsc per iteration
+ */
+static __always_inline void worker_sample(struct worker *w)
+{
+	struct histogram *h = w->hist;
+	u64 now;
+
+	if (!h)
+		return;
+
+	now = rdtsc();
+	hist_record(h, now - w->last_tsc);
+	w->last_tsc = now;
+}
+
+/*
+ * Find out how many TSC ticks are in one nanosecond
+ */
+static void calibrate_tsc(void)
+{
+	struct timespec start, end, delay = { .tv_nsec = 50 * 1000 * 1000 };
+	u64 tsc_start, tsc_end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tsc_start = rdtsc();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	tsc_end = rdtsc();
+
+	g_tsc_per_ns = (tsc_end - tsc_start) /
+		((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec));
+}
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+			    int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+/*
+ * MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM (XSNP_FWD on newer parts) of Intel core
+ * PMU: event 0xd2 umask 0x04, it's what "perf c2c" keys on. Other vendors
+ * have no equivalent we can use without knowing the exact model.
+ */
+static void detect_hitm_event(void)
+{
+	u32 eax, ebx, ecx, edx;
+	char vendor[13];
+
+	if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+		return;
+	memcpy(vendor, &ebx, 4);
+	memcpy(vendor + 4, &edx, 4);
+	memcpy(vendor + 8, &ecx, 4);
+	vendor[12] = '\0';
+	if (strcmp(vendor, "GenuineIntel"))
+		return;
+
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (((eax >> 8) & 0xf) == 6)
+		perf_counter_table[PERF_HITM].config = 0x04d2;
+}
+
+static int perf_open_counter(enum perf_counter c)
+{
+	struct perf_event_attr attr;
+
+	if (perf_counter_table[c].type == PERF_TYPE_RAW && !perf_counter_table[c].config)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_counter_table[c].type;
+	attr.config = perf_counter_table[c].config;
+	attr.disabled = 1;
+	// User space only, that's all we need and what paranoid level 2 allows
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	// Count the calling thread on whatever CPU it runs
+	return perf_event_open(&attr, 0, -1, -1, 0);
+}
+
+/*
+ * Check if we can use perf events at all, so that we complain only once
+ */
+static void perf_probe(void)
+{
+	int fd = perf_open_counter(PERF_CYCLES);
+
+	if (fd == -1) {
+		printf("perf events not available (%s), run without counters\n",
+			strerror(errno));
+		return;
+	}
 	close(fd);
+	detect_hitm_event();
+	g_perf = 1;
+}
 
-	if ((pinfo & (1ull << 63)) == 0) {
-	    printf("page not present\n");
-	    exit(EXIT_FAILURE);
-	    return ~0ull;  // should not reach here
+static void perf_start(struct worker *w)
+{
+	for (int i = 0; i < PERF_MAX; i++) {
+		w->perf_fd[i] = g_perf ? perf_open_counter(i) : -1;
+		if (w->perf_fd[i] == -1)
+			continue;
+		ioctl(w->perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(w->perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
 	}
+}
 
-	return ((pinfo & 0x007fffffffffffffull) * pagesize)
-			+ (addr & (pagesize - 1));
+static void perf_stop(struct worker *w)
+{
+	struct {
+		u64 value;
+		u64 time_enabled;
+		u64 time_running;
+	} data;
+
+	for (int i = 0; i < PERF_MAX; i++) {
+		if (w->perf_fd[i] == -1)
+			continue;
+		ioctl(w->perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(w->perf_fd[i], &data, sizeof(data)) != sizeof(data)) {
+			close(w->perf_fd[i]);
+			w->perf_fd[i] = -1;
+			continue;
+		}
+		// Scale up if the counter was multiplexed with other events
+		if (data.time_running && data.time_running < data.time_enabled)
+			data.value = (double)data.value * data.time_enabled / data.time_running;
+		w->perf_val[i] = data.value;
+		close(w->perf_fd[i]);
+	}
 }
 
 static __always_inline void clflush(volatile void *__p)
@@ -142,7 +651,42 @@ static __always_inline void clflush(volatile void *__p)
 
 static inline void clflushopt(volatile void *__p)
 {
-    asm volatile(".byte 0x3e; clflush %0" : "+m" (*(volatile char *)__p));
+    asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)__p));
+}
+
+static inline void clwb(volatile void *__p)
+{
+    asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)__p));
+}
+
+/*
+ * CPUID tells what the CPU can do, XCR0 tells if the OS saves the vector
+ * registers, both are needed before we can touch ymm/zmm.
+ */
+static u32 detect_cpu_features(void)
+{
+	u32 eax, ebx, ecx, edx, xcr0 = 0;
+	u32 features = 0;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	if (ecx & bit_OSXSAVE)
+		asm volatile("xgetbv" : "=a" (xcr0) : "c" (0) : "edx");
+	// SSE and AVX state
+	if ((ecx & bit_AVX) && (xcr0 & 0x6) == 0x6)
+		features |= CPU_FEAT_AVX;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return features;
+	// opmask, upper ZMM0-15 and ZMM16-31 state
+	if ((ebx & bit_AVX512F) && (features & CPU_FEAT_AVX) && (xcr0 & 0xe0) == 0xe0)
+		features |= CPU_FEAT_AVX512F;
+	if (ebx & bit_CLFLUSHOPT)
+		features |= CPU_FEAT_CLFLUSHOPT;
+	if (ebx & bit_CLWB)
+		features |= CPU_FEAT_CLWB;
+
+	return features;
 }
 
 static __always_inline void nt_mov(void *dst, const void *src, size_t cnt)
@@ -163,10 +707,12 @@ static __always_inline void nt_mov(void *dst, const void *src, size_t cnt)
 
 void * full_write(void *arg)
 {
-	volatile long *var = (volatile long*)arg;
+	struct worker *w = arg;
+	volatile long *var = w->var;
 
-	for (int i = 0; g_infinite || i < LOOP_MAX; ++i) {
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
 		(*var)++;
+		worker_sample(w);
 	}
 	return NULL;
 }
@@ -174,10 +720,12 @@ void * full_write(void *arg)
 // NT write will invalidate the copy in cache first if there is
 void * nt_write(void *arg)
 {
-	volatile long *var = (volatile long*)arg;
+	struct worker *w = arg;
+	volatile long *var = w->var;
 
-	for (int i = 0; g_infinite || i < LOOP_MAX; ++i) {
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
 		nt_mov((void *)var, (const void *)&i, sizeof(*var));
+		worker_sample(w);
 	}
 	return NULL;
 }
@@ -188,37 +736,467 @@ void * nt_write(void *arg)
 // But here for testing purpose we ignore is.
 void * uc_write(void *arg)
 {
-	volatile long *var = (volatile long*)arg;
+	struct worker *w = arg;
+	volatile long *var = w->var;
 
-	for (int i = 0; g_infinite || i < LOOP_MAX; ++i) {
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
 		(*var)++;
+		worker_sample(w);
 	}
 	return NULL;
 }
 
-typedef void * (*write_func)(void *arg);
+// lock xadd, the fetched value is consumed so that it's not a plain lock add
+void * atomic_add_write(void *arg)
+{
+	struct worker *w = arg;
+	volatile long *var = w->var;
+	long sum = 0;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		sum += __atomic_fetch_add(var, 1, __ATOMIC_SEQ_CST);
+		worker_sample(w);
+	}
+	return (void *)sum;
+}
+
+void * store_relaxed_write(void *arg)
+{
+	struct worker *w = arg;
+	volatile long *var = w->var;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		__atomic_store_n(var, i, __ATOMIC_RELAXED);
+		worker_sample(w);
+	}
+	return NULL;
+}
+
+// On x86 only seq_cst store needs a full barrier, it's an implicitly locked xchg
+void * store_seq_cst_write(void *arg)
+{
+	struct worker *w = arg;
+	volatile long *var = w->var;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		__atomic_store_n(var, i, __ATOMIC_SEQ_CST);
+		worker_sample(w);
+	}
+	return NULL;
+}
+
+__attribute__((target("avx")))
+void * nt_write_32(void *arg)
+{
+	struct worker *w = arg;
+	__m256i *var = (__m256i *)w->var;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		_mm256_stream_si256(var, _mm256_set1_epi64x(i));
+		worker_sample(w);
+	}
+	return NULL;
+}
+
+// The whole cache line is overwritten, no RFO needed at all
+__attribute__((target("avx512f")))
+void * nt_write_64(void *arg)
+{
+	struct worker *w = arg;
+	__m512i *var = (__m512i *)w->var;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		_mm512_stream_si512(var, _mm512_set1_epi64(i));
+		worker_sample(w);
+	}
+	return NULL;
+}
+
+// Write back and evict the line after every store
+void * clflushopt_write(void *arg)
+{
+	struct worker *w = arg;
+	volatile long *var = w->var;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		(*var)++;
+		clflushopt(var);
+		worker_sample(w);
+	}
+	return NULL;
+}
+
+// Write back the line after every store, it may stay in the cache
+void * clwb_write(void *arg)
+{
+	struct worker *w = arg;
+	volatile long *var = w->var;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		(*var)++;
+		clwb(var);
+		worker_sample(w);
+	}
+	return NULL;
+}
+
+static struct percpu_counter g_counter;
+
+// All the writers increment the same counter
+void * shared_counter_write(void *arg)
+{
+	struct worker *w = arg;
+	volatile long *var = w->var;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		__atomic_fetch_add(var, 1, __ATOMIC_RELAXED);
+		worker_sample(w);
+	}
+	return NULL;
+}
+
+// Every writer increments the slot of the CPU it runs on
+void * percpu_counter_write(void *arg)
+{
+	struct worker *w = arg;
+
+	for (long i = 0; g_infinite || i < g_loops; ++i) {
+		percpu_counter_inc(&g_counter);
+		worker_sample(w);
+	}
+	return NULL;
+}
 
 // Write functions table
 static write_func write_func_table[] = {
 	[FULL_CACHELINE] = full_write,
 	[NT_WRITE]       = nt_write,
 	[UC_WRTIE]       = uc_write,
+	[ATOMIC_ADD]     = atomic_add_write,
+	[STORE_RELAXED]  = store_relaxed_write,
+	[STORE_SEQ_CST]  = store_seq_cst_write,
+	[NT_WRITE_32]    = nt_write_32,
+	[NT_WRITE_64]    = nt_write_64,
+	[CLFLUSHOPT_WRITE] = clflushopt_write,
+	[CLWB_WRITE]     = clwb_write,
 	[WRITE_MAX]      = NULL,
 };
 
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (errno) FATAL;
+	}
+
+	// Don't let the early birds run alone while the others are still created
+	pthread_barrier_wait(&g_start_barrier);
+
+	perf_start(w);
+	clock_gettime(CLOCK_MONOTONIC, &w->start);
+	if (w->hist)
+		w->last_tsc = rdtsc();
+	w->fn(w);
+	clock_gettime(CLOCK_MONOTONIC, &w->end);
+	perf_stop(w);
+
+	return NULL;
+}
+
+/*
+ * Start nr workers at the same time and wait for all of them to finish
+ */
+static void run_workers(struct worker *workers, int nr)
+{
+	errno = pthread_barrier_init(&g_start_barrier, NULL, nr);
+	if (errno) FATAL;
+
+	for (int i = 0; i < nr; i++) {
+		errno = pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+		if (errno) FATAL;
+	}
+
+	for (int i = 0; i < nr; i++)
+		pthread_join(workers[i].tid, NULL);
+
+	pthread_barrier_destroy(&g_start_barrier);
+}
+
+/* Millions of writes per second done by one worker */
+static double worker_mops(struct worker *w)
+{
+	return g_loops / elapsed_ns(&w->start, &w->end) * 1e3;
+}
+
+/*
+ * Counters of every worker, then the sum normalized per write for the
+ * write type under test
+ */
+static void report_counters(struct worker *workers, int nr, enum write_type wr_type)
+{
+	u64 total[PERF_MAX] = { 0 };
+	int valid[PERF_MAX] = { 0 };
+
+	if (!g_perf)
+		return;
+
+	for (int i = 0; i < nr; i++) {
+		struct worker *w = &workers[i];
+
+		printf("Thread %d:", i);
+		for (int c = 0; c < PERF_MAX; c++) {
+			if (w->perf_fd[c] == -1) {
+				printf(" %s n/a", perf_counter_table[c].name);
+				continue;
+			}
+			printf(" %s %lu", perf_counter_table[c].name, w->perf_val[c]);
+			total[c] += w->perf_val[c];
+			valid[c]++;
+		}
+		if (w->perf_fd[PERF_CYCLES] != -1 && w->perf_fd[PERF_INSTRUCTIONS] != -1 &&
+		    w->perf_val[PERF_CYCLES])
+			printf(" IPC %.2f", (double)w->perf_val[PERF_INSTRUCTIONS] /
+				w->perf_val[PERF_CYCLES]);
+		printf("\n");
+	}
+
+	printf("Counters per write (%s):", write_type_info[wr_type].name);
+	for (int c = 0; c < PERF_MAX; c++) {
+		if (valid[c] == nr)
+			printf(" %s %.4f", perf_counter_table[c].name,
+				(double)total[c] / ((double)g_loops * nr));
+	}
+	printf("\n");
+}
+
+static void report_workers(struct worker *workers, int nr, enum write_type wr_type)
+{
+	for (int i = 0; i < nr; i++) {
+		struct worker *w = &workers[i];
+
+		printf("Thread %d: cpu ", i);
+		if (w->cpu >= 0)
+			printf("%d", w->cpu);
+		else
+			printf("-");
+		printf(" var=%p %.2f ms %.2f Mops/s\n", w->var,
+			elapsed_ns(&w->start, &w->end) / 1e6, worker_mops(w));
+
+		if (w->hist && w->hist->count) {
+			struct histogram *h = w->hist;
+
+			printf("Thread %d: latency ns p50 %.1f p99 %.1f p99.9 %.1f max %.1f (%lu samples)\n",
+				i, hist_percentile(h, 50) / g_tsc_per_ns,
+				hist_percentile(h, 99) / g_tsc_per_ns,
+				hist_percentile(h, 99.9) / g_tsc_per_ns,
+				h->max / g_tsc_per_ns, h->count);
+		}
+	}
+
+	report_counters(workers, nr, wr_type);
+
+	if (nr > 1) {
+		double slowest = worker_mops(&workers[0]), fastest = slowest;
+
+		for (int i = 1; i < nr; i++) {
+			double mops = worker_mops(&workers[i]);
+
+			if (mops < slowest)
+				slowest = mops;
+			if (mops > fastest)
+				fastest = mops;
+		}
+		printf("Imbalance: slowest %.2f Mops/s fastest %.2f Mops/s (%.2fx)\n",
+			slowest, fastest, fastest / slowest);
+	}
+
+	// Relation to the first worker tells which cache line transfers we pay for
+	for (int i = 1; i < nr; i++) {
+		if (workers[0].cpu < 0 || workers[i].cpu < 0)
+			break;
+		printf("Pair %d-%d: cpu %d-%d %s %.2f Mops/s\n", 0, i,
+			workers[0].cpu, workers[i].cpu,
+			cpu_relation(workers[0].cpu, workers[i].cpu),
+			worker_mops(&workers[0]) + worker_mops(&workers[i]));
+	}
+}
+
+/*
+ * Place the workers' variables 'stride' bytes apart, for every stride from
+ * the store width up to SWEEP_MAX_STRIDE, print one CSV row per stride.
+ * The workers keep their CPUs, 'base' must have room for the largest stride.
+ */
+static void run_sweep(struct worker *workers, int nr, void *base, int width)
+{
+	printf("stride,threads,total_mops,min_thread_mops,max_thread_mops\n");
+
+	for (int stride = width; stride <= SWEEP_MAX_STRIDE; stride += width) {
+		double total = 0, slowest = 0, fastest = 0;
+
+		memset(base, 0, (nr - 1) * SWEEP_MAX_STRIDE + width);
+		for (int i = 0; i < nr; i++) {
+			workers[i].var = (volatile long *)(base + i * stride);
+			clflush(workers[i].var);
+		}
+
+		run_workers(workers, nr);
+
+		for (int i = 0; i < nr; i++) {
+			double mops = worker_mops(&workers[i]);
+
+			total += mops;
+			if (i == 0 || mops < slowest)
+				slowest = mops;
+			if (i == 0 || mops > fastest)
+				fastest = mops;
+		}
+		printf("%d,%d,%.2f,%.2f,%.2f\n", stride, nr, total, slowest, fastest);
+		fflush(stdout);
+	}
+}
+
+static double total_mops(struct worker *workers, int nr)
+{
+	double total = 0;
+
+	for (int i = 0; i < nr; i++)
+		total += worker_mops(&workers[i]);
+	return total;
+}
+
+/*
+ * Run the per-CPU counter with the given batch on nr workers, return the
+ * throughput of all of them. Exit if any increment got lost.
+ */
+static double run_percpu_counter(struct worker *workers, int nr, long batch)
+{
+	long sum;
+
+	if (percpu_counter_init(&g_counter, 0, batch)) FATAL;
+
+	for (int i = 0; i < nr; i++)
+		workers[i].fn = percpu_counter_write;
+	run_workers(workers, nr);
+
+	sum = percpu_counter_sum(&g_counter);
+	percpu_counter_flush(&g_counter);
+	if (sum != nr * g_loops || percpu_counter_read(&g_counter) != sum) {
+		fprintf(stderr, "Error: per-CPU counter (batch %ld) is %ld, expected %ld\n",
+			batch, sum, nr * g_loops);
+		exit(EXIT_FAILURE);
+	}
+	percpu_counter_destroy(&g_counter);
+
+	return total_mops(workers, nr);
+}
+
+/*
+ * Increment one shared atomic counter vs. the per-CPU counter with 1..nr
+ * writers, the workers keep their CPUs. Print one CSV row per number of
+ * writers.
+ */
+static void run_counter_bench(struct worker *workers, int nr, volatile long *shared)
+{
+	printf("threads,shared_atomic_mops,percpu_mops,percpu_batch%d_mops\n",
+		PERCPU_COUNTER_BATCH);
+
+	for (int t = 1; t <= nr; t++) {
+		double shared_mops, percpu_mops, batch_mops;
+
+		*shared = 0;
+		for (int i = 0; i < t; i++) {
+			workers[i].var = shared;
+			workers[i].fn = shared_counter_write;
+		}
+		run_workers(workers, t);
+		if (*shared != t * g_loops) {
+			fprintf(stderr, "Error: shared counter is %ld, expected %ld\n",
+				*shared, t * g_loops);
+			exit(EXIT_FAILURE);
+		}
+		shared_mops = total_mops(workers, t);
+
+		percpu_mops = run_percpu_counter(workers, t, 0);
+		batch_mops = run_percpu_counter(workers, t, PERCPU_COUNTER_BATCH);
+
+		printf("%d,%.2f,%.2f,%.2f\n", t, shared_mops, percpu_mops, batch_mops);
+		fflush(stdout);
+	}
+}
+
+/*
+ * Run 2 pinned writers on every pair of allowed CPUs and print the combined
+ * throughput, the lower it is the more expensive the cache line transfer
+ * between the two CPUs.
+ */
+static void run_matrix(write_func fn, volatile long *x, volatile long *y)
+{
+	struct worker workers[2];
+
+	if (g_nr_topo < 2) {
+		printf("Need at least 2 CPUs for the matrix, have %d\n", g_nr_topo);
+		return;
+	}
+
+	printf("Coherence cost matrix (Mops/s of both writers, loops=%ld):\n", g_loops);
+	printf("%8s", "");
+	for (int j = 0; j < g_nr_topo; j++)
+		printf(" %8d", g_topo[j].cpu);
+	printf("\n");
+
+	for (int i = 0; i < g_nr_topo; i++) {
+		printf("%8d", g_topo[i].cpu);
+		for (int j = 0; j < g_nr_topo; j++) {
+			if (j <= i) {
+				printf(" %8s", "-");
+				continue;
+			}
+
+			memset(workers, 0, sizeof(workers));
+			workers[0] = (struct worker){ .cpu = g_topo[i].cpu, .var = x, .fn = fn };
+			workers[1] = (struct worker){ .cpu = g_topo[j].cpu, .var = y, .fn = fn };
+			run_workers(workers, 2);
+
+			printf(" %8.2f", worker_mops(&workers[0]) + worker_mops(&workers[1]));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	printf("\nCPU topology:\n");
+	for (int i = 0; i < g_nr_topo; i++)
+		printf("cpu %d: socket %d core %d\n", g_topo[i].cpu,
+			g_topo[i].package_id, g_topo[i].core_id);
+}
+
 int main(int argc, char *argv[])
 {
 	void *map_base = NULL, *new_virt_addr = NULL, *data = NULL;
 	write_func worker = NULL; // full cacheline write by default
 	int is_sharing = 0; // false sharing by default
-	size_t data_size = 0;
+	size_t data_size = 0, stride = 0, width;
 	enum write_type wr_type = FULL_CACHELINE;
+	enum placement place = PLACE_NONE;
 	long long paddr = 0;
 	volatile long *x, *y;
-	pthread_t t1, t2;
+	struct worker *workers;
+	int cpus[CPU_SETSIZE];
+	int nr_threads = 2, nr_cpus = 0, matrix = 0, latency = 0, sweep = 0;
+	int counter = 0;
 	int opt, fd;
 
-	while ((opt = getopt(argc, argv, "hist:")) != -1) {
+	while ((opt = getopt(argc, argv, "Cc:HhiSl:mn:p:st:")) != -1) {
 		switch (opt) {
 		case 's':
 			is_sharing = 1;
@@ -234,6 +1212,49 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'n':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1 || nr_threads > CPU_SETSIZE) {
+				fprintf(stderr, "Error: invalid number of threads.\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'c':
+			nr_cpus = parse_cpulist(optarg, cpus, CPU_SETSIZE);
+			if (nr_cpus <= 0) {
+				fprintf(stderr, "Error: invalid cpulist \"%s\".\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			for (place = PLACE_SMT; place <= PLACE_CROSS; place++)
+				if (!strcmp(optarg, placement_name[place]))
+					break;
+			if (place > PLACE_CROSS) {
+				fprintf(stderr, "Error: unrecognized placement.\n");
+				show_help(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'm':
+			matrix = 1;
+			break;
+		case 'S':
+			sweep = 1;
+			break;
+		case 'C':
+			counter = 1;
+			break;
+		case 'l':
+			g_loops = atol(optarg);
+			if (g_loops <= 0) {
+				fprintf(stderr, "Error: invalid number of loops.\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'H':
+			latency = 1;
+			break;
 		case 'h':
 		default: /* '?' */
 			show_help(argv[0]);
@@ -241,11 +1262,64 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	printf("Size of false sharing data: %zu vs sharing data: %zu\n",
-		sizeof(false_sharing_t), sizeof(sharing_t));
+	if (write_type_info[wr_type].features & ~detect_cpu_features()) {
+		fprintf(stderr, "Error: write type %d (%s) is not supported by this CPU.\n",
+			wr_type, write_type_info[wr_type].name);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((matrix || sweep || counter) && g_infinite) {
+		fprintf(stderr, "Error: -m, -S and -C can't loop infinitely.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (matrix + sweep + counter > 1) {
+		fprintf(stderr, "Error: only one of -m, -S and -C can be used.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	read_topology();
+
+	if (nr_cpus) {
+		// One CPU per worker, the list overrides -n
+		nr_threads = nr_cpus;
+		for (int i = 0; i < nr_cpus; i++) {
+			if (!find_topology(cpus[i])) {
+				fprintf(stderr, "Error: CPU %d is not available.\n", cpus[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (place != PLACE_NONE)
+			fprintf(stderr, "Warning: -c overrides -p %s\n", placement_name[place]);
+	} else if (place != PLACE_NONE) {
+		if (pick_cpus(place, cpus, nr_threads)) {
+			fprintf(stderr, "Error: not enough CPUs for %d threads with placement %s.\n",
+				nr_threads, placement_name[place]);
+			exit(EXIT_FAILURE);
+		}
+		nr_cpus = nr_threads;
+	}
+
+	// Sweep and counter comparison print nothing but the CSV
+	if (!sweep && !counter)
+		printf("Size of false sharing data: %zu vs sharing data: %zu\n",
+			sizeof(false_sharing_t), sizeof(sharing_t));
+
+	// Worker i writes x + i * stride, the stride is the distance of 'x' and 'y'
+	stride = is_sharing ? offsetof(sharing_t, y) : offsetof(false_sharing_t, y);
+	// Vector stores need their slots aligned to the store width
+	width = write_type_info[wr_type].width;
+	stride = (stride + width - 1) / width * width;
 
 	// Allocate memory space
 	data_size = is_sharing ? sizeof(sharing_t) : sizeof(false_sharing_t);
+	if (sweep)
+		stride = SWEEP_MAX_STRIDE;
+	if ((nr_threads - 1) * stride + width > data_size)
+		data_size = (nr_threads - 1) * stride + width;
+	if (wr_type == UC_WRTIE && data_size > MAP_SIZE) {
+		fprintf(stderr, "Error: %d threads don't fit in one UC page.\n", nr_threads);
+		exit(EXIT_FAILURE);
+	}
 	new_virt_addr = data = mmap(NULL, data_size,
 							PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
 	if (data == MAP_FAILED) FATAL;
@@ -254,6 +1328,8 @@ int main(int argc, char *argv[])
 	if (wr_type == UC_WRTIE) {
 		// Get the physical address of 'data'
 		paddr = vtop((unsigned long long)data);
+		if (paddr == PAGEMAP_INVALID)
+			exit(EXIT_FAILURE);
 		printf("data=%p PA=0x%llx\n", data, paddr);
 
 		// Re-map the page where the 'data' is located with UC memory type,
@@ -266,34 +1342,69 @@ int main(int argc, char *argv[])
 	}
 
 	get_xy_addresses(is_sharing, new_virt_addr, &x, &y);
+	y = (volatile long *)((void *)x + stride);
 
-	clflushopt(x);
-	if (is_sharing)
-		clflushopt(y); // 'y' is not in the same cache line is this case
+	workers = aligned_alloc(SMP_CACHE_BYTES, nr_threads * sizeof(*workers));
+	if (!workers) FATAL;
+	memset(workers, 0, nr_threads * sizeof(*workers));
 
 	worker = write_func_table[wr_type];
-	printf("x=%p y=%p %ssharing write_type=%d\n",
-			x, y, is_sharing ? "" : "false-", wr_type);
+	for (int i = 0; i < nr_threads; i++) {
+		workers[i].var = (volatile long *)((void *)x + i * stride);
+		workers[i].cpu = nr_cpus ? cpus[i] : -1;
+		workers[i].fn = worker;
+		clflush(workers[i].var);
+		if (latency && !matrix && !sweep && !counter) {
+			workers[i].hist = aligned_alloc(SMP_CACHE_BYTES, sizeof(struct histogram));
+			if (!workers[i].hist) FATAL;
+			memset(workers[i].hist, 0, sizeof(struct histogram));
+		}
+	}
+
+	if (latency)
+		calibrate_tsc();
+	if (sweep) {
+		run_sweep(workers, nr_threads, (void *)x, width);
+		goto out;
+	}
+	if (counter) {
+		run_counter_bench(workers, nr_threads, x);
+		goto out;
+	}
+
+	if (!matrix)
+		perf_probe();
+
+	printf("x=%p y=%p %ssharing write_type=%d (%s)\n",
+			x, y, is_sharing ? "" : "false-", wr_type, write_type_info[wr_type].name);
+
+	if (matrix) {
+		run_matrix(worker, x, y);
+		goto out;
+	}
+
+	printf("threads=%d placement=%s\n", nr_threads,
+		nr_cpus ? (place != PLACE_NONE ? placement_name[place] : "cpulist") : "none");
 
 	// Start testing, record the time
 	struct timespec start, end;
 	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	// Create and start 2 threads and testing
-	pthread_create(&t1, NULL, worker, (void*)x);
-	pthread_create(&t2, NULL, worker, (void*)y);
-
-	// Wait for the threads end
-	pthread_join(t1, NULL);
-	pthread_join(t2, NULL);
+	// Create and start the threads and testing, wait for the threads end
+	run_workers(workers, nr_threads);
 
 	// End testing
 	clock_gettime(CLOCK_MONOTONIC, &end);
-	long duration_ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
-	double duration_ms = duration_ns / 1e6;
+	double duration_ms = elapsed_ns(&start, &end) / 1e6;
 	printf("Time: %.2f ms\n", duration_ms);
 
+	report_workers(workers, nr_threads, wr_type);
+
+out:
 	// Release resources
+	for (int i = 0; i < nr_threads; i++)
+		free(workers[i].hist);
+	free(workers);
 	if (wr_type == UC_WRTIE) {
 		munmap(map_base, MAP_SIZE);
 		close(fd);
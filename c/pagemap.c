@@ -0,0 +1,275 @@
+/*
+ * Virtual to physical address translation, see pagemap.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pagemap.h"
+
+static int g_pagemap_fd = -1;
+static int g_kpageflags_fd = -1;
+
+/*
+ * Open path once and cache the fd in *cache
+ */
+static int cached_open(int *cache, const char *path)
+{
+	int fd = __atomic_load_n(cache, __ATOMIC_ACQUIRE);
+	int expected = -1;
+
+	if (fd != -1)
+		return fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	// Another thread may have opened it meanwhile, keep only one
+	if (!__atomic_compare_exchange_n(cache, &expected, fd, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(fd);
+		fd = expected;
+	}
+
+	return fd;
+}
+
+static void cached_close(int *cache)
+{
+	int fd = __atomic_exchange_n(cache, -1, __ATOMIC_ACQ_REL);
+
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * pread() all of size bytes, the kernel walks large ranges in chunks so be
+ * prepared for short reads
+ */
+static int pread_full(int fd, void *buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t ret = pread(fd, (char *)buf + done, size - done, offset + done);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+int pagemap_fd(void)
+{
+	return cached_open(&g_pagemap_fd, "/proc/self/pagemap");
+}
+
+void pagemap_close(void)
+{
+	cached_close(&g_pagemap_fd);
+	cached_close(&g_kpageflags_fd);
+}
+
+int pagemap_read(unsigned long long addr, unsigned long nr_pages, uint64_t *entries)
+{
+	static long pagesize;
+	int fd;
+
+	if (pagesize == 0)
+		pagesize = getpagesize();
+
+	fd = pagemap_fd();
+	if (fd == -1)
+		return -1;
+
+	return pread_full(fd, entries, nr_pages * sizeof(*entries),
+			  addr / pagesize * sizeof(*entries));
+}
+
+int kpageflags_read(uint64_t pfn, unsigned long nr, uint64_t *flags)
+{
+	int fd = cached_open(&g_kpageflags_fd, "/proc/kpageflags");
+
+	if (fd == -1)
+		return -1;
+
+	return pread_full(fd, flags, nr * sizeof(*flags), pfn * sizeof(*flags));
+}
+
+long vtop_range(unsigned long long addr, unsigned long nr_pages, uint64_t *paddrs)
+{
+	long pagesize = getpagesize();
+	long present = 0;
+
+	// Entries and physical addresses have the same size, translate in place
+	if (pagemap_read(addr, nr_pages, paddrs))
+		return -1;
+
+	for (unsigned long i = 0; i < nr_pages; i++) {
+		uint64_t pinfo = paddrs[i];
+
+		if (pinfo & PM_PRESENT) {
+			paddrs[i] = (pinfo & PM_PFN_MASK) * pagesize;
+			present++;
+		} else {
+			paddrs[i] = PAGEMAP_INVALID;
+		}
+	}
+
+	return present;
+}
+
+unsigned long long vtop(unsigned long long addr)
+{
+	static int pagesize;
+	uint64_t pinfo;
+
+	if (pagesize == 0)
+		pagesize = getpagesize();
+
+	if (pagemap_read(addr, 1, &pinfo)) {
+		perror("pagemap");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((pinfo & PM_PRESENT) == 0) {
+		printf("page not present\n");
+		return PAGEMAP_INVALID;
+	}
+
+	return ((pinfo & PM_PFN_MASK) * pagesize) + (addr & (pagesize - 1));
+}
+
+/*
+ * Find the VMA of addr in /proc/self/smaps, return the size of the pages
+ * the kernel maps it with and whether it's a hugetlb mapping. Return 0 on
+ * success, -1 if addr isn't mapped.
+ */
+static int smaps_lookup(unsigned long long addr, unsigned long long *page_size,
+			int *hugetlb)
+{
+	FILE *fp = fopen("/proc/self/smaps", "r");
+	unsigned long long start, end, kb;
+	int found = 0, ret = -1;
+	char line[512];
+
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		// VMA header: "start-end perms offset dev inode path", the
+		// fields that follow it start with a capital letter
+		if ((isdigit(line[0]) || islower(line[0])) &&
+		    sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+			if (found)
+				break;
+			found = addr >= start && addr < end;
+			continue;
+		}
+		if (!found)
+			continue;
+		if (sscanf(line, "KernelPageSize: %llu kB", &kb) == 1) {
+			*page_size = kb * 1024;
+			ret = 0;
+		}
+	}
+	fclose(fp);
+
+	// hugetlbfs is the only case the kernel page size isn't the base page
+	*hugetlb = ret == 0 && *page_size > (unsigned long long)getpagesize();
+
+	return ret;
+}
+
+/*
+ * Walk the flags of the max_pages aligned PFN window around pfn to find the
+ * head of the compound page and how many base pages it has
+ */
+static int compound_extent(uint64_t pfn, unsigned long max_pages,
+			   uint64_t *head, unsigned long *nr_pages)
+{
+	uint64_t base = pfn & ~((uint64_t)max_pages - 1);
+	uint64_t *flags = malloc(max_pages * sizeof(*flags));
+	unsigned long i, n;
+
+	if (!flags)
+		return -1;
+	if (kpageflags_read(base, max_pages, flags)) {
+		free(flags);
+		return -1;
+	}
+
+	i = pfn - base;
+	while (i > 0 && !(flags[i] & KPF_COMPOUND_HEAD))
+		i--;
+	for (n = 1; i + n < max_pages && (flags[i + n] & KPF_COMPOUND_TAIL); n++)
+		;
+
+	*head = base + i;
+	*nr_pages = n;
+	free(flags);
+
+	return 0;
+}
+
+int vtop_page(unsigned long long addr, struct page_info *info)
+{
+	unsigned long long pagesize = getpagesize();
+	unsigned long long offset;
+	uint64_t pinfo, pfn;
+
+	memset(info, 0, sizeof(*info));
+	info->vaddr = addr;
+
+	if (pagemap_read(addr, 1, &pinfo))
+		return -1;
+	if (!(pinfo & PM_PRESENT)) {
+		errno = ENOENT;
+		return -1;
+	}
+	pfn = pinfo & PM_PFN_MASK;
+	info->paddr = pfn * pagesize + (addr & (pagesize - 1));
+
+	if (smaps_lookup(addr, &info->page_size, &info->hugetlb))
+		info->page_size = pagesize;
+
+	// Without CAP_SYS_ADMIN the PFN is 0, smaps is all we know
+	if (pfn && !kpageflags_read(pfn, 1, &info->kpageflags)) {
+		info->thp = !!(info->kpageflags & KPF_THP);
+		info->hugetlb |= !!(info->kpageflags & KPF_HUGE);
+
+		if (info->thp && !info->hugetlb) {
+			// THP is at most PMD sized and naturally aligned
+			unsigned long long pmd_pages = (2ULL << 20) / pagesize;
+			unsigned long nr_pages;
+			uint64_t head;
+
+			if (!compound_extent(pfn, pmd_pages, &head, &nr_pages)) {
+				info->page_size = nr_pages * pagesize;
+				info->head_paddr = head * pagesize;
+				info->head_vaddr = (addr & ~(pagesize - 1)) - (pfn - head) * pagesize;
+				return 0;
+			}
+		}
+	}
+
+	// hugetlb pages are naturally aligned both virtually and physically
+	offset = addr & (info->page_size - 1);
+	info->head_vaddr = addr - offset;
+	info->head_paddr = info->paddr - offset;
+
+	return 0;
+}
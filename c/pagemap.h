@@ -0,0 +1,89 @@
+/*
+ * Virtual to physical address translation with /proc/self/pagemap.
+ *
+ * The pagemap file is opened once and kept open, a whole range of entries
+ * is read by one pread(), so translating a large buffer costs one syscall
+ * instead of open/pread/close per page.
+ *
+ * Note the PFNs are only visible with CAP_SYS_ADMIN, they read as 0
+ * otherwise.
+ */
+#ifndef _PAGEMAP_H
+#define _PAGEMAP_H
+
+#include <stdint.h>
+
+/* Bits of a pagemap entry, see Documentation/admin-guide/mm/pagemap.rst */
+#define PM_PFN_MASK		((1ULL << 55) - 1)
+#define PM_SOFT_DIRTY		(1ULL << 55)
+#define PM_MMAP_EXCLUSIVE	(1ULL << 56)
+#define PM_FILE			(1ULL << 61)
+#define PM_SWAP			(1ULL << 62)
+#define PM_PRESENT		(1ULL << 63)
+
+#define PAGEMAP_INVALID		(~0ULL)
+
+/* Bits of /proc/kpageflags, see include/uapi/linux/kernel-page-flags.h */
+#define KPF_COMPOUND_HEAD	(1ULL << 15)
+#define KPF_COMPOUND_TAIL	(1ULL << 16)
+#define KPF_HUGE		(1ULL << 17)
+#define KPF_THP			(1ULL << 22)
+
+/*
+ * The page backing a virtual address. For a huge page (hugetlb or THP) the
+ * head is the first base page of the compound page and the extent is the
+ * physical range it covers.
+ */
+struct page_info {
+	unsigned long long vaddr;
+	unsigned long long paddr;	/* physical address of vaddr */
+	unsigned long long page_size;	/* 4K, 2M, 1G... */
+	unsigned long long head_vaddr;	/* virtual address mapping the head */
+	unsigned long long head_paddr;	/* start of the physical extent */
+	uint64_t kpageflags;		/* 0 if /proc/kpageflags isn't readable */
+	int hugetlb;			/* backed by hugetlbfs */
+	int thp;			/* backed by a transparent huge page */
+};
+
+/*
+ * Return the fd of /proc/self/pagemap, open it on the first call.
+ * Return -1 with errno set on failure.
+ */
+int pagemap_fd(void);
+void pagemap_close(void);
+
+/*
+ * Read the raw pagemap entries of nr_pages pages starting from the page
+ * containing addr. Return 0 on success, -1 with errno set on failure.
+ */
+int pagemap_read(unsigned long long addr, unsigned long nr_pages, uint64_t *entries);
+
+/*
+ * Physical address of every page of the range, PAGEMAP_INVALID for the
+ * pages not present. Return the number of present pages, -1 with errno
+ * set on failure.
+ */
+long vtop_range(unsigned long long addr, unsigned long nr_pages, uint64_t *paddrs);
+
+/*
+ * Convert a user mode virtual address belonging to the current process
+ * to physical, return PAGEMAP_INVALID if the page is not present. Exit
+ * if pagemap can't be read.
+ */
+unsigned long long vtop(unsigned long long addr);
+
+/*
+ * Read the /proc/kpageflags entries of nr PFNs, it needs CAP_SYS_ADMIN.
+ * Return 0 on success, -1 with errno set on failure.
+ */
+int kpageflags_read(uint64_t pfn, unsigned long nr, uint64_t *flags);
+
+/*
+ * Huge page aware translation of addr. The page size comes from
+ * /proc/self/smaps, the compound head from /proc/kpageflags if it can be
+ * read. Return 0 on success, -1 with errno set on failure, errno is ENOENT
+ * if the page is not present.
+ */
+int vtop_page(unsigned long long addr, struct page_info *info);
+
+#endif /* _PAGEMAP_H */
@@ -0,0 +1,82 @@
+/*
+ * Per-CPU sharded counter, see percpu_counter.h
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "percpu_counter.h"
+
+int percpu_counter_init(struct percpu_counter *fbc, long amount, long batch)
+{
+	long nr = sysconf(_SC_NPROCESSORS_CONF);
+
+	if (nr < 1)
+		nr = 1;
+
+	fbc->slots = aligned_alloc(SMP_CACHE_BYTES, nr * sizeof(*fbc->slots));
+	if (!fbc->slots)
+		return -1;
+	memset(fbc->slots, 0, nr * sizeof(*fbc->slots));
+
+	fbc->count = amount;
+	fbc->batch = batch;
+	fbc->nr_slots = nr;
+
+	return 0;
+}
+
+void percpu_counter_destroy(struct percpu_counter *fbc)
+{
+	free(fbc->slots);
+	fbc->slots = NULL;
+	fbc->nr_slots = 0;
+}
+
+/*
+ * User space can't disable preemption, the thread may move to another CPU
+ * between sched_getcpu() and the update, so the slot is still updated
+ * atomically. It's a lock add on a line that is normally in the local
+ * cache only, which is cheap compared to a line bouncing between CPUs.
+ */
+void percpu_counter_add(struct percpu_counter *fbc, long amount)
+{
+	int cpu = sched_getcpu();
+	struct percpu_counter_slot *slot;
+	long count;
+
+	if (cpu < 0)
+		cpu = 0;
+	slot = &fbc->slots[cpu % fbc->nr_slots];
+
+	count = __atomic_add_fetch(&slot->count, amount, __ATOMIC_RELAXED);
+	if (fbc->batch && (count >= fbc->batch || count <= -fbc->batch)) {
+		// Only move what we have seen, concurrent updates stay in the slot
+		__atomic_fetch_add(&fbc->count, count, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&slot->count, count, __ATOMIC_RELAXED);
+	}
+}
+
+long percpu_counter_sum(struct percpu_counter *fbc)
+{
+	long sum = __atomic_load_n(&fbc->count, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < fbc->nr_slots; i++)
+		sum += __atomic_load_n(&fbc->slots[i].count, __ATOMIC_RELAXED);
+
+	return sum;
+}
+
+void percpu_counter_flush(struct percpu_counter *fbc)
+{
+	for (int i = 0; i < fbc->nr_slots; i++) {
+		long count = __atomic_exchange_n(&fbc->slots[i].count, 0, __ATOMIC_RELAXED);
+
+		if (count)
+			__atomic_fetch_add(&fbc->count, count, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,74 @@
+/*
+ * Per-CPU sharded counter, every CPU updates its own cache line so that
+ * concurrent increments don't bounce a shared line between the CPUs.
+ *
+ *   struct percpu_counter c;
+ *
+ *   percpu_counter_init(&c, 0, 0);
+ *   percpu_counter_inc(&c);             // cheap, touches the local slot only
+ *   total = percpu_counter_sum(&c);     // expensive, reads every slot
+ *   percpu_counter_destroy(&c);
+ *
+ * With a non-zero batch a slot is folded into the global count once it
+ * reaches +/-batch, then percpu_counter_read() returns the global count
+ * which is off by at most nr_slots * batch, without touching the slots.
+ */
+#ifndef _PERCPU_COUNTER_H
+#define _PERCPU_COUNTER_H
+
+#ifndef SMP_CACHE_BYTES
+#define SMP_CACHE_BYTES 64
+#endif
+
+#ifndef ____cacheline_aligned
+#define ____cacheline_aligned __attribute__((__aligned__(SMP_CACHE_BYTES)))
+#endif
+
+struct percpu_counter_slot {
+	long count;
+} ____cacheline_aligned;
+
+struct percpu_counter {
+	long count;		// global count, slots are folded into it
+	long batch;		// fold a slot at +/-batch, 0 to never fold
+	int nr_slots;		// one per possible CPU
+	struct percpu_counter_slot *slots;
+} ____cacheline_aligned;
+
+/*
+ * Return 0 on success, -1 with errno set if the slots can't be allocated
+ */
+int percpu_counter_init(struct percpu_counter *fbc, long amount, long batch);
+void percpu_counter_destroy(struct percpu_counter *fbc);
+
+void percpu_counter_add(struct percpu_counter *fbc, long amount);
+
+/*
+ * Exact value, only stable if nobody is updating the counter
+ */
+long percpu_counter_sum(struct percpu_counter *fbc);
+
+/*
+ * Fold all slots into the global count
+ */
+void percpu_counter_flush(struct percpu_counter *fbc);
+
+static inline void percpu_counter_inc(struct percpu_counter *fbc)
+{
+	percpu_counter_add(fbc, 1);
+}
+
+static inline void percpu_counter_dec(struct percpu_counter *fbc)
+{
+	percpu_counter_add(fbc, -1);
+}
+
+/*
+ * Cheap approximate value, the slots that are not folded yet are missed
+ */
+static inline long percpu_counter_read(struct percpu_counter *fbc)
+{
+	return __atomic_load_n(&fbc->count, __ATOMIC_RELAXED);
+}
+
+#endif /* _PERCPU_COUNTER_H */
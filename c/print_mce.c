@@ -1,4 +1,35 @@
+// gcc -Wall -O2 -o print_mce print_mce.c -lpthread
+//
+// ./print_mce                   decode the built-in mces_seen[] records
+// ./print_mce dump.bin          decode raw struct mce records (mmapped)
+// ./print_mce - < /dev/mcelog   decode raw records from stdin or a pipe
+// ./print_mce -w dump.bin -n N  write N raw records (mces_seen[] + synthetic)
+// ./print_mce -a -j 8 dump.bin  top offenders and error rates over a dump
+// ./print_mce -z dump.mcec dump.bin     compress a dump into columns
+// ./print_mce -Z dump.mcec | ./print_mce -   and back
+// ./print_mce -q bank=4 dump.mcec       count, reading only the bank column
+// ./print_mce -e 'mcgstatus&4,bank=4|5' dump.bin   decode matching records
+//
+// mkfifo /tmp/mcelog
+// ./print_mce -L /tmp/mcelog &                  live decoding of a FIFO
+// ./print_mce -w /tmp/mcelog -n 100000 -R 5000  stand-in producer
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <immintrin.h>
 
 #define BIT(nr)			((1UL) << (nr))
 #define BIT_ULL(nr)		((1ULL) << (nr))
@@ -56,45 +87,49 @@ struct mce {
 	__u64 kflags;		/* Internal kernel use */
 };
 
-static void print_mce(struct mce *m)
+/*
+ * Reference formatter: mce_format() below must produce exactly the same
+ * bytes, it is the one used for decoding.
+ */
+static void fprint_mce(FILE *f, const struct mce *m)
 {
-	printf("CPU %d: Machine Check%s: %Lx Bank %d: %016Lx\n",
+	fprintf(f, "CPU %d: Machine Check%s: %Lx Bank %d: %016Lx\n",
 		 m->extcpu,
 		 (m->mcgstatus & MCG_STATUS_MCIP ? " Exception" : ""),
 		 m->mcgstatus, m->bank, m->status);
 
 	if (m->ip) {
-		printf("RIP%s %02x:<%016Lx> ",
+		fprintf(f, "RIP%s %02x:<%016Lx> ",
 			!(m->mcgstatus & MCG_STATUS_EIPV) ? " !INEXACT!" : "",
 			m->cs, m->ip);
 
 		if (m->cs == __KERNEL_CS)
-			printf("{%p}", (void *)(unsigned long)m->ip);
-		printf("\n");
+			fprintf(f, "{%p}", (void *)(unsigned long)m->ip);
+		fprintf(f, "\n");
 	}
 
-	printf("TSC %llx ", m->tsc);
+	fprintf(f, "TSC %llx ", m->tsc);
 	if (m->addr)
-		printf("ADDR %llx ", m->addr);
+		fprintf(f, "ADDR %llx ", m->addr);
 	if (m->misc)
-		printf("MISC %llx ", m->misc);
+		fprintf(f, "MISC %llx ", m->misc);
 	if (m->ppin)
-		printf("PPIN %llx ", m->ppin);
+		fprintf(f, "PPIN %llx ", m->ppin);
 
 	if (m->synd || m->ipid /*mce_flags.smca*/) {
 		if (m->synd)
-			printf("SYND %llx ", m->synd);
+			fprintf(f, "SYND %llx ", m->synd);
 		if (m->ipid)
-			printf("IPID %llx ", m->ipid);
+			fprintf(f, "IPID %llx ", m->ipid);
 	}
 
-	printf("\n");
+	fprintf(f, "\n");
 
 	/*
 	 * Note this output is parsed by external tools and old fields
 	 * should not be changed.
 	 */
-	printf("PROCESSOR %u:%x TIME %llu SOCKET %u APIC %x microcode %x\n",
+	fprintf(f, "PROCESSOR %u:%x TIME %llu SOCKET %u APIC %x microcode %x\n",
 		m->cpuvendor, m->cpuid, m->time, m->socketid, m->apicid,
 		m->microcode);
 }
@@ -534,14 +569,2673 @@ struct mce mces_seen[] = {
 	}
 };
 
-int main()
+/*
+ * Buffered decoder.
+ *
+ * fprint_mce() goes through stdio for every field, which dominates when
+ * replaying large archives.  mce_format() renders the same text into a
+ * large reusable buffer with hand-rolled hex/decimal conversion, and the
+ * buffer is handed to write(2) in one go when it fills up.
+ */
+#define OUTBUF_SIZE	(1UL << 20)
+#define MCE_TEXT_MAX	512	/* worst case text of one record, see mce_format() */
+
+struct outbuf {
+	int fd;
+	size_t len;
+	char buf[OUTBUF_SIZE];
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char dec_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static void out_flush(struct outbuf *ob)
+{
+	size_t off = 0;
+
+	while (off < ob->len) {
+		ssize_t ret = write(ob->fd, ob->buf + off, ob->len - off);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		off += ret;
+	}
+	ob->len = 0;
+}
+
+/* Make sure @n bytes can be appended, return where to put them */
+static inline char *out_reserve(struct outbuf *ob, size_t n)
+{
+	if (ob->len + n > OUTBUF_SIZE)
+		out_flush(ob);
+	return ob->buf + ob->len;
+}
+
+static inline char *put_str(char *p, const char *s, size_t n)
+{
+	memcpy(p, s, n);
+	return p + n;
+}
+
+#define PUT_LIT(p, s)	put_str(p, s, sizeof(s) - 1)
+
+/* Equivalent of "%0*llx" with @width (0 for plain "%llx") */
+static inline char *put_hex(char *p, __u64 v, int width)
+{
+	int n = (64 - __builtin_clzll(v | 1) + 3) / 4;
+	char *end;
+
+	if (n < width)
+		n = width;
+	end = p + n;
+	do {
+		*--end = hex_digits[v & 0xf];
+		v >>= 4;
+	} while (end > p);
+	return p + n;
+}
+
+/* Equivalent of "%llu" */
+static inline char *put_dec(char *p, __u64 v)
+{
+	char tmp[20], *t = tmp + sizeof(tmp);
+
+	while (v >= 100) {
+		unsigned int r = v % 100;
+
+		v /= 100;
+		t -= 2;
+		memcpy(t, &dec_pairs[r * 2], 2);
+	}
+	if (v >= 10) {
+		t -= 2;
+		memcpy(t, &dec_pairs[v * 2], 2);
+	} else {
+		*--t = '0' + v;
+	}
+	return put_str(p, t, tmp + sizeof(tmp) - t);
+}
+
+/* Equivalent of "%d" */
+static inline char *put_sdec(char *p, int v)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return put_dec(p, -(__s64)v);
+	}
+	return put_dec(p, v);
+}
+
+/*
+ * Same output as fprint_mce(), byte for byte.  @p must have MCE_TEXT_MAX
+ * bytes available; returns the end of the text.
+ */
+static char *mce_format(char *p, const struct mce *m)
+{
+	p = PUT_LIT(p, "CPU ");
+	p = put_sdec(p, m->extcpu);
+	p = PUT_LIT(p, ": Machine Check");
+	if (m->mcgstatus & MCG_STATUS_MCIP)
+		p = PUT_LIT(p, " Exception");
+	p = PUT_LIT(p, ": ");
+	p = put_hex(p, m->mcgstatus, 0);
+	p = PUT_LIT(p, " Bank ");
+	p = put_dec(p, m->bank);
+	p = PUT_LIT(p, ": ");
+	p = put_hex(p, m->status, 16);
+	*p++ = '\n';
+
+	if (m->ip) {
+		p = PUT_LIT(p, "RIP");
+		if (!(m->mcgstatus & MCG_STATUS_EIPV))
+			p = PUT_LIT(p, " !INEXACT!");
+		*p++ = ' ';
+		p = put_hex(p, m->cs, 2);
+		p = PUT_LIT(p, ":<");
+		p = put_hex(p, m->ip, 16);
+		p = PUT_LIT(p, "> ");
+
+		/* %p of a non-NULL pointer */
+		if (m->cs == __KERNEL_CS) {
+			p = PUT_LIT(p, "{0x");
+			p = put_hex(p, (unsigned long)m->ip, 0);
+			*p++ = '}';
+		}
+		*p++ = '\n';
+	}
+
+	p = PUT_LIT(p, "TSC ");
+	p = put_hex(p, m->tsc, 0);
+	*p++ = ' ';
+	if (m->addr) {
+		p = PUT_LIT(p, "ADDR ");
+		p = put_hex(p, m->addr, 0);
+		*p++ = ' ';
+	}
+	if (m->misc) {
+		p = PUT_LIT(p, "MISC ");
+		p = put_hex(p, m->misc, 0);
+		*p++ = ' ';
+	}
+	if (m->ppin) {
+		p = PUT_LIT(p, "PPIN ");
+		p = put_hex(p, m->ppin, 0);
+		*p++ = ' ';
+	}
+	if (m->synd) {
+		p = PUT_LIT(p, "SYND ");
+		p = put_hex(p, m->synd, 0);
+		*p++ = ' ';
+	}
+	if (m->ipid) {
+		p = PUT_LIT(p, "IPID ");
+		p = put_hex(p, m->ipid, 0);
+		*p++ = ' ';
+	}
+	*p++ = '\n';
+
+	/*
+	 * Note this output is parsed by external tools and old fields
+	 * should not be changed.
+	 */
+	p = PUT_LIT(p, "PROCESSOR ");
+	p = put_dec(p, m->cpuvendor);
+	*p++ = ':';
+	p = put_hex(p, m->cpuid, 0);
+	p = PUT_LIT(p, " TIME ");
+	p = put_dec(p, m->time);
+	p = PUT_LIT(p, " SOCKET ");
+	p = put_dec(p, m->socketid);
+	p = PUT_LIT(p, " APIC ");
+	p = put_hex(p, m->apicid, 0);
+	p = PUT_LIT(p, " microcode ");
+	p = put_hex(p, m->microcode, 0);
+	*p++ = '\n';
+
+	return p;
+}
+
+/*
+ * Record sources.  A regular file is mmapped and handed over in one batch,
+ * anything else (stdin, a pipe, a character device) is read in batches of
+ * MCE_BATCH records, a record split across two reads is carried over.
+ */
+#define MCE_BATCH	4096
+
+typedef void (*mce_batch_fn)(const struct mce *recs, size_t nr, void *arg);
+/* Records the consumer of a live stream can take now, may wait for room */
+typedef size_t (*mce_room_fn)(void *arg);
+
+/* mce_stream_fd() flags */
+#define MCE_STREAM_LIVE		0x1	/* hand over records after every read */
+#define MCE_STREAM_FOLLOW	0x2	/* wait for more at EOF, until mce_stream_stop */
+
+static volatile sig_atomic_t mce_stream_stop;
+
+/*
+ * With @room, a read is capped to the records it reports.  No room at all
+ * means the source cannot wait, a full batch is read so it keeps draining.
+ */
+static int mce_stream_fd(int fd, mce_batch_fn fn, void *arg, int flags,
+			 mce_room_fn room)
+{
+	static struct mce batch[MCE_BATCH];
+	char *buf = (char *)batch;
+	size_t have = 0;
+
+	while (!mce_stream_stop) {
+		size_t limit = sizeof(batch);
+		ssize_t ret;
+
+		if (room) {
+			size_t n = room(arg);
+
+			if (mce_stream_stop)
+				break;
+			if (n && n < MCE_BATCH)
+				limit = n * sizeof(struct mce);
+			if (limit <= have)
+				limit = have + sizeof(struct mce);
+		}
+
+		ret = read(fd, buf + have, limit - have);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return -1;
+		}
+		have += ret;
+		if (ret == 0 || have == sizeof(batch) || (flags & MCE_STREAM_LIVE)) {
+			size_t nr = have / sizeof(struct mce);
+
+			if (nr)
+				fn(batch, nr, arg);
+			have -= nr * sizeof(struct mce);
+			memmove(buf, buf + nr * sizeof(struct mce), have);
+		}
+		if (ret == 0) {
+			if (!(flags & MCE_STREAM_FOLLOW))
+				break;
+			nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+		}
+	}
+	if (have)
+		fprintf(stderr, "print_mce: ignoring %zu trailing bytes\n", have);
+	return 0;
+}
+
+static int mce_stream(const char *path, mce_batch_fn fn, void *arg)
+{
+	struct stat st;
+	int fd, ret;
+
+	if (!strcmp(path, "-"))
+		return mce_stream_fd(STDIN_FILENO, fn, arg, 0, NULL);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		size_t len = st.st_size;
+		void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (map != MAP_FAILED) {
+			size_t nr = len / sizeof(struct mce);
+
+			madvise(map, len, MADV_SEQUENTIAL);
+			if (nr)
+				fn(map, nr, arg);
+			if (len % sizeof(struct mce))
+				fprintf(stderr, "print_mce: ignoring %zu trailing bytes\n",
+					len % sizeof(struct mce));
+			munmap(map, len);
+			close(fd);
+			return 0;
+		}
+	}
+
+	ret = mce_stream_fd(fd, fn, arg, 0, NULL);
+	close(fd);
+	return ret;
+}
+
+struct decode_ctx {
+	struct outbuf *ob;	/* NULL: use the stdio reference formatter */
+	unsigned long idx;
+};
+
+/* "[idx]:\n" + record + "\n", as the original main() printed them */
+static void decode_one(struct decode_ctx *ctx, const struct mce *m, unsigned long idx)
 {
-	int i = 0;
+	struct outbuf *ob = ctx->ob;
+	char *p;
 
-	for(; i < ARRAY_SIZE(mces_seen); i++) {
-		printf("[%d]:\n", i);
-		print_mce(&mces_seen[i]);
+	if (!ob) {
+		printf("[%lu]:\n", idx);
+		fprint_mce(stdout, m);
 		printf("\n");
+		return;
+	}
+
+	p = out_reserve(ob, MCE_TEXT_MAX + 32);
+	*p++ = '[';
+	p = put_dec(p, idx);
+	p = PUT_LIT(p, "]:\n");
+	p = mce_format(p, m);
+	*p++ = '\n';
+	ob->len = p - ob->buf;
+}
+
+static void decode_batch(const struct mce *recs, size_t nr, void *arg)
+{
+	struct decode_ctx *ctx = arg;
+	size_t i;
+
+	for (i = 0; i < nr; i++, ctx->idx++)
+		decode_one(ctx, &recs[i], ctx->idx);
+}
+
+/*
+ * Synthetic records for dumps, self checks and benchmarks.  Fields are
+ * zero about half of the time so every optional part of the text shows up,
+ * and extcpu sometimes has the top bit set to exercise the "%d" sign.
+ */
+static __u64 rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static __u64 rnd64(void)
+{
+	/* xorshift64* */
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * 0x2545f4914f6cdd1dULL;
+}
+
+static __u64 rnd_field(int bits)
+{
+	__u64 v = rnd64();
+
+	if (v & 1)
+		return 0;
+	v = rnd64() >> (rnd64() % 64);
+	return bits < 64 ? v & ((1ULL << bits) - 1) : v;
+}
+
+static void mce_synth(struct mce *m)
+{
+	static const __u8 cs[] = { __KERNEL_CS, 0x33, 0x0 };
+
+	memset(m, 0, sizeof(*m));
+	m->status = rnd_field(64);
+	m->misc = rnd_field(64);
+	m->addr = rnd_field(64);
+	m->mcgstatus = rnd64() & 7;
+	m->ip = rnd_field(64);
+	m->tsc = rnd64() >> (rnd64() % 64);
+	m->time = rnd_field(64);
+	m->cpuvendor = rnd_field(8);
+	m->cpuid = rnd_field(32);
+	m->cs = rnd64() % 4 ? cs[rnd64() % ARRAY_SIZE(cs)] : rnd_field(8);
+	m->bank = rnd_field(8);
+	m->extcpu = rnd_field(32);
+	m->socketid = rnd_field(32);
+	m->apicid = rnd_field(32);
+	m->mcgcap = rnd_field(64);
+	m->synd = rnd_field(64);
+	m->ipid = rnd_field(64);
+	m->ppin = rnd_field(64);
+	m->microcode = rnd_field(32);
+	m->finished = 1;
+}
+
+/* Records @first.. of a stream starting with mces_seen[], then synthetic */
+static void mce_gen(struct mce *recs, size_t nr, size_t first)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (first + i < ARRAY_SIZE(mces_seen))
+			recs[i] = mces_seen[first + i];
+		else
+			mce_synth(&recs[i]);
+	}
+}
+
+/*
+ * Write @nr records to @path, a file or a FIFO.  With @rate the records are
+ * paced to that many per second, which makes this the stand-in producer
+ * for the live ingestion mode.
+ */
+static int write_dump(const char *path, size_t nr, unsigned long rate)
+{
+	struct mce batch[256];
+	FILE *f = fopen(path, "w");
+	size_t done = 0, chunk = ARRAY_SIZE(batch);
+	struct timespec start, next;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	if (rate) {
+		/* about a thousand writes per second */
+		chunk = rate / 1000 + 1;
+		if (chunk > ARRAY_SIZE(batch))
+			chunk = ARRAY_SIZE(batch);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+	while (done < nr) {
+		size_t n = nr - done < chunk ? nr - done : chunk;
+
+		mce_gen(batch, n, done);
+		if (fwrite(batch, sizeof(*batch), n, f) != n ||
+		    (rate && fflush(f))) {
+			perror(path);
+			fclose(f);
+			return -1;
+		}
+		done += n;
+
+		if (rate) {
+			__u64 ns = done * 1000000000ULL / rate;
+
+			next.tv_sec = start.tv_sec + (start.tv_nsec + ns) / 1000000000;
+			next.tv_nsec = (start.tv_nsec + ns) % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+	if (fclose(f)) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* mce_format() against fprint_mce() over mces_seen[] and @nr synthetic records */
+static int self_check(size_t nr)
+{
+	char text[MCE_TEXT_MAX], *ref;
+	size_t ref_len, i, max_len = 0;
+	FILE *f;
+	struct mce m;
+
+	f = open_memstream(&ref, &ref_len);
+	if (!f) {
+		perror("open_memstream");
+		return 1;
+	}
+	for (i = 0; i < nr + ARRAY_SIZE(mces_seen); i++) {
+		size_t len;
+
+		if (i < ARRAY_SIZE(mces_seen))
+			m = mces_seen[i];
+		else
+			mce_synth(&m);
+		/* worst case record every now and then */
+		if (i % 1000 == 999) {
+			memset(&m, 0xff, sizeof(m));
+			m.extcpu = 0x80000000;
+			m.cs = __KERNEL_CS;
+		}
+
+		rewind(f);
+		fprint_mce(f, &m);
+		fflush(f);
+		len = mce_format(text, &m) - text;
+		if (len > max_len)
+			max_len = len;
+		if (len != (size_t)ftell(f) || memcmp(text, ref, len)) {
+			fprintf(stderr, "mismatch on record %zu:\n--- fprint_mce\n%.*s--- mce_format\n%.*s",
+				i, (int)ftell(f), ref, (int)len, text);
+			fclose(f);
+			free(ref);
+			return 1;
+		}
+	}
+	fclose(f);
+	free(ref);
+	printf("self check: %zu records ok, longest %zu bytes\n",
+	       nr + ARRAY_SIZE(mces_seen), max_len);
+	return 0;
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Decode @nr synthetic records to /dev/null with both formatters, CSV out */
+static int bench(size_t nr)
+{
+	struct mce *recs = malloc(nr * sizeof(*recs));
+	static struct outbuf ob;
+	struct decode_ctx ctx;
+	FILE *null = fopen("/dev/null", "w");
+	FILE *saved = stdout;
+	__u64 t0, t_printf, t_buf;
+
+	if (!recs || !null) {
+		perror("bench");
+		return 1;
 	}
+	mce_gen(recs, nr, 0);
+
+	stdout = null;
+	ctx = (struct decode_ctx){ .ob = NULL };
+	t0 = now_ns();
+	decode_batch(recs, nr, &ctx);
+	fflush(null);
+	t_printf = now_ns() - t0;
+	stdout = saved;
+
+	ob.fd = fileno(null);
+	ctx = (struct decode_ctx){ .ob = &ob };
+	t0 = now_ns();
+	decode_batch(recs, nr, &ctx);
+	out_flush(&ob);
+	t_buf = now_ns() - t0;
+
+	printf("impl,records,ns,ns_per_record\n");
+	printf("printf,%zu,%llu,%.1f\n", nr, t_printf, (double)t_printf / nr);
+	printf("buffered,%zu,%llu,%.1f\n", nr, t_buf, (double)t_buf / nr);
+
+	fclose(null);
+	free(recs);
 	return 0;
 }
+
+/*
+ * Archive analysis.
+ *
+ * Input is cut into chunks of up to ANALYZE_STAGE records (an mmapped dump
+ * is used in place), each chunk is split evenly across the worker threads
+ * and every worker counts records into its own hash tables, one per
+ * dimension.  The per-worker tables are merged once at the end, so workers
+ * never share a cache line while counting.
+ */
+#define PAGE_SHIFT		12
+#define ANALYZE_STAGE		(1UL << 20)
+#define ANALYZE_MAX_THREADS	256
+
+enum agg_dim {
+	AGG_CPU,	/* extcpu */
+	AGG_BANK,	/* bank */
+	AGG_SOCKET,	/* socketid */
+	AGG_PPIN,	/* ppin, records without one are skipped */
+	AGG_PAGE,	/* addr >> PAGE_SHIFT, records without addr are skipped */
+	AGG_TIME,	/* time bucket, records without a time are skipped */
+	AGG_UPTIME,	/* tsc bucket of records without a time, with -F */
+	AGG_NR,
+};
+
+static const char * const agg_names[AGG_NR] = {
+	"cpu", "bank", "socket", "ppin", "page", "time", "uptime",
+};
+
+struct agg_entry {
+	__u64 key;
+	__u64 count;
+};
+
+/*
+ * Open addressing key -> count, a zero count marks an empty slot.  Key and
+ * count share a slot so a lookup touches a single cache line.
+ */
+struct agg {
+	struct agg_entry *slots;
+	size_t mask;
+	size_t nr;
+};
+
+static void agg_init(struct agg *a, size_t slots)
+{
+	a->slots = calloc(slots, sizeof(*a->slots));
+	if (!a->slots) {
+		perror("calloc");
+		exit(1);
+	}
+	a->mask = slots - 1;
+	a->nr = 0;
+}
+
+static void agg_destroy(struct agg *a)
+{
+	free(a->slots);
+}
+
+static inline size_t agg_slot(const struct agg *a, __u64 key)
+{
+	return ((key * 0x9e3779b97f4a7c15ULL) >> 32) & a->mask;
+}
+
+static void agg_add(struct agg *a, __u64 key, __u64 count)
+{
+	size_t i = agg_slot(a, key);
+	struct agg_entry *e;
+
+	while ((e = &a->slots[i])->count) {
+		if (e->key == key) {
+			e->count += count;
+			return;
+		}
+		i = (i + 1) & a->mask;
+	}
+	e->key = key;
+	e->count = count;
+
+	/* keep the load factor under 1/2 */
+	if (++a->nr * 2 > a->mask) {
+		struct agg old = *a;
+
+		agg_init(a, (old.mask + 1) * 2);
+		for (i = 0; i <= old.mask; i++)
+			if (old.slots[i].count)
+				agg_add(a, old.slots[i].key, old.slots[i].count);
+		agg_destroy(&old);
+	}
+}
+
+struct analyze_ctx;
+
+struct analyze_worker {
+	pthread_t tid;
+	const struct analyze_ctx *ctx;
+	const struct mce *recs;
+	size_t nr;
+	struct agg agg[AGG_NR];
+	__u64 untimed;
+} __attribute__((aligned(64)));
+
+struct analyze_ctx {
+	unsigned int threads;
+	__u64 interval;		/* time bucket width in seconds */
+	__u64 tsc_hz;		/* if set, bucket tsc of records without a time */
+	struct analyze_worker *workers;
+	struct mce *stage;	/* copies of streamed records */
+	size_t staged;
+	__u64 total;
+};
+
+static void *analyze_worker(void *arg)
+{
+	struct analyze_worker *w = arg;
+	const struct analyze_ctx *ctx = w->ctx;
+	struct agg *agg = w->agg;
+	size_t i;
+
+	for (i = 0; i < w->nr; i++) {
+		const struct mce *m = &w->recs[i];
+		agg_add(&agg[AGG_CPU], m->extcpu, 1);
+		agg_add(&agg[AGG_BANK], m->bank, 1);
+		agg_add(&agg[AGG_SOCKET], m->socketid, 1);
+		if (m->ppin)
+			agg_add(&agg[AGG_PPIN], m->ppin, 1);
+		if (m->addr)
+			agg_add(&agg[AGG_PAGE], m->addr >> PAGE_SHIFT, 1);
+
+		/*
+		 * tsc counts from boot, not from the epoch, so its buckets are
+		 * kept apart from the wall time ones
+		 */
+		if (m->time)
+			agg_add(&agg[AGG_TIME], m->time / ctx->interval, 1);
+		else if (ctx->tsc_hz)
+			agg_add(&agg[AGG_UPTIME], m->tsc / ctx->tsc_hz / ctx->interval, 1);
+		else
+			w->untimed++;
+	}
+	return NULL;
+}
+
+/* Split @recs evenly across the workers and wait for them */
+static void analyze_run(struct analyze_ctx *ctx, const struct mce *recs, size_t nr)
+{
+	size_t per = (nr + ctx->threads - 1) / ctx->threads;
+	unsigned int i;
+
+	for (i = 0; i < ctx->threads; i++) {
+		struct analyze_worker *w = &ctx->workers[i];
+		size_t off = per * i < nr ? per * i : nr;
+
+		w->recs = recs + off;
+		w->nr = nr - off < per ? nr - off : per;
+		if (pthread_create(&w->tid, NULL, analyze_worker, w)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < ctx->threads; i++)
+		pthread_join(ctx->workers[i].tid, NULL);
+	ctx->total += nr;
+}
+
+static void analyze_batch(const struct mce *recs, size_t nr, void *arg)
+{
+	struct analyze_ctx *ctx = arg;
+
+	/* an mmapped dump comes in one big batch, no need to copy it */
+	if (!ctx->staged && nr >= ANALYZE_STAGE) {
+		analyze_run(ctx, recs, nr);
+		return;
+	}
+
+	while (nr) {
+		size_t n = ANALYZE_STAGE - ctx->staged;
+
+		if (n > nr)
+			n = nr;
+		memcpy(ctx->stage + ctx->staged, recs, n * sizeof(*recs));
+		ctx->staged += n;
+		recs += n;
+		nr -= n;
+		if (ctx->staged == ANALYZE_STAGE) {
+			analyze_run(ctx, ctx->stage, ctx->staged);
+			ctx->staged = 0;
+		}
+	}
+}
+
+/* By count, most frequent first, ties by key */
+static int cmp_count(const void *a, const void *b)
+{
+	const struct agg_entry *x = a, *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+	const struct agg_entry *x = a, *y = b;
+
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+/* Fold the per-worker tables of @dim into a sorted entry array */
+static struct agg_entry *agg_merge(struct analyze_ctx *ctx, enum agg_dim dim,
+				   size_t *nr, int (*cmp)(const void *, const void *))
+{
+	struct agg all;
+	struct agg_entry *e;
+	unsigned int t;
+	size_t i, n = 0;
+
+	agg_init(&all, 1024);
+	for (t = 0; t < ctx->threads; t++) {
+		struct agg *a = &ctx->workers[t].agg[dim];
+
+		for (i = 0; i <= a->mask; i++)
+			if (a->slots[i].count)
+				agg_add(&all, a->slots[i].key, a->slots[i].count);
+	}
+
+	e = malloc((all.nr + 1) * sizeof(*e));
+	if (!e) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i <= all.mask; i++)
+		if (all.slots[i].count)
+			e[n++] = all.slots[i];
+	agg_destroy(&all);
+
+	qsort(e, n, sizeof(*e), cmp);
+	*nr = n;
+	return e;
+}
+
+static void analyze_report(struct analyze_ctx *ctx, size_t top)
+{
+	struct agg_entry *e;
+	__u64 untimed = 0;
+	size_t i, nr;
+	int dim;
+
+	printf("dimension,key,count,share\n");
+	for (dim = 0; dim < AGG_TIME; dim++) {
+		e = agg_merge(ctx, dim, &nr, cmp_count);
+		for (i = 0; i < nr && i < top; i++) {
+			if (dim == AGG_PAGE)
+				printf("%s,0x%llx,", agg_names[dim], e[i].key << PAGE_SHIFT);
+			else if (dim == AGG_PPIN)
+				printf("%s,0x%llx,", agg_names[dim], e[i].key);
+			else
+				printf("%s,%llu,", agg_names[dim], e[i].key);
+			printf("%llu,%.4f\n", e[i].count, (double)e[i].count / ctx->total);
+		}
+		free(e);
+	}
+
+	for (i = 0; i < ctx->threads; i++)
+		untimed += ctx->workers[i].untimed;
+
+	for (dim = AGG_TIME; dim < AGG_NR; dim++) {
+		e = agg_merge(ctx, dim, &nr, cmp_key);
+		/* uptime: seconds since boot from tsc, time: since the epoch */
+		if (dim == AGG_TIME || nr)
+			printf("\n%s_bucket_start,records,per_second\n", agg_names[dim]);
+		for (i = 0; i < nr; i++)
+			printf("%llu,%llu,%.6f\n", e[i].key * ctx->interval, e[i].count,
+			       (double)e[i].count / ctx->interval);
+		free(e);
+	}
+	if (untimed)
+		printf("untimed,%llu,\n", untimed);
+}
+
+static int analyze(const char *path, unsigned int threads, size_t top,
+		   __u64 interval, __u64 tsc_hz)
+{
+	struct analyze_ctx ctx = {
+		.threads = threads,
+		.interval = interval,
+		.tsc_hz = tsc_hz,
+	};
+	unsigned int i;
+	__u64 t0 = now_ns();
+	int ret, dim;
+
+	ctx.workers = aligned_alloc(64, threads * sizeof(*ctx.workers));
+	ctx.stage = malloc(ANALYZE_STAGE * sizeof(*ctx.stage));
+	if (!ctx.workers || !ctx.stage) {
+		perror("analyze");
+		return 1;
+	}
+	for (i = 0; i < threads; i++) {
+		memset(&ctx.workers[i], 0, sizeof(ctx.workers[i]));
+		ctx.workers[i].ctx = &ctx;
+		for (dim = 0; dim < AGG_NR; dim++)
+			agg_init(&ctx.workers[i].agg[dim], 1024);
+	}
+
+	if (path) {
+		ret = mce_stream(path, analyze_batch, &ctx);
+	} else {
+		analyze_batch(mces_seen, ARRAY_SIZE(mces_seen), &ctx);
+		ret = 0;
+	}
+	if (ctx.staged)
+		analyze_run(&ctx, ctx.stage, ctx.staged);
+
+	if (!ret) {
+		analyze_report(&ctx, top);
+		fprintf(stderr, "analyzed %llu records with %u threads in %.3f s\n",
+			ctx.total, threads, (now_ns() - t0) / 1e9);
+	}
+
+	for (i = 0; i < threads; i++)
+		for (dim = 0; dim < AGG_NR; dim++)
+			agg_destroy(&ctx.workers[i].agg[dim]);
+	free(ctx.workers);
+	free(ctx.stage);
+	return ret ? 1 : 0;
+}
+
+/*
+ * Columnar record store.
+ *
+ * struct mce_cols keeps every field of struct mce in its own array so a
+ * scan over one field only touches that field.  On disk (.mcec) records
+ * are grouped in blocks of up to MCEC_BLOCK records, each block stores its
+ * columns one after the other, every column with the smallest of:
+ *
+ *   MCEC_RAW     fixed width little endian values
+ *   MCEC_VARINT  LEB128 values
+ *   MCEC_DELTA   LEB128 of the zigzagged difference to the previous value,
+ *                what tsc and time end up with
+ *   MCEC_RLE     (value, run length) LEB128 pairs, what mostly constant
+ *                fields like synd, ipid or kflags end up with
+ *
+ * Every column carries its length, so a reader skips the ones it was not
+ * asked for.  Struct padding is not stored, decoded records have it zeroed.
+ */
+#define MCE_FIELDS(X)							\
+	X(status) X(misc) X(addr) X(mcgstatus) X(ip) X(tsc) X(time)	\
+	X(cpuvendor) X(inject_flags) X(severity) X(pad) X(cpuid) X(cs)	\
+	X(bank) X(cpu) X(finished) X(extcpu) X(socketid) X(apicid)	\
+	X(mcgcap) X(synd) X(ipid) X(ppin) X(microcode) X(kflags)
+
+enum mce_field {
+#define X(f)	MCE_F_##f,
+	MCE_FIELDS(X)
+#undef X
+	MCE_F_NR,
+};
+
+static const struct mce_field_desc {
+	const char *name;
+	size_t off;
+	size_t size;
+} mce_fields[MCE_F_NR] = {
+#define X(f)	{ #f, offsetof(struct mce, f), sizeof(((struct mce *)0)->f) },
+	MCE_FIELDS(X)
+#undef X
+};
+
+struct mce_cols {
+	size_t nr;
+	size_t cap;
+	void *col[MCE_F_NR];	/* NULL for columns that were not loaded */
+};
+
+/* Typed column of field @f, e.g. MCE_COL(c, bank)[i] */
+#define MCE_COL(c, f)	((__typeof__(((struct mce *)0)->f) *)(c)->col[MCE_F_##f])
+
+#define MCEC_MAGIC	"MCECOL1"
+#define MCEC_BLOCK	(1UL << 20)
+#define MCEC_ALL	((1UL << MCE_F_NR) - 1)
+
+enum mcec_enc {
+	MCEC_RAW,
+	MCEC_VARINT,
+	MCEC_DELTA,
+	MCEC_RLE,
+	MCEC_ENC_NR,
+};
+
+static const char * const mcec_enc_names[MCEC_ENC_NR] = {
+	"raw", "varint", "delta", "rle",
+};
+
+struct mcec_file_hdr {
+	char magic[8];
+	__u32 fields;		/* MCE_F_NR of the writer */
+	__u32 record_size;	/* sizeof(struct mce) of the writer */
+};
+
+struct mcec_block_hdr {
+	__u64 nr;
+	__u32 columns;
+	__u32 reserved;
+};
+
+struct mcec_col_hdr {
+	__u8 field;
+	__u8 enc;
+	__u8 size;
+	__u8 reserved[5];
+	__u64 len;
+};
+
+static void mce_cols_init(struct mce_cols *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+static void mce_cols_destroy(struct mce_cols *c)
+{
+	int f;
+
+	for (f = 0; f < MCE_F_NR; f++)
+		free(c->col[f]);
+	mce_cols_init(c);
+}
+
+/* Make room for @nr records in the columns of @mask, contents are kept */
+static void mce_cols_reserve(struct mce_cols *c, size_t nr, unsigned long mask)
+{
+	int f;
+
+	if (nr <= c->cap) {
+		for (f = 0; f < MCE_F_NR; f++)
+			if ((mask & (1UL << f)) && !c->col[f])
+				break;
+		if (f == MCE_F_NR)
+			return;
+	}
+	if (nr < c->cap)
+		nr = c->cap;
+
+	for (f = 0; f < MCE_F_NR; f++) {
+		void *p;
+
+		if (!(mask & (1UL << f)) && !c->col[f])
+			continue;
+		p = realloc(c->col[f], nr * mce_fields[f].size);
+		if (!p) {
+			perror("realloc");
+			exit(1);
+		}
+		c->col[f] = p;
+	}
+	c->cap = nr;
+}
+
+static inline __u64 col_get(const struct mce_cols *c, int f, size_t i)
+{
+	const void *col = c->col[f];
+
+	switch (mce_fields[f].size) {
+	case 1:
+		return ((const __u8 *)col)[i];
+	case 2:
+		return ((const __u16 *)col)[i];
+	case 4:
+		return ((const __u32 *)col)[i];
+	default:
+		return ((const __u64 *)col)[i];
+	}
+}
+
+static inline void col_put(struct mce_cols *c, int f, size_t i, __u64 v)
+{
+	void *col = c->col[f];
+
+	switch (mce_fields[f].size) {
+	case 1:
+		((__u8 *)col)[i] = v;
+		break;
+	case 2:
+		((__u16 *)col)[i] = v;
+		break;
+	case 4:
+		((__u32 *)col)[i] = v;
+		break;
+	default:
+		((__u64 *)col)[i] = v;
+		break;
+	}
+}
+
+/*
+ * Append @nr records, copying only the fields in @mask.  The other columns
+ * are not touched, their values for the new records are undefined.
+ */
+static void mce_cols_append(struct mce_cols *c, const struct mce *recs, size_t nr,
+			    unsigned long mask)
+{
+	size_t i, want = c->nr + nr;
+	int f;
+
+	if (want > c->cap && want < c->cap * 2)
+		want = c->cap * 2;
+	mce_cols_reserve(c, want, mask);
+
+	for (f = 0; f < MCE_F_NR; f++) {
+		const struct mce_field_desc *d = &mce_fields[f];
+		const char *src = (const char *)recs + d->off;
+		char *dst = (char *)c->col[f] + c->nr * d->size;
+
+		if (!(mask & (1UL << f)))
+			continue;
+
+		/* a constant size per loop, so the copies become plain moves */
+		switch (d->size) {
+		case 1:
+			for (i = 0; i < nr; i++)
+				memcpy(dst + i, src + i * sizeof(*recs), 1);
+			break;
+		case 4:
+			for (i = 0; i < nr; i++)
+				memcpy(dst + i * 4, src + i * sizeof(*recs), 4);
+			break;
+		default:
+			for (i = 0; i < nr; i++)
+				memcpy(dst + i * 8, src + i * sizeof(*recs), 8);
+			break;
+		}
+	}
+	c->nr += nr;
+}
+
+/* Record @i, fields of columns that were not loaded read as 0 */
+static void mce_cols_get(const struct mce_cols *c, size_t i, struct mce *m)
+{
+	int f;
+
+	memset(m, 0, sizeof(*m));
+	for (f = 0; f < MCE_F_NR; f++) {
+		const struct mce_field_desc *d = &mce_fields[f];
+
+		if (c->col[f])
+			memcpy((char *)m + d->off, (const char *)c->col[f] + i * d->size,
+			       d->size);
+	}
+}
+
+static inline __u8 *put_varint(__u8 *p, __u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* NULL on a truncated or overlong varint */
+static inline const __u8 *get_varint(const __u8 *p, const __u8 *end, __u64 *v)
+{
+	__u64 r = 0;
+	int shift;
+
+	for (shift = 0; shift < 64 && p < end; shift += 7) {
+		__u8 b = *p++;
+
+		r |= (__u64)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = r;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static inline __u64 zigzag(__u64 d)
+{
+	return (d << 1) ^ -(d >> 63);
+}
+
+static inline __u64 unzigzag(__u64 z)
+{
+	return (z >> 1) ^ -(z & 1);
+}
+
+/* Worst case of any encoding of @nr values, RLE with runs of 1 */
+#define MCEC_ENC_MAX(nr)	((nr) * 20)
+
+/* Encode column @f with @enc into @buf, return the length */
+static size_t mcec_encode(const struct mce_cols *c, int f, enum mcec_enc enc,
+			  __u8 *buf)
+{
+	size_t i, size = mce_fields[f].size;
+	__u8 *p = buf;
+	__u64 prev = 0;
+
+	switch (enc) {
+	case MCEC_RAW:
+		for (i = 0; i < c->nr; i++) {
+			__u64 v = col_get(c, f, i);
+			size_t b;
+
+			for (b = 0; b < size; b++)
+				*p++ = v >> (b * 8);
+		}
+		break;
+	case MCEC_VARINT:
+		for (i = 0; i < c->nr; i++)
+			p = put_varint(p, col_get(c, f, i));
+		break;
+	case MCEC_DELTA:
+		for (i = 0; i < c->nr; i++) {
+			__u64 v = col_get(c, f, i);
+
+			p = put_varint(p, zigzag(v - prev));
+			prev = v;
+		}
+		break;
+	case MCEC_RLE:
+		for (i = 0; i < c->nr; ) {
+			__u64 v = col_get(c, f, i);
+			size_t run = 1;
+
+			while (i + run < c->nr && col_get(c, f, i + run) == v)
+				run++;
+			p = put_varint(p, v);
+			p = put_varint(p, run);
+			i += run;
+		}
+		break;
+	default:
+		break;
+	}
+	return p - buf;
+}
+
+/* Decode @nr values of column @f, -1 if the data does not add up */
+static int mcec_decode(struct mce_cols *c, int f, enum mcec_enc enc,
+		       const __u8 *p, size_t len, size_t nr)
+{
+	const __u8 *end = p + len;
+	size_t i, size = mce_fields[f].size;
+	__u64 v = 0, run;
+
+	switch (enc) {
+	case MCEC_RAW:
+		if (len != nr * size)
+			return -1;
+		for (i = 0; i < nr; i++) {
+			size_t b;
+
+			for (v = 0, b = 0; b < size; b++)
+				v |= (__u64)*p++ << (b * 8);
+			col_put(c, f, i, v);
+		}
+		return 0;
+	case MCEC_VARINT:
+	case MCEC_DELTA:
+		for (i = 0; i < nr; i++) {
+			__u64 d;
+
+			p = get_varint(p, end, &d);
+			if (!p)
+				return -1;
+			v = enc == MCEC_DELTA ? v + unzigzag(d) : d;
+			col_put(c, f, i, v);
+		}
+		break;
+	case MCEC_RLE:
+		for (i = 0; i < nr; ) {
+			p = get_varint(p, end, &v);
+			if (p)
+				p = get_varint(p, end, &run);
+			if (!p || !run || run > nr - i)
+				return -1;
+			while (run--)
+				col_put(c, f, i++, v);
+		}
+		break;
+	default:
+		return -1;
+	}
+	return p == end ? 0 : -1;
+}
+
+struct mcec_writer {
+	FILE *f;
+	struct mce_cols cols;	/* the block being filled */
+	__u8 *buf[2];		/* candidate and best encoding */
+	__u64 records;
+	__u64 bytes[MCE_F_NR];	/* encoded bytes per field, for the report */
+	__u64 blocks_by_enc[MCEC_ENC_NR];
+};
+
+static int mcec_write_block(struct mcec_writer *w)
+{
+	struct mcec_block_hdr bh = { .nr = w->cols.nr, .columns = MCE_F_NR };
+	int f;
+
+	if (!w->cols.nr)
+		return 0;
+	if (fwrite(&bh, sizeof(bh), 1, w->f) != 1)
+		return -1;
+
+	for (f = 0; f < MCE_F_NR; f++) {
+		struct mcec_col_hdr ch = {
+			.field = f,
+			.size = mce_fields[f].size,
+			.len = ~0ULL,
+		};
+		int enc;
+
+		for (enc = 0; enc < MCEC_ENC_NR; enc++) {
+			size_t len = mcec_encode(&w->cols, f, enc, w->buf[0]);
+
+			if (len < ch.len) {
+				__u8 *tmp = w->buf[0];
+
+				w->buf[0] = w->buf[1];
+				w->buf[1] = tmp;
+				ch.len = len;
+				ch.enc = enc;
+			}
+		}
+		if (fwrite(&ch, sizeof(ch), 1, w->f) != 1 ||
+		    fwrite(w->buf[1], 1, ch.len, w->f) != ch.len)
+			return -1;
+		w->bytes[f] += sizeof(ch) + ch.len;
+		w->blocks_by_enc[ch.enc]++;
+	}
+
+	w->records += w->cols.nr;
+	w->cols.nr = 0;
+	return 0;
+}
+
+static int mcec_writer_open(struct mcec_writer *w, FILE *f)
+{
+	struct mcec_file_hdr fh = {
+		.magic = MCEC_MAGIC,
+		.fields = MCE_F_NR,
+		.record_size = sizeof(struct mce),
+	};
+
+	memset(w, 0, sizeof(*w));
+	w->f = f;
+	mce_cols_init(&w->cols);
+	w->buf[0] = malloc(MCEC_ENC_MAX(MCEC_BLOCK));
+	w->buf[1] = malloc(MCEC_ENC_MAX(MCEC_BLOCK));
+	if (!w->buf[0] || !w->buf[1]) {
+		perror("malloc");
+		exit(1);
+	}
+	return fwrite(&fh, sizeof(fh), 1, f) == 1 ? 0 : -1;
+}
+
+static int mcec_writer_add(struct mcec_writer *w, const struct mce *recs, size_t nr)
+{
+	while (nr) {
+		size_t n = MCEC_BLOCK - w->cols.nr;
+
+		if (n > nr)
+			n = nr;
+		mce_cols_append(&w->cols, recs, n, MCEC_ALL);
+		recs += n;
+		nr -= n;
+		if (w->cols.nr == MCEC_BLOCK && mcec_write_block(w))
+			return -1;
+	}
+	return 0;
+}
+
+/* Flush the last block, the FILE is left to the caller */
+static int mcec_writer_close(struct mcec_writer *w)
+{
+	int ret = mcec_write_block(w);
+
+	if (fflush(w->f))
+		ret = -1;
+	free(w->buf[0]);
+	free(w->buf[1]);
+	mce_cols_destroy(&w->cols);
+	return ret;
+}
+
+static int mcec_read_hdr(FILE *f)
+{
+	struct mcec_file_hdr fh;
+
+	if (fread(&fh, sizeof(fh), 1, f) != 1 ||
+	    memcmp(fh.magic, MCEC_MAGIC, sizeof(fh.magic)) ||
+	    fh.fields != MCE_F_NR || fh.record_size != sizeof(struct mce))
+		return -1;
+	return 0;
+}
+
+/*
+ * Read the next block into @c, decoding only the columns in @mask.
+ * Returns 1 for a block, 0 at the end of the file and -1 on errors.
+ */
+static int mcec_read_block(FILE *f, struct mce_cols *c, unsigned long mask)
+{
+	struct mcec_block_hdr bh;
+	unsigned long seen = 0;
+	__u8 *buf = NULL;
+	size_t buf_len = 0;
+	size_t got;
+	__u32 i;
+
+	/* only a clean end between blocks is the end of the file */
+	got = fread(&bh, 1, sizeof(bh), f);
+	if (got != sizeof(bh))
+		return !got && feof(f) ? 0 : -1;
+	if (bh.columns != MCE_F_NR || !bh.nr || bh.nr > MCEC_BLOCK)
+		return -1;
+
+	mce_cols_reserve(c, bh.nr, mask);
+	c->nr = bh.nr;
+
+	for (i = 0; i < bh.columns; i++) {
+		struct mcec_col_hdr ch;
+
+		if (fread(&ch, sizeof(ch), 1, f) != 1 || ch.field >= MCE_F_NR ||
+		    ch.size != mce_fields[ch.field].size ||
+		    ch.len > MCEC_ENC_MAX(bh.nr))
+			goto err;
+
+		/* a repeated column would leave another one stale */
+		if (seen & (1UL << ch.field))
+			goto err;
+		seen |= 1UL << ch.field;
+
+		if (!(mask & (1UL << ch.field))) {
+			if (fseeko(f, ch.len, SEEK_CUR))
+				goto err;
+			continue;
+		}
+		if (ch.len > buf_len) {
+			free(buf);
+			buf_len = ch.len;
+			buf = malloc(buf_len);
+			if (!buf) {
+				perror("malloc");
+				exit(1);
+			}
+		}
+		if (fread(buf, 1, ch.len, f) != ch.len ||
+		    mcec_decode(c, ch.field, ch.enc, buf, ch.len, bh.nr))
+			goto err;
+	}
+	if (seen != MCEC_ALL)
+		goto err;
+	free(buf);
+	return 1;
+err:
+	free(buf);
+	return -1;
+}
+
+static void mcec_batch(const struct mce *recs, size_t nr, void *arg)
+{
+	struct mcec_writer *w = arg;
+
+	if (mcec_writer_add(w, recs, nr)) {
+		perror("write");
+		exit(1);
+	}
+}
+
+/* Convert a raw dump (or stdin, or mces_seen[]) to a .mcec file */
+static int mcec_compress(const char *out, const char *in)
+{
+	struct mcec_writer w;
+	FILE *f = fopen(out, "w");
+	__u64 raw, total = sizeof(struct mcec_file_hdr);
+	int ret = 0, field, enc;
+
+	if (!f || mcec_writer_open(&w, f)) {
+		perror(out);
+		return 1;
+	}
+	if (in)
+		ret = mce_stream(in, mcec_batch, &w);
+	else
+		mcec_batch(mces_seen, ARRAY_SIZE(mces_seen), &w);
+	if (mcec_writer_close(&w) || fclose(f)) {
+		perror(out);
+		return 1;
+	}
+	if (ret)
+		return 1;
+
+	fprintf(stderr, "field,bytes\n");
+	for (field = 0; field < MCE_F_NR; field++) {
+		fprintf(stderr, "%s,%llu\n", mce_fields[field].name, w.bytes[field]);
+		total += w.bytes[field];
+	}
+	fprintf(stderr, "\nencoding,columns\n");
+	for (enc = 0; enc < MCEC_ENC_NR; enc++)
+		fprintf(stderr, "%s,%llu\n", mcec_enc_names[enc], w.blocks_by_enc[enc]);
+
+	raw = w.records * sizeof(struct mce);
+	fprintf(stderr, "\n%llu records, %llu raw bytes, %llu compressed (%.1fx)\n",
+		w.records, raw, total, total ? (double)raw / total : 0);
+	return 0;
+}
+
+/* Expand a .mcec file back to raw struct mce records on stdout */
+static int mcec_expand(const char *in)
+{
+	static struct outbuf ob;
+	struct mce_cols c;
+	FILE *f = fopen(in, "r");
+	int ret;
+
+	if (!f || mcec_read_hdr(f)) {
+		fprintf(stderr, "%s: not a .mcec file\n", in);
+		return 1;
+	}
+	ob.fd = STDOUT_FILENO;
+	mce_cols_init(&c);
+	while ((ret = mcec_read_block(f, &c, MCEC_ALL)) > 0) {
+		size_t i;
+
+		for (i = 0; i < c.nr; i++) {
+			char *p = out_reserve(&ob, sizeof(struct mce));
+
+			mce_cols_get(&c, i, (struct mce *)p);
+			ob.len += sizeof(struct mce);
+		}
+	}
+	out_flush(&ob);
+	mce_cols_destroy(&c);
+	fclose(f);
+	if (ret < 0)
+		fprintf(stderr, "%s: corrupt block\n", in);
+	return ret < 0;
+}
+
+/* Round trip mces_seen[] and @nr synthetic records through a .mcec file */
+static int mcec_check(size_t nr)
+{
+	size_t total = nr + ARRAY_SIZE(mces_seen), i, done = 0;
+	struct mce *recs = malloc(total * sizeof(*recs));
+	struct mcec_writer w;
+	struct mce_cols c;
+	FILE *f = tmpfile();
+	int ret;
+
+	if (!recs || !f) {
+		perror("mcec_check");
+		return 1;
+	}
+	mce_gen(recs, total, 0);
+	/* long runs and monotonic timestamps, as in real logs */
+	for (i = total / 2; i < total; i++) {
+		recs[i].synd = recs[i].ipid = recs[i].kflags = 0;
+		recs[i].bank = 4;
+		recs[i].tsc = recs[i - 1].tsc + (i % 7) * 1000;
+		recs[i].time = 1698310858 + i / 100;
+	}
+
+	if (mcec_writer_open(&w, f) || mcec_writer_add(&w, recs, total) ||
+	    mcec_writer_close(&w)) {
+		perror("mcec_check");
+		return 1;
+	}
+
+	rewind(f);
+	mce_cols_init(&c);
+	ret = mcec_read_hdr(f);
+	while (!ret && (ret = mcec_read_block(f, &c, MCEC_ALL)) > 0) {
+		for (i = 0; i < c.nr; i++, done++) {
+			struct mce m, want = recs[done];
+			int field;
+
+			mce_cols_get(&c, i, &m);
+			/* compare field by field, padding is not stored */
+			for (field = 0; field < MCE_F_NR; field++) {
+				const struct mce_field_desc *d = &mce_fields[field];
+
+				if (memcmp((char *)&m + d->off, (char *)&want + d->off,
+					   d->size)) {
+					fprintf(stderr, "mcec: record %zu field %s differs\n",
+						done, d->name);
+					ret = -1;
+					goto out;
+				}
+			}
+		}
+		ret = 0;
+	}
+	if (!ret && done != total) {
+		fprintf(stderr, "mcec: %zu of %zu records read back\n", done, total);
+		ret = -1;
+	}
+out:
+	mce_cols_destroy(&c);
+	fclose(f);
+	free(recs);
+	if (ret)
+		return 1;
+	printf("mcec check: %zu records ok\n", total);
+	return 0;
+}
+
+/*
+ * Record filters.
+ *
+ * A filter is a conjunction of predicates on single fields, written as
+ *
+ *   status&0x8000000000000000,mcgstatus&4,bank=0|4|5,time=1698310000..1698320000
+ *
+ * "field&mask" wants all bits of mask set, "field=a|b|lo..hi" wants the
+ * field to be one of the values or in one of the inclusive ranges.  Every
+ * predicate is compiled to up to MCE_FILTER_TERMS terms that all have the
+ * same shape,
+ *
+ *   ((v & and) - lo) <= span	(unsigned, in the width of the field)
+ *
+ * so a single compare kernel per field width evaluates any predicate.
+ * Filters run column wise over struct mce_cols and produce a selection
+ * bitmap with one bit per record.  Words of the bitmap that an earlier
+ * predicate already cleared are skipped.
+ */
+#define MCE_FILTER_PREDS	16
+#define MCE_FILTER_TERMS	8
+
+struct mce_term {
+	__u64 and;
+	__u64 lo;
+	__u64 span;
+};
+
+struct mce_pred {
+	int field;
+	int nr;			/* 0: matches nothing */
+	struct mce_term t[MCE_FILTER_TERMS];
+};
+
+struct mce_filter {
+	int nr;
+	struct mce_pred pred[MCE_FILTER_PREDS];
+};
+
+static inline bool term_match(const struct mce_term *t, __u64 v)
+{
+	return ((v & t->and) - t->lo) <= t->span;
+}
+
+/*
+ * Add a term to @p, clipped to the width of the field: a term that cannot
+ * match any value of the field is dropped, so the narrow compare kernels
+ * can truncate and, lo and span without changing the result.
+ */
+static int pred_add(struct mce_pred *p, __u64 and, __u64 lo, __u64 hi)
+{
+	size_t size = mce_fields[p->field].size;
+	__u64 fmax = size < 8 ? (1ULL << (size * 8)) - 1 : ~0ULL;
+
+	if (p->nr == MCE_FILTER_TERMS)
+		return -E2BIG;
+	if (lo > fmax)
+		return 0;
+	if (hi > fmax)
+		hi = fmax;
+	p->t[p->nr++] = (struct mce_term){ and & fmax, lo, hi - lo };
+	return 0;
+}
+
+static int mce_filter_parse(struct mce_filter *flt, const char *expr)
+{
+	const char *s = expr;
+
+	memset(flt, 0, sizeof(*flt));
+	while (*s) {
+		struct mce_pred *p;
+		size_t len = strcspn(s, "&=");
+		char *end;
+		int field, ret;
+
+		for (field = 0; field < MCE_F_NR; field++)
+			if (strlen(mce_fields[field].name) == len &&
+			    !strncmp(mce_fields[field].name, s, len))
+				break;
+		if (field == MCE_F_NR || !s[len] || flt->nr == MCE_FILTER_PREDS)
+			return -EINVAL;
+
+		p = &flt->pred[flt->nr++];
+		p->field = field;
+		s += len;
+
+		if (*s++ == '&') {
+			__u64 mask = strtoull(s, &end, 0);
+
+			if (end == s)
+				return -EINVAL;
+			ret = pred_add(p, mask, mask, mask);
+			s = end;
+		} else {
+			for (;;) {
+				__u64 lo = strtoull(s, &end, 0), hi = lo;
+
+				if (end == s)
+					return -EINVAL;
+				s = end;
+				if (!strncmp(s, "..", 2)) {
+					s += 2;
+					hi = strtoull(s, &end, 0);
+					if (end == s || hi < lo)
+						return -EINVAL;
+					s = end;
+				}
+				ret = pred_add(p, ~0ULL, lo, hi);
+				if (ret || *s != '|')
+					break;
+				s++;	/* a value must follow */
+			}
+		}
+		if (ret)
+			return ret;
+		if (*s == ',' && s[1])
+			s++;
+		else if (*s)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/* Columns a filter reads, for mcec_read_block() */
+static unsigned long mce_filter_fields(const struct mce_filter *flt)
+{
+	unsigned long mask = 0;
+	int i;
+
+	for (i = 0; i < flt->nr; i++)
+		mask |= 1UL << flt->pred[i].field;
+	return mask;
+}
+
+/* Record at a time reference */
+static bool mce_filter_match(const struct mce_filter *flt, const struct mce *m)
+{
+	int i, j;
+
+	for (i = 0; i < flt->nr; i++) {
+		const struct mce_pred *p = &flt->pred[i];
+		const struct mce_field_desc *d = &mce_fields[p->field];
+		__u64 v = 0;
+
+		/* little endian: the low bytes of v */
+		memcpy(&v, (const char *)m + d->off, d->size);
+		for (j = 0; j < p->nr; j++)
+			if (term_match(&p->t[j], v))
+				break;
+		if (j == p->nr)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Column kernels: AND the matches of @p over @nr values of @col into @sel.
+ * The SIMD ones do whole 64 record words and leave the tail to the scalar
+ * one.
+ */
+typedef void (*filt_kernel_fn)(const void *col, size_t nr,
+			       const struct mce_pred *p, __u64 *sel);
+
+#define DEFINE_FILT_SCALAR(type)					\
+static void filt_scalar_##type(const void *col, size_t nr,		\
+			       const struct mce_pred *p, __u64 *sel)	\
+{									\
+	const type *v = col;						\
+	size_t w, i;							\
+	int j;								\
+									\
+	for (w = 0; w * 64 < nr; w++) {					\
+		size_t n = nr - w * 64 < 64 ? nr - w * 64 : 64;		\
+		__u64 m = 0;						\
+									\
+		if (!sel[w])						\
+			continue;					\
+		for (i = 0; i < n; i++) {				\
+			type x = v[w * 64 + i];				\
+									\
+			for (j = 0; j < p->nr; j++)			\
+				if ((type)((x & p->t[j].and) - p->t[j].lo) <= \
+				    (type)p->t[j].span) {		\
+					m |= 1ULL << i;			\
+					break;				\
+				}					\
+		}							\
+		sel[w] &= m;						\
+	}								\
+}
+
+DEFINE_FILT_SCALAR(__u8)
+DEFINE_FILT_SCALAR(__u32)
+DEFINE_FILT_SCALAR(__u64)
+
+#define FILT_TAIL(type, col, nr, p, sel)				\
+	do {								\
+		size_t __done = (nr) & ~63UL;				\
+									\
+		if (__done < (nr))					\
+			filt_scalar_##type((const type *)(col) + __done, \
+					   (nr) - __done, p,		\
+					   (sel) + __done / 64);	\
+	} while (0)
+
+__attribute__((target("avx2")))
+static void filt_avx2___u8(const void *col, size_t nr,
+			   const struct mce_pred *p, __u64 *sel)
+{
+	const __u8 *v = col;
+	size_t w;
+	int h, j;
+
+	for (w = 0; w < nr / 64; w++) {
+		__u64 m = 0;
+
+		if (!sel[w])
+			continue;
+		for (h = 0; h < 2; h++) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(v + w * 64 + h * 32));
+			__m256i hit = _mm256_setzero_si256();
+
+			for (j = 0; j < p->nr; j++) {
+				__m256i d = _mm256_sub_epi8(
+					_mm256_and_si256(x, _mm256_set1_epi8(p->t[j].and)),
+					_mm256_set1_epi8(p->t[j].lo));
+				__m256i s = _mm256_set1_epi8(p->t[j].span);
+
+				/* d <= s unsigned: min(d, s) == d */
+				hit = _mm256_or_si256(hit,
+					_mm256_cmpeq_epi8(_mm256_min_epu8(d, s), d));
+			}
+			m |= (__u64)(__u32)_mm256_movemask_epi8(hit) << (h * 32);
+		}
+		sel[w] &= m;
+	}
+	FILT_TAIL(__u8, col, nr, p, sel);
+}
+
+__attribute__((target("avx2")))
+static void filt_avx2___u32(const void *col, size_t nr,
+			    const struct mce_pred *p, __u64 *sel)
+{
+	const __u32 *v = col;
+	size_t w;
+	int q, j;
+
+	for (w = 0; w < nr / 64; w++) {
+		__u64 m = 0;
+
+		if (!sel[w])
+			continue;
+		for (q = 0; q < 8; q++) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(v + w * 64 + q * 8));
+			__m256i hit = _mm256_setzero_si256();
+
+			for (j = 0; j < p->nr; j++) {
+				__m256i d = _mm256_sub_epi32(
+					_mm256_and_si256(x, _mm256_set1_epi32(p->t[j].and)),
+					_mm256_set1_epi32(p->t[j].lo));
+				__m256i s = _mm256_set1_epi32(p->t[j].span);
+
+				hit = _mm256_or_si256(hit,
+					_mm256_cmpeq_epi32(_mm256_min_epu32(d, s), d));
+			}
+			m |= (__u64)_mm256_movemask_ps(_mm256_castsi256_ps(hit)) << (q * 8);
+		}
+		sel[w] &= m;
+	}
+	FILT_TAIL(__u32, col, nr, p, sel);
+}
+
+__attribute__((target("avx2")))
+static void filt_avx2___u64(const void *col, size_t nr,
+			    const struct mce_pred *p, __u64 *sel)
+{
+	const __u64 *v = col;
+	const __m256i sign = _mm256_set1_epi64x(1ULL << 63);
+	size_t w;
+	int q, j;
+
+	for (w = 0; w < nr / 64; w++) {
+		__u64 m = 0;
+
+		if (!sel[w])
+			continue;
+		for (q = 0; q < 16; q++) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(v + w * 64 + q * 4));
+			__m256i miss = _mm256_set1_epi64x(-1);
+
+			for (j = 0; j < p->nr; j++) {
+				__m256i d = _mm256_sub_epi64(
+					_mm256_and_si256(x, _mm256_set1_epi64x(p->t[j].and)),
+					_mm256_set1_epi64x(p->t[j].lo));
+				__m256i s = _mm256_set1_epi64x(p->t[j].span);
+
+				/* no unsigned 64-bit compare: flip the sign bits */
+				miss = _mm256_and_si256(miss, _mm256_cmpgt_epi64(
+					_mm256_xor_si256(d, sign), _mm256_xor_si256(s, sign)));
+			}
+			m |= (__u64)(~_mm256_movemask_pd(_mm256_castsi256_pd(miss)) & 0xf)
+				<< (q * 4);
+		}
+		sel[w] &= m;
+	}
+	FILT_TAIL(__u64, col, nr, p, sel);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void filt_avx512___u8(const void *col, size_t nr,
+			     const struct mce_pred *p, __u64 *sel)
+{
+	const __u8 *v = col;
+	size_t w;
+	int j;
+
+	for (w = 0; w < nr / 64; w++) {
+		__m512i x;
+		__mmask64 m = 0;
+
+		if (!sel[w])
+			continue;
+		x = _mm512_loadu_si512(v + w * 64);
+		for (j = 0; j < p->nr; j++)
+			m |= _mm512_cmple_epu8_mask(
+				_mm512_sub_epi8(
+					_mm512_and_si512(x, _mm512_set1_epi8(p->t[j].and)),
+					_mm512_set1_epi8(p->t[j].lo)),
+				_mm512_set1_epi8(p->t[j].span));
+		sel[w] &= m;
+	}
+	FILT_TAIL(__u8, col, nr, p, sel);
+}
+
+__attribute__((target("avx512f")))
+static void filt_avx512___u32(const void *col, size_t nr,
+			      const struct mce_pred *p, __u64 *sel)
+{
+	const __u32 *v = col;
+	size_t w;
+	int q, j;
+
+	for (w = 0; w < nr / 64; w++) {
+		__u64 m = 0;
+
+		if (!sel[w])
+			continue;
+		for (q = 0; q < 4; q++) {
+			__m512i x = _mm512_loadu_si512(v + w * 64 + q * 16);
+			__mmask16 k = 0;
+
+			for (j = 0; j < p->nr; j++)
+				k |= _mm512_cmple_epu32_mask(
+					_mm512_sub_epi32(
+						_mm512_and_si512(x, _mm512_set1_epi32(p->t[j].and)),
+						_mm512_set1_epi32(p->t[j].lo)),
+					_mm512_set1_epi32(p->t[j].span));
+			m |= (__u64)k << (q * 16);
+		}
+		sel[w] &= m;
+	}
+	FILT_TAIL(__u32, col, nr, p, sel);
+}
+
+__attribute__((target("avx512f")))
+static void filt_avx512___u64(const void *col, size_t nr,
+			      const struct mce_pred *p, __u64 *sel)
+{
+	const __u64 *v = col;
+	size_t w;
+	int q, j;
+
+	for (w = 0; w < nr / 64; w++) {
+		__u64 m = 0;
+
+		if (!sel[w])
+			continue;
+		for (q = 0; q < 8; q++) {
+			__m512i x = _mm512_loadu_si512(v + w * 64 + q * 8);
+			__mmask8 k = 0;
+
+			for (j = 0; j < p->nr; j++)
+				k |= _mm512_cmple_epu64_mask(
+					_mm512_sub_epi64(
+						_mm512_and_si512(x, _mm512_set1_epi64(p->t[j].and)),
+						_mm512_set1_epi64(p->t[j].lo)),
+					_mm512_set1_epi64(p->t[j].span));
+			m |= (__u64)k << (q * 8);
+		}
+		sel[w] &= m;
+	}
+	FILT_TAIL(__u64, col, nr, p, sel);
+}
+
+enum filt_impl {
+	FILT_SCALAR,
+	FILT_AVX2,
+	FILT_AVX512,
+	FILT_IMPL_NR,
+};
+
+static const char * const filt_impl_names[FILT_IMPL_NR] = {
+	"scalar", "avx2", "avx512",
+};
+
+/* Indexed by field size: 1, 4 and 8 bytes (struct mce has no 2 byte field) */
+static const filt_kernel_fn filt_kernels[FILT_IMPL_NR][3] = {
+	[FILT_SCALAR]	= { filt_scalar___u8, filt_scalar___u32, filt_scalar___u64 },
+	[FILT_AVX2]	= { filt_avx2___u8, filt_avx2___u32, filt_avx2___u64 },
+	[FILT_AVX512]	= { filt_avx512___u8, filt_avx512___u32, filt_avx512___u64 },
+};
+
+static bool filt_impl_supported(enum filt_impl impl)
+{
+	__builtin_cpu_init();
+	switch (impl) {
+	case FILT_AVX512:
+		return __builtin_cpu_supports("avx512f") &&
+		       __builtin_cpu_supports("avx512bw");
+	case FILT_AVX2:
+		return __builtin_cpu_supports("avx2");
+	default:
+		return true;
+	}
+}
+
+static enum filt_impl filt_impl_best(void)
+{
+	static int best = -1;
+
+	if (best < 0) {
+		best = FILT_IMPL_NR - 1;
+		while (!filt_impl_supported(best))
+			best--;
+	}
+	return best;
+}
+
+#define SEL_WORDS(nr)	(((nr) + 63) / 64)
+
+/*
+ * Evaluate @flt over the records in @c into @sel, SEL_WORDS(c->nr) words.
+ * The columns of mce_filter_fields() must be loaded.  Returns the number
+ * of selected records.
+ */
+static size_t mce_filter_cols(const struct mce_filter *flt, const struct mce_cols *c,
+			      __u64 *sel, enum filt_impl impl)
+{
+	size_t w, words = SEL_WORDS(c->nr), hits = 0;
+	int i;
+
+	memset(sel, 0xff, words * sizeof(*sel));
+	if (c->nr % 64)
+		sel[words - 1] = (1ULL << (c->nr % 64)) - 1;
+
+	for (i = 0; i < flt->nr; i++) {
+		const struct mce_pred *p = &flt->pred[i];
+		size_t size = mce_fields[p->field].size;
+
+		filt_kernels[impl][size == 1 ? 0 : size == 4 ? 1 : 2]
+			(c->col[p->field], c->nr, p, sel);
+	}
+
+	for (w = 0; w < words; w++)
+		hits += __builtin_popcountll(sel[w]);
+	return hits;
+}
+
+struct filter_ctx {
+	const struct mce_filter *flt;
+	struct decode_ctx dec;
+	struct mce_cols cols;
+	__u64 *sel;
+	__u64 hits;
+};
+
+/* Print the matching records of a batch, numbered by their input position */
+static void filter_batch(const struct mce *recs, size_t nr, void *arg)
+{
+	struct filter_ctx *ctx = arg;
+
+	while (nr) {
+		size_t n = nr < MCEC_BLOCK ? nr : MCEC_BLOCK, w;
+
+		ctx->cols.nr = 0;
+		mce_cols_append(&ctx->cols, recs, n, mce_filter_fields(ctx->flt));
+		ctx->hits += mce_filter_cols(ctx->flt, &ctx->cols, ctx->sel,
+					     filt_impl_best());
+
+		for (w = 0; w < SEL_WORDS(n); w++) {
+			__u64 bits = ctx->sel[w];
+
+			while (bits) {
+				size_t i = w * 64 + __builtin_ctzll(bits);
+
+				decode_one(&ctx->dec, &recs[i], ctx->dec.idx + i);
+				bits &= bits - 1;
+			}
+		}
+		ctx->dec.idx += n;
+		recs += n;
+		nr -= n;
+	}
+}
+
+static int filter_print(const char *expr, const char *path, struct outbuf *ob)
+{
+	struct mce_filter flt;
+	struct filter_ctx ctx = { .flt = &flt, .dec = { .ob = ob } };
+	int ret = 0;
+
+	if (mce_filter_parse(&flt, expr)) {
+		fprintf(stderr, "%s: bad filter\n", expr);
+		return 1;
+	}
+	ctx.sel = malloc(SEL_WORDS(MCEC_BLOCK) * sizeof(*ctx.sel));
+	if (!ctx.sel) {
+		perror("malloc");
+		return 1;
+	}
+	mce_cols_init(&ctx.cols);
+
+	if (path)
+		ret = mce_stream(path, filter_batch, &ctx);
+	else
+		filter_batch(mces_seen, ARRAY_SIZE(mces_seen), &ctx);
+
+	if (ob)
+		out_flush(ob);
+	fflush(stdout);
+	fprintf(stderr, "%llu of %lu records selected\n", ctx.hits, ctx.dec.idx);
+	mce_cols_destroy(&ctx.cols);
+	free(ctx.sel);
+	return ret ? 1 : 0;
+}
+
+/*
+ * Filter @nr synthetic records record by record and column wise with
+ * every supported kernel, check they agree, CSV out.
+ */
+static int filter_bench(size_t nr, const char *expr)
+{
+	struct mce *recs = malloc(nr * sizeof(*recs));
+	__u64 *ref = calloc(SEL_WORDS(nr), sizeof(*ref));
+	__u64 *sel = malloc(SEL_WORDS(nr) * sizeof(*sel));
+	struct mce_filter flt;
+	struct mce_cols c;
+	size_t i, hits = 0;
+	__u64 t0, t;
+	int impl, ret = 0;
+
+	if (!recs || !ref || !sel) {
+		perror("filter_bench");
+		return 1;
+	}
+	if (mce_filter_parse(&flt, expr)) {
+		fprintf(stderr, "%s: bad filter\n", expr);
+		return 1;
+	}
+	mce_gen(recs, nr, 0);
+	mce_cols_init(&c);
+	mce_cols_append(&c, recs, nr, mce_filter_fields(&flt));
+
+	printf("impl,records,ns,ns_per_record,selected\n");
+
+	t0 = now_ns();
+	for (i = 0; i < nr; i++)
+		if (mce_filter_match(&flt, &recs[i])) {
+			ref[i / 64] |= 1ULL << (i % 64);
+			hits++;
+		}
+	t = now_ns() - t0;
+	printf("record,%zu,%llu,%.2f,%zu\n", nr, t, (double)t / nr, hits);
+
+	for (impl = 0; impl < FILT_IMPL_NR; impl++) {
+		size_t n;
+
+		if (!filt_impl_supported(impl))
+			continue;
+		t0 = now_ns();
+		n = mce_filter_cols(&flt, &c, sel, impl);
+		t = now_ns() - t0;
+		printf("%s,%zu,%llu,%.2f,%zu\n", filt_impl_names[impl], nr, t,
+		       (double)t / nr, n);
+		if (n != hits || memcmp(sel, ref, SEL_WORDS(nr) * sizeof(*sel))) {
+			fprintf(stderr, "%s: selection differs from the reference\n",
+				filt_impl_names[impl]);
+			ret = 1;
+		}
+	}
+
+	mce_cols_destroy(&c);
+	free(recs);
+	free(ref);
+	free(sel);
+	return ret;
+}
+
+/* Count the records matching a filter, only the columns it needs are read */
+static int mcec_count(const char *in, const char *expr)
+{
+	struct mce_filter flt;
+	struct mce_cols c;
+	__u64 *sel, hits = 0, total = 0;
+	FILE *f;
+	int ret;
+
+	if (mce_filter_parse(&flt, expr)) {
+		fprintf(stderr, "%s: bad filter\n", expr);
+		return 1;
+	}
+	f = fopen(in, "r");
+	if (!f || mcec_read_hdr(f)) {
+		fprintf(stderr, "%s: not a .mcec file\n", in);
+		return 1;
+	}
+	sel = malloc(SEL_WORDS(MCEC_BLOCK) * sizeof(*sel));
+	if (!sel) {
+		perror("malloc");
+		return 1;
+	}
+	mce_cols_init(&c);
+	while ((ret = mcec_read_block(f, &c, mce_filter_fields(&flt))) > 0) {
+		hits += mce_filter_cols(&flt, &c, sel, filt_impl_best());
+		total += c.nr;
+	}
+	mce_cols_destroy(&c);
+	free(sel);
+	fclose(f);
+	if (ret < 0) {
+		fprintf(stderr, "%s: corrupt block\n", in);
+		return 1;
+	}
+	printf("%llu of %llu records\n", hits, total);
+	return 0;
+}
+
+/*
+ * Live ingestion.
+ *
+ * The reader (the main thread) only copies raw records from the source
+ * into a single producer/single consumer ring, reading no more than the
+ * ring has room for.  A FIFO or device is never left waiting for the
+ * consumer: when the ring is full the records are dropped and counted, so
+ * a slow terminal or a burst of formatting work cannot stall reading the
+ * source during an MCE storm.  A regular file keeps its records, there the
+ * reader waits for room instead.  The consumer thread formats and
+ * aggregates whatever is in the ring.
+ */
+#define INGEST_RING_SLOTS	4096
+
+struct mce_ring {
+	struct mce *slots;
+	size_t mask;
+
+	/* written by the producer */
+	__u64 head __attribute__((aligned(64)));
+	__u64 received;
+	__u64 dropped;
+	__u64 full;		/* pushes that found the ring full */
+	__u64 stalls;		/* waits for room, for sources that keep their data */
+	__u64 max_used;
+	bool done;
+	__u32 space_waiting;	/* futex, producer is (about to be) asleep */
+
+	/* written by the consumer */
+	__u64 tail __attribute__((aligned(64)));
+	__u64 head_cache;
+	__u64 consumed;
+	__u64 idle;		/* times the consumer slept on an empty ring */
+	__u32 waiting;		/* futex, consumer is (about to be) asleep */
+};
+
+static void mce_futex_wait(__u32 *uaddr, __u32 val)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/*
+ * Wake the other side if it sleeps on @waiting.  The fence pairs with the
+ * one the sleeper issues between setting @waiting and checking the ring
+ * again: either it sees our update or we see @waiting.
+ */
+static void mce_futex_wake(__u32 *waiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+		syscall(SYS_futex, waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static int mce_ring_init(struct mce_ring *r, size_t slots)
+{
+	size_t n = 1;
+
+	while (n < slots)
+		n <<= 1;
+	memset(r, 0, sizeof(*r));
+	r->slots = malloc(n * sizeof(*r->slots));
+	r->mask = n - 1;
+	return r->slots ? 0 : -ENOMEM;
+}
+
+/* Producer: free slots */
+static size_t mce_ring_room(struct mce_ring *r)
+{
+	return r->mask + 1 - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+/* Producer: sleep until there is room or mce_stream_stop, return the room */
+static size_t mce_ring_wait_room(struct mce_ring *r)
+{
+	size_t n;
+
+	while (!(n = mce_ring_room(r)) && !mce_stream_stop) {
+		__atomic_store_n(&r->space_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!mce_ring_room(r) && !mce_stream_stop) {
+			r->stalls++;
+			/* a signal ends the wait with EINTR */
+			mce_futex_wait(&r->space_waiting, 1);
+		}
+		__atomic_store_n(&r->space_waiting, 0, __ATOMIC_RELAXED);
+	}
+	return n;
+}
+
+/* Producer: queue as many of @recs as fit, return how many did */
+static size_t mce_ring_push(struct mce_ring *r, const struct mce *recs, size_t nr)
+{
+	size_t size = r->mask + 1, n, i;
+	__u64 head = r->head;
+	/* once per read() from the source, not per record */
+	__u64 tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	n = size - (head - tail);
+	if (n > nr)
+		n = nr;
+
+	for (i = 0; i < n; i++)
+		r->slots[(head + i) & r->mask] = recs[i];
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+
+	if (head + n - tail > r->max_used)
+		r->max_used = head + n - tail;
+	return n;
+}
+
+/* Consumer: records ready at the tail, contiguous up to the end of the ring */
+static size_t mce_ring_peek(struct mce_ring *r, const struct mce **recs)
+{
+	__u64 tail = r->tail;
+	size_t n, wrap;
+
+	if (tail == r->head_cache)
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	n = r->head_cache - tail;
+	wrap = r->mask + 1 - (tail & r->mask);
+	*recs = &r->slots[tail & r->mask];
+	return n < wrap ? n : wrap;
+}
+
+/* Consumer: hand @n slots back to the producer */
+static void mce_ring_release(struct mce_ring *r, size_t n)
+{
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+	mce_futex_wake(&r->space_waiting);
+}
+
+struct ingest_ctx {
+	struct mce_ring ring;
+	bool lossless;		/* the source keeps its data, wait instead of dropping */
+	struct decode_ctx dec;
+	struct agg agg[2];	/* by bank and by extcpu */
+};
+
+static void ingest_batch(const struct mce *recs, size_t nr, void *arg)
+{
+	struct mce_ring *r = &((struct ingest_ctx *)arg)->ring;
+	size_t n = mce_ring_push(r, recs, nr);
+
+	r->received += nr;
+	if (n)
+		mce_futex_wake(&r->waiting);
+	if (n < nr) {
+		r->dropped += nr - n;
+		r->full++;
+	}
+}
+
+static size_t ingest_room(void *arg)
+{
+	struct ingest_ctx *ctx = arg;
+
+	if (ctx->lossless)
+		return mce_ring_wait_room(&ctx->ring);
+	return mce_ring_room(&ctx->ring);
+}
+
+static void *ingest_consumer(void *arg)
+{
+	struct ingest_ctx *ctx = arg;
+	struct mce_ring *r = &ctx->ring;
+
+	for (;;) {
+		const struct mce *recs;
+		size_t n = mce_ring_peek(r, &recs), i;
+
+		if (!n) {
+			/* check done only after an empty peek, nothing is left behind */
+			if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) &&
+			    !mce_ring_peek(r, &recs))
+				break;
+
+			/* sleep until the producer pushes or is done */
+			__atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!mce_ring_peek(r, &recs) &&
+			    !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+				r->idle++;
+				mce_futex_wait(&r->waiting, 1);
+			}
+			__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			decode_one(&ctx->dec, &recs[i], ctx->dec.idx++);
+			agg_add(&ctx->agg[0], recs[i].bank, 1);
+			agg_add(&ctx->agg[1], recs[i].extcpu, 1);
+		}
+		mce_ring_release(r, n);
+		r->consumed += n;
+
+		/* live output, a slow stdout backs up into the ring */
+		if (ctx->dec.ob)
+			out_flush(ctx->dec.ob);
+		else
+			fflush(stdout);
+	}
+	return NULL;
+}
+
+static void ingest_signal(int sig)
+{
+	mce_stream_stop = 1;
+}
+
+static void ingest_report(struct ingest_ctx *ctx)
+{
+	static const char * const names[] = { "bank", "cpu" };
+	struct mce_ring *r = &ctx->ring;
+	int a;
+
+	fprintf(stderr, "received,consumed,dropped,ring_full,producer_stalls,max_used,slots,consumer_idle\n");
+	fprintf(stderr, "%llu,%llu,%llu,%llu,%llu,%llu,%zu,%llu\n",
+		r->received, r->consumed, r->dropped, r->full, r->stalls, r->max_used,
+		r->mask + 1, r->idle);
+
+	for (a = 0; a < 2; a++) {
+		struct agg *g = &ctx->agg[a];
+		struct agg_entry *e = malloc((g->nr + 1) * sizeof(*e));
+		size_t i, n = 0;
+
+		if (!e)
+			return;
+		for (i = 0; i <= g->mask; i++)
+			if (g->slots[i].count)
+				e[n++] = g->slots[i];
+		qsort(e, n, sizeof(*e), cmp_count);
+		for (i = 0; i < n && i < 5; i++)
+			fprintf(stderr, "%s,%llu,%llu\n", names[a], e[i].key, e[i].count);
+		free(e);
+	}
+}
+
+/*
+ * Tail raw records from @path (a FIFO, a file or "-") until EOF, or with
+ * @follow until SIGINT/SIGTERM.
+ */
+static int ingest(const char *path, size_t slots, bool follow, struct outbuf *ob)
+{
+	struct ingest_ctx *ctx = aligned_alloc(64, sizeof(*ctx));
+	struct sigaction sa = { .sa_handler = ingest_signal };
+	struct stat st;
+	sigset_t set, old;
+	pthread_t tid;
+	int fd, ret;
+
+	if (!ctx || mce_ring_init(&ctx->ring, slots)) {
+		perror("ingest");
+		return 1;
+	}
+	ctx->dec = (struct decode_ctx){ .ob = ob };
+	agg_init(&ctx->agg[0], 256);
+	agg_init(&ctx->agg[1], 1024);
+
+	/* no SA_RESTART: a signal gets the reader out of a blocking read() */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	/*
+	 * A regular file still has the records when the ring is full, drop
+	 * only what a FIFO or device would otherwise lose
+	 */
+	ctx->lossless = !fstat(fd, &st) && S_ISREG(st.st_mode);
+
+	/* signals go to the reader, the consumer keeps them blocked */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if (pthread_create(&tid, NULL, ingest_consumer, ctx)) {
+		perror("pthread_create");
+		return 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ret = mce_stream_fd(fd, ingest_batch, ctx,
+			    MCE_STREAM_LIVE | (follow ? MCE_STREAM_FOLLOW : 0),
+			    ingest_room);
+	__atomic_store_n(&ctx->ring.done, true, __ATOMIC_RELEASE);
+	mce_futex_wake(&ctx->ring.waiting);
+	pthread_join(tid, NULL);
+
+	ingest_report(ctx);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	agg_destroy(&ctx->agg[0]);
+	agg_destroy(&ctx->agg[1]);
+	free(ctx->ring.slots);
+	free(ctx);
+	return ret ? 1 : 0;
+}
+
+#define FILTER_EXAMPLE	"status&0x8000000000000000,mcgstatus&4,bank=0|4|5,time=1..0xffffffff"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-r] [file|-]   decode raw struct mce records\n"
+		"                          (built-in records without a file)\n"
+		"       %s -w file [-n N]  write N raw records\n"
+		"       %s -c N            check the formatter on N random records\n"
+		"       %s -b N            benchmark decoding N records\n"
+		"       %s -a [-j threads] [-k top] [-i secs] [-F tsc_mhz] [file|-]\n"
+		"                          count records by cpu, bank, socket, ppin\n"
+		"                          and page, error rates per time bucket\n"
+		"       %s -z out.mcec [file|-]  compress records into columns\n"
+		"       %s -Z in.mcec      expand columns to raw records on stdout\n"
+		"       %s -q filter in.mcec  count matching records\n"
+		"       %s -e filter [file|-]  decode matching records\n"
+		"       %s -B N [-e filter]    benchmark filtering N records\n"
+		"       %s -L file|- [-f] [-S slots]  decode records as they arrive\n"
+		"  -r  use the stdio reference formatter\n"
+		"  -R  with -w, write that many records per second\n"
+		"  -f  with -L, keep waiting at EOF until interrupted\n"
+		"  -F  bucket records without a time by tsc, as uptime\n"
+		"filter: comma separated field&mask (all bits set) or\n"
+		"        field=value|lo..hi|... predicates, e.g.\n"
+		"        %s\n",
+		prog, prog, prog, prog, prog, prog, prog, prog, prog, prog,
+		prog, FILTER_EXAMPLE);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct outbuf ob;
+	struct decode_ctx ctx = { .ob = &ob };
+	const char *dump = NULL, *mcec_out = NULL, *query = NULL, *filter = NULL;
+	size_t bench_nr = 0, slots = INGEST_RING_SLOTS;
+	const char *live = NULL;
+	unsigned long rate = 0;
+	bool follow = false;
+	size_t nr = ARRAY_SIZE(mces_seen);
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t top = 10;
+	__u64 interval = 3600, tsc_hz = 0;
+	bool analysis = false;
+	int opt, ret = 0;
+
+	/* one worker per CPU by default, sysconf() may fail */
+	if (threads < 1)
+		threads = 1;
+	else if (threads > ANALYZE_MAX_THREADS)
+		threads = ANALYZE_MAX_THREADS;
+
+	while ((opt = getopt(argc, argv, "rw:n:c:b:aj:k:i:F:z:Z:q:e:B:L:fS:R:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			ctx.ob = NULL;
+			break;
+		case 'a':
+			analysis = true;
+			break;
+		case 'j':
+			threads = strtol(optarg, NULL, 0);
+			if (threads < 1 || threads > ANALYZE_MAX_THREADS) {
+				fprintf(stderr, "-j %s: threads must be 1..%d\n",
+					optarg, ANALYZE_MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 'k':
+			top = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'F':
+			tsc_hz = strtoull(optarg, NULL, 0) * 1000000;
+			break;
+		case 'z':
+			mcec_out = optarg;
+			break;
+		case 'Z':
+			return mcec_expand(optarg);
+		case 'q':
+			query = optarg;
+			break;
+		case 'e':
+			filter = optarg;
+			break;
+		case 'B':
+			bench_nr = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			live = optarg;
+			break;
+		case 'f':
+			follow = true;
+			break;
+		case 'S':
+			slots = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			dump = optarg;
+			break;
+		case 'n':
+			nr = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			nr = strtoul(optarg, NULL, 0);
+			return self_check(nr) || mcec_check(nr);
+		case 'b':
+			return bench(strtoul(optarg, NULL, 0));
+		case 'h':
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (dump)
+		return write_dump(dump, nr, rate) ? 1 : 0;
+
+	if (live) {
+		ob.fd = STDOUT_FILENO;
+		return ingest(live, slots ? slots : 1, follow, ctx.ob);
+	}
+
+	if (bench_nr)
+		return filter_bench(bench_nr, filter ? filter : FILTER_EXAMPLE);
+
+	if (filter) {
+		ob.fd = STDOUT_FILENO;
+		return filter_print(filter, optind < argc ? argv[optind] : NULL, ctx.ob);
+	}
+
+	if (mcec_out)
+		return mcec_compress(mcec_out, optind < argc ? argv[optind] : NULL);
+
+	if (query) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		return mcec_count(argv[optind], query);
+	}
+
+	if (analysis) {
+		if (!interval) {
+			fprintf(stderr, "-i: the interval must be at least 1 second\n");
+			return 1;
+		}
+		return analyze(optind < argc ? argv[optind] : NULL, threads, top,
+			       interval, tsc_hz);
+	}
+
+	ob.fd = STDOUT_FILENO;
+	if (optind < argc)
+		ret = mce_stream(argv[optind], decode_batch, &ctx) ? 1 : 0;
+	else
+		decode_batch(mces_seen, ARRAY_SIZE(mces_seen), &ctx);
+
+	if (ctx.ob)
+		out_flush(&ob);
+	else
+		fflush(stdout);
+	return ret;
+}
@@ -1,3 +1,5 @@
+// gcc -Wall -g -o run_in_vm run_in_vm.c pagemap.c
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +7,8 @@
 #include <fcntl.h>
 #include <assert.h>
 
+#include "pagemap.h"
+
 #define DEFAULT_SLEEP (60)
 #define DEFAULT_SIZE (4096)
 
@@ -12,42 +16,6 @@
   asm volatile(".byte 0x66; clflush %0" : \
       "+m" (*(volatile char *)(addr)));
 
-/*
- * get information about address from /proc/self/pagemap
- */
-unsigned long long vtop(unsigned long long addr)
-{
-  static int pagesize;
-  unsigned long long pinfo;
-  long offset;
-  int fd;
-
-  if (pagesize == 0)
-    pagesize = getpagesize();
-
-  offset = addr / pagesize * (sizeof pinfo);
-
-  fd = open("/proc/self/pagemap", O_RDONLY);
-  if (fd == -1) {
-    perror("pagemap");
-    exit(1);
-  }
-
-  if (pread(fd, &pinfo, sizeof pinfo, offset) != sizeof pinfo) {
-    perror("pagemap");
-    exit(1);
-  }
-
-  close(fd);
-
-  if ((pinfo & (1ull << 63)) == 0) {
-    printf("page not present\n");
-    return ~0ull;
-  }
-
-  return ((pinfo & 0x007fffffffffffffull) * pagesize) + (addr & (pagesize - 1));
-}
-
 void malloc_free(unsigned int sec, size_t size)
 {
   void *ptr = malloc(size);
@@ -1,74 +1,677 @@
+// gcc -Wall -g -o test_mmap test_mmap.c pagemap.c -lpthread
+//
+// ./test_mmap          # base page
+// ./test_mmap -T       # transparent huge page
+// ./test_mmap -H 2M    # hugetlb page, needs /proc/sys/vm/nr_hugepages > 0
+// ./test_mmap -r 4G -t 8 [-T]  # contiguity and NUMA report of a 4G buffer
+// ./test_mmap -b 4G -t 8 [-T]  # compare the ways to pre-fault a 4G buffer
+
+#define _GNU_SOURCE
 #include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "pagemap.h"
+
+#define THP_SIZE	(2UL << 20)
+
+// Pagemap entries read by one pread() in report mode
+#define PAGEMAP_CHUNK	(64UL << 10)
+
+// Extent sizes are bucketed by power of 2, from 4K up to 1T
+#define EXTENT_BUCKETS	(41)
+
+#define MAX_NUMNODES	(1024)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23	/* since Linux 5.14 */
+#endif
+
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+
+enum backing {
+	BACKING_PAGE,	// base pages
+	BACKING_HUGETLB,	// MAP_HUGETLB, needs reserved huge pages
+	BACKING_THP,	// madvise(MADV_HUGEPAGE) on a 2M aligned range
+};
 
 static long pagesize;
+static size_t hugepage_size = 2UL << 20;
 
 /*
- * Convert a user mode virtual address belonging to the
- * current process to physical.
- * Does not handle huge pages.
+ * Map size bytes backed by the given kind of pages, a THP buffer is aligned
+ * to THP_SIZE. munmap(p, size) releases all of it. extra_flags are added to
+ * the mmap() flags, e.g. MAP_POPULATE, of base page and hugetlb buffers only:
+ * a THP buffer is mapped oversized, trimmed and only then madvised, so
+ * MAP_POPULATE would fault in base pages, including the 2M trimmed off.
  */
+static void *map_buffer(size_t size, enum backing backing, int extra_flags)
+{
+    int flags = MAP_SHARED|MAP_ANON;
+    size_t map_size = size;
+    char *p, *aligned;
+
+    if (backing == BACKING_HUGETLB)
+        flags |= MAP_HUGETLB | (__builtin_ctzl(hugepage_size) << MAP_HUGE_SHIFT);
+    // THP of shared anonymous memory depends on shmem_enabled, use private
+    if (backing == BACKING_THP) {
+        flags = MAP_PRIVATE|MAP_ANON;
+        map_size = size + THP_SIZE;
+        extra_flags &= ~MAP_POPULATE;
+    }
+
+    p = mmap(NULL, map_size, PROT_READ|PROT_WRITE, flags | extra_flags, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "cannot allocate memory: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    aligned = p;
+    if (backing == BACKING_THP) {
+        // Trim the mapping to start at a huge page boundary
+        aligned = (char *)(((unsigned long)p + THP_SIZE - 1) & ~(THP_SIZE - 1));
+        if (aligned > p)
+            munmap(p, aligned - p);
+        if (aligned + size < p + map_size)
+            munmap(aligned + size, p + map_size - (aligned + size));
+        if (madvise(aligned, size, MADV_HUGEPAGE))
+            fprintf(stderr, "madvise(MADV_HUGEPAGE): %s\n", strerror(errno));
+    }
+
+    return aligned;
+}
+
+static void *data_alloc(size_t size, enum backing backing)
+{
+    char *aligned = map_buffer(size, backing, 0);
+    int i;
+
+    srandom(getpid() * time(NULL));
+    for (i = 0; i < pagesize; i++)
+        aligned[i] = random();
+    return aligned;
+}
+
+static void show_help(char *program)
+{
+	fprintf(stderr, "\nUsage: %s [-H size | -T] [-r size | -b size] [-t threads]\n"
+		"\t-H size: back the buffer by hugetlb pages of size 2M or 1G\n"
+		"\t-T     : back the buffer by transparent huge pages\n"
+		"\t-r size: map size bytes (K/M/G suffix), fault them in and report\n"
+		"\t         the physically contiguous extents and their NUMA nodes\n"
+		"\t-b size: map size bytes and compare the ways to pre-fault them\n"
+		"\t-t threads: fault the pages in with this many threads\n"
+		"\t-h     : print this help\n\n",
+		program);
+}
+
 /*
- * get information about address from /proc/self/pagemap
+ * Parse a size like "4096", "512K", "64M" or "4G"
  */
-unsigned long long vtop(unsigned long long addr)
-{
-	static int pagesize;
-	unsigned long long pinfo;
-	long offset;
-	int fd;
-
-	if (pagesize == 0)
-		pagesize = getpagesize();
-	offset = addr / pagesize * (sizeof pinfo);
-	fd = open("/proc/self/pagemap", O_RDONLY);
-	if (fd == -1) {
-		perror("pagemap");
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		size <<= 10;
+		end++;
+	}
+
+	return *end ? 0 : size;
+}
+
+static double elapsed_ms(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+struct fault_work {
+	pthread_t tid;
+	char *start;
+	size_t len;
+	cpu_set_t *cpus;	// CPUs to run on, NULL to run anywhere
+};
+
+static void *fault_thread(void *arg)
+{
+	struct fault_work *w = arg;
+
+	if (w->cpus) {
+		errno = pthread_setaffinity_np(pthread_self(), sizeof(*w->cpus), w->cpus);
+		if (errno)
+			perror("pthread_setaffinity_np");
+	}
+
+	for (size_t off = 0; off < w->len; off += pagesize)
+		w->start[off] = 1;
+
+	return NULL;
+}
+
+/*
+ * Write one byte of every page with nr_threads threads, each one takes a
+ * contiguous part of the buffer. Return the time it took in ms.
+ */
+static double fault_pages(char *p, size_t size, int nr_threads)
+{
+	struct fault_work *work = calloc(nr_threads, sizeof(*work));
+	size_t pages = size / pagesize, per_thread = (pages + nr_threads - 1) / nr_threads;
+	struct timespec start, end;
+
+	if (!work) {
+		fprintf(stderr, "cannot allocate memory\n");
 		exit(1);
 	}
-	if (pread(fd, &pinfo, sizeof pinfo, offset) != sizeof pinfo) {
-		perror("pagemap");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nr_threads; i++) {
+		size_t first = i * per_thread;
+
+		work[i].start = p + first * pagesize;
+		work[i].len = first >= pages ? 0 :
+			(first + per_thread > pages ? pages - first : per_thread) * pagesize;
+		errno = pthread_create(&work[i].tid, NULL, fault_thread, &work[i]);
+		if (errno) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(work[i].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	free(work);
+	return elapsed_ms(&start, &end);
+}
+
+/*
+ * Physically contiguous run of pages of the buffer
+ */
+struct extent {
+	char *vaddr;
+	size_t pages;
+};
+
+/*
+ * Walk the pagemap of the buffer in PAGEMAP_CHUNK sized reads and merge the
+ * pages with consecutive PFNs into extents. Return the number of extents,
+ * -1 if the PFNs can't be seen.
+ */
+static long collect_extents(char *p, size_t size, struct extent **extents)
+{
+	size_t pages = size / pagesize, nr = 0, max = 1024;
+	uint64_t *pfns = malloc(PAGEMAP_CHUNK * sizeof(*pfns));
+	struct extent *ext = malloc(max * sizeof(*ext));
+	uint64_t prev = 0;
+	int seen_pfn = 0;
+
+	if (!pfns || !ext) {
+		fprintf(stderr, "cannot allocate memory\n");
 		exit(1);
 	}
-	close(fd);
-	if ((pinfo & (1ull << 63)) == 0) {
-		printf("page not present\n");
-		return ~0ull;
+
+	for (size_t done = 0; done < pages; done += PAGEMAP_CHUNK) {
+		size_t n = pages - done < PAGEMAP_CHUNK ? pages - done : PAGEMAP_CHUNK;
+
+		if (pagemap_read((unsigned long long)(p + done * pagesize), n, pfns)) {
+			perror("pagemap");
+			exit(1);
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			uint64_t pfn = pfns[i] & PM_PFN_MASK;
+
+			if (!(pfns[i] & PM_PRESENT)) {
+				// Not faulted in, it breaks the extent
+				prev = 0;
+				continue;
+			}
+			seen_pfn |= pfn != 0;
+
+			if (prev && pfn == prev + 1) {
+				ext[nr - 1].pages++;
+			} else {
+				if (nr == max) {
+					max *= 2;
+					ext = realloc(ext, max * sizeof(*ext));
+					if (!ext) {
+						fprintf(stderr, "cannot allocate memory\n");
+						exit(1);
+					}
+				}
+				ext[nr].vaddr = p + (done + i) * pagesize;
+				ext[nr].pages = 1;
+				nr++;
+			}
+			prev = pfn;
+		}
+	}
+
+	free(pfns);
+	*extents = ext;
+	if (!seen_pfn) {
+		free(ext);
+		return -1;
 	}
-	return ((pinfo & 0x007fffffffffffffull) * pagesize) + (addr & (pagesize - 1));
+	return nr;
 }
 
-static void *data_alloc(void)
+/*
+ * NUMA node of the first page of every extent, an extent doesn't cross
+ * nodes. move_pages() with no target nodes only queries, it's called
+ * directly so that we don't need libnuma.
+ */
+static void query_nodes(struct extent *ext, long nr, int *nodes)
 {
-    char    *p = mmap(NULL, pagesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
-    int i;
+	const long batch = 4096;
+	void *pages[batch];
 
-    if (p == NULL) {
-        fprintf(stderr, "cannot allocate memory\n");
-        exit(1);
-    }
-    srandom(getpid() * time(NULL));
-    for (i = 0; i < pagesize; i++)
-        p[i] = random();
-    return p + pagesize / 4;
+	for (long done = 0; done < nr; done += batch) {
+		long n = nr - done < batch ? nr - done : batch;
+
+		for (long i = 0; i < n; i++)
+			pages[i] = ext[done + i].vaddr;
+		if (syscall(SYS_move_pages, 0, n, pages, NULL, nodes + done, 0)) {
+			// No NUMA support, everything is on node 0
+			for (long i = 0; i < n; i++)
+				nodes[done + i] = 0;
+		}
+	}
+}
+
+/*
+ * Parse the cpulist of a NUMA node into set, return the number of CPUs,
+ * -1 if the node doesn't exist
+ */
+static int read_node_cpus(int node, cpu_set_t *set)
+{
+	char path[128], buf[4096], *p = buf;
+	FILE *fp;
+	int nr = 0;
+
+	snprintf(path, sizeof(path), SYSFS_NODE_DIR "/node%d/cpulist", node);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (!fgets(buf, sizeof(buf), fp))
+		buf[0] = '\0';
+	fclose(fp);
+
+	CPU_ZERO(set);
+	while (*p && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10), last = first;
+
+		if (end == p)
+			break;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++, nr++)
+			CPU_SET(cpu, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return nr;
 }
 
-int main()
+/*
+ * First-touch with the threads spread evenly over the NUMA nodes that have
+ * CPUs. Every node gets an equal part of the buffer, faulted in by threads
+ * bound to that node, so the default local policy puts the part on the
+ * node. Return the time it took in ms.
+ */
+static double fault_pages_numa(char *p, size_t size, int nr_threads, int *nr_nodes)
 {
-	void *vaddr = NULL;
+	static cpu_set_t node_cpus[MAX_NUMNODES];
+	size_t pages = size / pagesize, node_pages;
+	struct timespec start, end;
+	struct fault_work *work;
+	int nodes = 0, per_node, nr = 0;
+
+	for (int n = 0; n < MAX_NUMNODES; n++)
+		if (read_node_cpus(n, &node_cpus[nodes]) > 0)
+			nodes++;
+	// No NUMA in sysfs, one node with all the CPUs
+	if (!nodes) {
+		sched_getaffinity(0, sizeof(node_cpus[0]), &node_cpus[0]);
+		nodes = 1;
+	}
+	*nr_nodes = nodes;
+
+	per_node = nr_threads / nodes > 0 ? nr_threads / nodes : 1;
+	node_pages = (pages + nodes - 1) / nodes;
+	work = calloc(nodes * per_node, sizeof(*work));
+	if (!work) {
+		fprintf(stderr, "cannot allocate memory\n");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 0; n < nodes; n++) {
+		size_t node_first = n * node_pages;
+		size_t node_len = node_first >= pages ? 0 :
+			(node_first + node_pages > pages ? pages - node_first : node_pages);
+		size_t per_thread = (node_len + per_node - 1) / per_node;
+
+		for (int t = 0; t < per_node; t++, nr++) {
+			size_t first = t * per_thread;
+
+			work[nr].start = p + (node_first + first) * pagesize;
+			work[nr].len = first >= node_len ? 0 :
+				(first + per_thread > node_len ? node_len - first : per_thread) * pagesize;
+			work[nr].cpus = &node_cpus[n];
+			errno = pthread_create(&work[nr].tid, NULL, fault_thread, &work[nr]);
+			if (errno) {
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+	}
+	for (int i = 0; i < nr; i++)
+		pthread_join(work[i].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	free(work);
+	return elapsed_ms(&start, &end);
+}
+
+enum populate_method {
+	POPULATE_BYTE_LOOP,
+	POPULATE_MEMSET,
+	POPULATE_MAP_POPULATE,
+	POPULATE_MADVISE,
+	POPULATE_FIRST_TOUCH,
+	POPULATE_MAX,
+};
+
+static const char *populate_name[] = {
+	[POPULATE_BYTE_LOOP]    = "byte loop",
+	[POPULATE_MEMSET]       = "memset",
+	[POPULATE_MAP_POPULATE] = "MAP_POPULATE",
+	[POPULATE_MADVISE]      = "MADV_POPULATE_WRITE",
+	[POPULATE_FIRST_TOUCH]  = "NUMA first-touch",
+};
+
+/*
+ * Map a fresh buffer and populate it with the method, the time includes
+ * mmap() since that's where MAP_POPULATE does its work. Return the time
+ * in ms, -1 if the method isn't supported.
+ */
+static double populate(size_t size, enum backing backing, enum populate_method method,
+		       int nr_threads, int *nr_nodes)
+{
+	struct timespec start, end;
+	double ms = 0;
+	char *p;
+
+	// MAP_POPULATE can't populate THP, see map_buffer()
+	if (backing == BACKING_THP && method == POPULATE_MAP_POPULATE)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	p = map_buffer(size, backing, method == POPULATE_MAP_POPULATE ? MAP_POPULATE : 0);
+
+	switch (method) {
+	case POPULATE_BYTE_LOOP:
+		// volatile, or the compiler turns it into memset()
+		for (size_t i = 0; i < size; i++)
+			((volatile char *)p)[i] = i;
+		break;
+	case POPULATE_MEMSET:
+		memset(p, 0, size);
+		break;
+	case POPULATE_MAP_POPULATE:
+		break;
+	case POPULATE_MADVISE:
+		if (madvise(p, size, MADV_POPULATE_WRITE)) {
+			munmap(p, size);
+			return -1;
+		}
+		break;
+	case POPULATE_FIRST_TOUCH:
+		fault_pages_numa(p, size, nr_threads, nr_nodes);
+		break;
+	default:
+		break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = elapsed_ms(&start, &end);
+
+	munmap(p, size);
+	return ms;
+}
+
+static void populate_bench(size_t size, enum backing backing, int nr_threads)
+{
+	printf("Populate %zu MB, %s\n", size >> 20, backing == BACKING_HUGETLB ?
+		"hugetlb" : backing == BACKING_THP ? "thp" : "base pages");
+	printf("%-40s %10s %8s\n", "method", "ms", "GB/s");
+
+	for (int m = 0; m < POPULATE_MAX; m++) {
+		int nr_nodes = 0;
+		double ms = populate(size, backing, m, nr_threads, &nr_nodes);
+		char name[64];
+
+		if (m == POPULATE_FIRST_TOUCH)
+			snprintf(name, sizeof(name), "%s (%d nodes, %d threads)",
+				populate_name[m], nr_nodes, nr_threads);
+		else
+			snprintf(name, sizeof(name), "%s", populate_name[m]);
+
+		if (ms < 0)
+			printf("%-40s %10s %8s\n", name, "n/a", "n/a");
+		else
+			printf("%-40s %10.2f %8.2f\n", name, ms, size / ms / 1e6);
+	}
+}
+
+static void print_size(size_t bytes)
+{
+	if (bytes >= (1UL << 30))
+		printf("%6zu GB", bytes >> 30);
+	else if (bytes >= (1UL << 20))
+		printf("%6zu MB", bytes >> 20);
+	else
+		printf("%6zu kB", bytes >> 10);
+}
+
+/*
+ * Map size bytes, fault them in and report how fragmented the buffer is
+ * physically and which NUMA nodes it landed on
+ */
+static void contiguity_report(size_t size, enum backing backing, int nr_threads)
+{
+	size_t bucket_count[EXTENT_BUCKETS] = { 0 }, bucket_bytes[EXTENT_BUCKETS] = { 0 };
+	size_t node_extents[MAX_NUMNODES] = { 0 }, node_bytes[MAX_NUMNODES] = { 0 };
+	size_t largest = 0;
+	struct extent *ext;
+	double ms;
+	int *nodes;
+	long nr;
+	char *p;
+
+	p = data_alloc(size, backing);
+	ms = fault_pages(p, size, nr_threads);
+	printf("Mapped %zu MB, faulted in %.2f ms by %d threads (%.2f GB/s)\n",
+		size >> 20, ms, nr_threads, size / ms / 1e6);
+
+	nr = collect_extents(p, size, &ext);
+	if (nr < 0) {
+		printf("PFNs are hidden, run as root (CAP_SYS_ADMIN) to see them\n");
+		munmap(p, size);
+		return;
+	}
+
+	nodes = malloc(nr * sizeof(*nodes));
+	if (!nodes) {
+		fprintf(stderr, "cannot allocate memory\n");
+		exit(1);
+	}
+	query_nodes(ext, nr, nodes);
+
+	for (long i = 0; i < nr; i++) {
+		size_t bytes = ext[i].pages * pagesize;
+		int b = 63 - __builtin_clzl(bytes) - 12;
+		int node = nodes[i];
+
+		if (b >= EXTENT_BUCKETS)
+			b = EXTENT_BUCKETS - 1;
+		bucket_count[b]++;
+		bucket_bytes[b] += bytes;
+		if (bytes > largest)
+			largest = bytes;
+
+		// Negative status is -errno of a page we couldn't query
+		if (node < 0 || node >= MAX_NUMNODES)
+			continue;
+		node_extents[node]++;
+		node_bytes[node] += bytes;
+	}
+
+	printf("Physical extents: %ld, largest %zu kB, average %zu kB\n",
+		nr, largest >> 10, size / nr >> 10);
+	printf("%-20s %10s %9s %7s\n", "extent size", "extents", "total", "buffer");
+	for (int b = 0; b < EXTENT_BUCKETS; b++) {
+		if (!bucket_count[b])
+			continue;
+		printf("  >= ");
+		print_size(1UL << (b + 12));
+		printf("      %10zu ", bucket_count[b]);
+		print_size(bucket_bytes[b]);
+		printf(" %6.2f%%\n", 100.0 * bucket_bytes[b] / size);
+	}
+
+	printf("%-20s %10s %9s %7s\n", "NUMA node", "extents", "total", "buffer");
+	for (int n = 0; n < MAX_NUMNODES; n++) {
+		if (!node_extents[n])
+			continue;
+		printf("  %-18d %10zu ", n, node_extents[n]);
+		print_size(node_bytes[n]);
+		printf(" %6.2f%%\n", 100.0 * node_bytes[n] / size);
+	}
+
+	free(nodes);
+	free(ext);
+	munmap(p, size);
+}
+
+static void print_page_info(void *vaddr)
+{
+	struct page_info info;
+
+	if (vtop_page((unsigned long long)vaddr, &info)) {
+		printf("page info: %s\n", strerror(errno));
+		return;
+	}
+
+	printf("page size = %llu kB (%s)\n", info.page_size >> 10,
+		info.hugetlb ? "hugetlb" : info.thp ? "thp" : "base page");
+	printf("head vaddr = %llx paddr = %llx, extent = %llx-%llx",
+		info.head_vaddr, info.head_paddr, info.head_paddr,
+		info.head_paddr + info.page_size - 1);
+	if (info.kpageflags)
+		printf(" kpageflags = %llx", (unsigned long long)info.kpageflags);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	enum backing backing = BACKING_PAGE;
+	void *vaddr = NULL, *data = NULL;
 	long long paddr = 0;
+	size_t size, report_size = 0, bench_size = 0;
+	int nr_threads = 1;
+	int opt;
 
 	pagesize = getpagesize();
-	vaddr = data_alloc();
+	size = pagesize;
+
+	while ((opt = getopt(argc, argv, "b:hH:r:t:T")) != -1) {
+		switch (opt) {
+		case 'H':
+			backing = BACKING_HUGETLB;
+			if (!strcmp(optarg, "2M")) {
+				hugepage_size = 2UL << 20;
+			} else if (!strcmp(optarg, "1G")) {
+				hugepage_size = 1UL << 30;
+			} else {
+				fprintf(stderr, "Error: huge page size must be 2M or 1G.\n");
+				exit(EXIT_FAILURE);
+			}
+			size = hugepage_size;
+			break;
+		case 'r':
+			report_size = parse_size(optarg);
+			if (report_size < (size_t)pagesize) {
+				fprintf(stderr, "Error: invalid size \"%s\".\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			bench_size = parse_size(optarg);
+			if (bench_size < (size_t)pagesize) {
+				fprintf(stderr, "Error: invalid size \"%s\".\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1) {
+				fprintf(stderr, "Error: invalid number of threads.\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			backing = BACKING_THP;
+			size = THP_SIZE;
+			break;
+		case 'h':
+		default: /* '?' */
+			show_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	// Whole huge pages only
+	if (backing != BACKING_PAGE) {
+		size_t align = backing == BACKING_HUGETLB ? hugepage_size : THP_SIZE;
+
+		report_size = (report_size + align - 1) & ~(align - 1);
+		bench_size = (bench_size + align - 1) & ~(align - 1);
+	}
+
+	if (report_size) {
+		contiguity_report(report_size, backing, nr_threads);
+		return 0;
+	}
+	if (bench_size) {
+		populate_bench(bench_size, backing, nr_threads);
+		return 0;
+	}
+
+	data = data_alloc(size, backing);
+	vaddr = data + pagesize / 4;
 	paddr = vtop((long long)vaddr);
 
 	printf("vaddr = %p paddr = %llx\n", vaddr, paddr);
-	munmap(vaddr, pagesize);
+	print_page_info(vaddr);
+	munmap(data, size);
 
 	return 0;
 }